@@ -0,0 +1,247 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "loader.h"
+#include "tile.h"
+#include "tilefactory.h"
+#include "visibleset.h"
+
+// Offline, with an empty cache, so nothing is downloaded or decoded.
+// Once the cache is indexed no work is queued for the tiles.
+static Loader & make_offline()
+{
+    static Loader loader(false, false, 19, "", "", "./bench-cache/");
+    while (!loader.indexed()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return loader;
+}
+
+static Loader & offline()
+{
+    static Loader & loader = make_offline();
+    return loader;
+}
+
+static const uint16_t bits = 9;
+
+// Quad-tree co-ordinates near the middle of the map
+static const uint64_t centre = uint64_t(1) << 63;
+
+// Fill the factory with population tiles, from zoom 20 so that they
+// are out of the way of the tiles being looked up
+static void populate(size_t population)
+{
+    TileFactory * factory = TileFactory::instance();
+    factory->clear();
+    Loader & loader = offline();
+    for (uint64_t i = 0; factory->size() < population; ++i) {
+        factory->get_tile(loader, 20, i % 1024, i / 1024);
+    }
+}
+
+// Tiles of a square grid at zoom, to look up repeatedly
+static std::vector<Tile *> grid(uint16_t zoom, uint64_t side)
+{
+    std::vector<Tile *> tiles;
+    const uint64_t origin = zoom ? centre >> (64 - zoom) : 0;
+    const uint64_t mask = (uint64_t(1) << zoom) - 1;
+    for (uint64_t j = 0; j < side; ++j) {
+        for (uint64_t i = 0; i < side; ++i) {
+            tiles.push_back(TileFactory::instance()->get_tile(offline(), zoom, (origin + i) & mask, (origin + j) & mask));
+        }
+    }
+    return tiles;
+}
+
+static void BM_TileKey(benchmark::State & state)
+{
+    const uint16_t zoom = state.range(0);
+    const uint64_t x = zoom ? centre >> (64 - zoom) : 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(TileFactory::tile_key(zoom, x, x));
+    }
+}
+BENCHMARK(BM_TileKey)->Arg(0)->Arg(10)->Arg(19);
+
+static void BM_GetFilename(benchmark::State & state)
+{
+    const bool tms = state.range(0);
+    const bool zxy = state.range(1);
+    const Tile tile(17, centre >> 47, centre >> 47, 0);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tile.get_filename(tms, zxy, ".png"));
+    }
+}
+BENCHMARK(BM_GetFilename)->ArgsProduct({{0, 1}, {0, 1}});
+
+// Lookup of tiles already in the factory: zoom, cache population
+static void BM_GetTile(benchmark::State & state)
+{
+    populate(state.range(1));
+    const std::vector<Tile *> tiles = grid(state.range(0), 8);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        const Tile * t = tiles[i++ % tiles.size()];
+        benchmark::DoNotOptimize(TileFactory::instance()->get_tile(offline(), t->zoom, t->x, t->y));
+    }
+    state.counters["population"] = TileFactory::instance()->size();
+}
+BENCHMARK(BM_GetTile)->ArgsProduct({{2, 10, 19}, {0, 10000, 100000}});
+
+static void BM_GetTileAt(benchmark::State & state)
+{
+    populate(state.range(1));
+    const uint16_t zoom = state.range(0);
+    const std::vector<Tile *> tiles = grid(zoom, 8);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        const Tile * t = tiles[i++ % tiles.size()];
+        benchmark::DoNotOptimize(TileFactory::instance()->get_tile_at(offline(), zoom, t->x << (64 - zoom), t->y << (64 - zoom)));
+    }
+    state.counters["population"] = TileFactory::instance()->size();
+}
+BENCHMARK(BM_GetTileAt)->ArgsProduct({{2, 10, 19}, {0, 10000, 100000}});
+
+// Creation of a new tile, including the cache check of the loader
+static void BM_GetTileNew(benchmark::State & state)
+{
+    populate(state.range(0));
+    uint64_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(TileFactory::instance()->get_tile(offline(), 18, i % 4096, 100000 + i / 4096));
+        ++i;
+    }
+}
+BENCHMARK(BM_GetTileNew)->Arg(0)->Arg(100000);
+
+static void BM_TileGet(benchmark::State & state)
+{
+    populate(state.range(1));
+    std::vector<Tile *> tiles = grid(state.range(0), 8);
+    Tile * tile = tiles[tiles.size()/2];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tile->get(offline(), 1, 1));
+    }
+}
+BENCHMARK(BM_TileGet)->ArgsProduct({{10, 19}, {0, 100000}});
+
+// East, north, west and south again, back where it started
+static void BM_Neighbours(benchmark::State & state)
+{
+    populate(state.range(1));
+    std::vector<Tile *> tiles = grid(state.range(0), 8);
+    Tile * tile = tiles[tiles.size()/2];
+    for (auto _ : state) {
+        Tile * t = tile->get_east(offline())->get_north(offline())->get_west(offline())->get_south(offline());
+        benchmark::DoNotOptimize(t);
+    }
+}
+BENCHMARK(BM_Neighbours)->ArgsProduct({{10, 19}, {0, 100000}});
+
+// All the way up to the root, as when nothing is loaded
+static void BM_GetParentUV(benchmark::State & state)
+{
+    populate(state.range(1));
+    std::vector<Tile *> tiles = grid(state.range(0), 1);
+    for (auto _ : state) {
+        float minUV[2] = { 0.0f, 0.0f };
+        float maxUV[2] = { 1.0f, 1.0f };
+        const Tile * t = tiles[0];
+        while (t) {
+            t = t->get_parent(offline(), minUV, maxUV);
+        }
+        benchmark::DoNotOptimize(minUV);
+    }
+}
+BENCHMARK(BM_GetParentUV)->ArgsProduct({{10, 19}, {0, 100000}});
+
+static void BM_VisibleBounds(benchmark::State & state)
+{
+    const uint64_t width = state.range(0);
+    const uint64_t height = state.range(1);
+    const uint16_t zoom = state.range(2);
+    uint64_t tile[2];
+    uint64_t size[2];
+    for (auto _ : state) {
+        visibleBounds(width, height, bits, zoom, centre, centre, tile, size);
+        benchmark::DoNotOptimize(tile);
+        benchmark::DoNotOptimize(size);
+    }
+}
+BENCHMARK(BM_VisibleBounds)->Args({1024, 768, 10})->Args({3840, 2160, 17});
+
+// The tile selection of drawTiles: the visible set of a window panning
+// one tile column per frame, resolving ancestors as nothing is loaded.
+// Window width, height, zoom and cache population.
+static void BM_VisibleSetPan(benchmark::State & state)
+{
+    populate(state.range(3));
+    const uint64_t width = state.range(0);
+    const uint64_t height = state.range(1);
+    const uint16_t zoom = state.range(2);
+
+    VisibleSet visible;
+    uint64_t x = centre;
+    uint64_t tile[2];
+    uint64_t size[2];
+    for (auto _ : state) {
+        x += uint64_t(1) << (64 - zoom);
+        visibleBounds(width, height, bits, zoom, x, centre, tile, size);
+        benchmark::DoNotOptimize(visible.update(offline(), zoom, tile, size));
+    }
+    state.counters["tiles"] = visible.tiles().size();
+}
+BENCHMARK(BM_VisibleSetPan)
+    ->Args({1024, 768, 10, 0})
+    ->Args({1024, 768, 17, 0})
+    ->Args({3840, 2160, 17, 0})
+    ->Args({3840, 2160, 17, 100000});
+
+// A window that has not moved, the common case
+static void BM_VisibleSetStill(benchmark::State & state)
+{
+    populate(0);
+    const uint16_t zoom = state.range(2);
+
+    VisibleSet visible;
+    uint64_t tile[2];
+    uint64_t size[2];
+    visibleBounds(state.range(0), state.range(1), bits, zoom, centre, centre, tile, size);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(visible.update(offline(), zoom, tile, size));
+    }
+}
+BENCHMARK(BM_VisibleSetStill)->Args({1024, 768, 17})->Args({3840, 2160, 17});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,49 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <GL/glew.h>
+
+// The tile code only creates and fills textures, which the benchmarks
+// never draw.  No-op stand-ins avoid the need for a GL context.
+
+extern "C" {
+
+void GLAPIENTRY glGenTextures(GLsizei n, GLuint * textures)
+{
+    static GLuint next = 1;
+    for (GLsizei i = 0; i < n; ++i) {
+        textures[i] = next++;
+    }
+}
+
+void GLAPIENTRY glDeleteTextures(GLsizei, const GLuint *) {}
+void GLAPIENTRY glBindTexture(GLenum, GLuint) {}
+void GLAPIENTRY glPixelStorei(GLenum, GLint) {}
+void GLAPIENTRY glTexParameteri(GLenum, GLenum, GLint) {}
+void GLAPIENTRY glTexImage2D(GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const void *) {}
+
+// An entry point GLEW looks up at run time
+PFNGLCOMPRESSEDTEXIMAGE2DPROC __glewCompressedTexImage2D = nullptr;
+
+}
@@ -0,0 +1,435 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <GL/glew.h>
+
+#include "batch.h"
+#include "geo.h"
+#include "loader.h"
+#include "offscreen.h"
+#include "pacer.h"
+#include "pngwriter.h"
+#include "render.h"
+#include "tile.h"
+#include "tilefactory.h"
+
+// Largest chunk drawn at once, and memory for the rows of a band
+static const uint32_t maxChunk  = 1024;
+static const size_t   bandBytes = size_t(16) << 20;
+
+struct BatchRenderer::Job
+{
+    std::string filename;
+    uint32_t    width = 0;
+    uint32_t    height = 0;
+    uint64_t    x = 0;          // centre
+    uint64_t    y = 0;
+    double      zoom = 0.0;
+
+    // Top left of the chunk being drawn, and its size
+    uint32_t    row = 0;
+    uint32_t    column = 0;
+    uint32_t    chunkWidth = 0;
+    uint32_t    chunkHeight = 0;
+
+    // Band being drawn, and the band being compressed
+    std::vector<uint8_t> band;
+    std::vector<uint8_t> encoding;
+    std::future<bool>    encoded;
+
+    PngWriter   png;
+    View        view;
+
+    double      started = 0.0;
+    double      seconds = 0.0;
+    bool        ok = true;
+    bool        complete = true;    // every tile was loaded in time
+};
+
+BatchRenderer::BatchRenderer()
+: m_chunk(maxChunk), m_timeout(60.0), m_elapsed(0.0), m_evicted(0)
+{
+    // Seconds to wait for the tiles of a chunk, before drawing what there is
+    if (const char * timeout = std::getenv("SLIPPYMAP_RENDER_TIMEOUT"))
+    {
+        m_timeout = std::atof(timeout);
+    }
+}
+
+BatchRenderer::~BatchRenderer()
+{
+}
+
+bool BatchRenderer::open(const std::string & filename, const std::string & dir)
+{
+    std::ifstream is(filename.c_str());
+    if (!is)
+    {
+        std::cerr << "Could not read " << filename << std::endl;
+        return false;
+    }
+
+    if (!dir.empty())
+    {
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(dir, ec);
+    }
+
+    std::string line;
+    while (std::getline(is, line))
+    {
+        std::stringstream ss(line);
+        std::string name;
+        if (!(ss >> name) || name[0] == '#')
+        {
+            continue;
+        }
+
+        std::unique_ptr<Job> job(new Job());
+        job->filename = dir.empty() ? name : (boost::filesystem::path(dir) / name).string();
+
+        std::vector<double> values;
+        double value;
+        while (ss >> value)
+        {
+            values.push_back(value);
+        }
+
+        if (values.size() == 5 && values[0] >= 1 && values[1] >= 1)
+        {
+            // Centre latitude and longitude, and zoom
+            job->x = longitude_to_x(values[3]);
+            job->y = latitude_to_y(values[2]);
+            job->zoom = values[4];
+        }
+        else if (values.size() == 6 && values[0] >= 1 && values[1] >= 1 && values[2] < values[4] && values[3] < values[5])
+        {
+            // West, south, east and north, to fit
+            const uint64_t west  = longitude_to_x(values[2]);
+            const uint64_t south = latitude_to_y(values[3]);
+            const uint64_t east  = longitude_to_x(values[4]);
+            const uint64_t north = latitude_to_y(values[5]);
+            job->x = west  + (east  - west )/2;
+            job->y = south + (north - south)/2;
+
+            // Units per pixel at zoom z are 2^(64-bits-z)
+            const double units = std::max(double(east - west)/values[0], double(north - south)/values[1]);
+            job->zoom = 64 - bits - std::log2(std::max(units, 1.0));
+        }
+        else
+        {
+            std::cerr << "Could not parse job: " << line << std::endl;
+            continue;
+        }
+
+        job->width  = uint32_t(values[0]);
+        job->height = uint32_t(values[1]);
+        job->zoom   = std::max(0.0, std::min(19.0, job->zoom));
+        m_jobs.push_back(std::move(job));
+    }
+
+    return true;
+}
+
+bool BatchRenderer::start(Job & job)
+{
+    job.started = FramePacer::now();
+    job.row = 0;
+    job.column = 0;
+    job.chunkHeight = 0;
+
+    if (!job.png.open(job.filename, job.width, job.height))
+    {
+        job.ok = false;
+        return false;
+    }
+
+    // A whole band of chunks, unless the image is very wide
+    const uint32_t rows = uint32_t(std::max<size_t>(16, bandBytes/(size_t(job.width)*3)));
+    job.chunkHeight = std::min(std::min(m_chunk, rows), job.height);
+    job.band.assign(size_t(job.width)*job.chunkHeight*3, 0);
+
+    job.view.follow = false;
+    job.view.orient = false;
+    job.view.player = player_state;
+    job.view.player.zoom = job.zoom;
+
+    return true;
+}
+
+void BatchRenderer::place(Job & job)
+{
+    job.chunkWidth = std::min(m_chunk, job.width - job.column);
+
+    // Centre of the chunk, from the centre of the image, y northward
+    const double units = std::ldexp(1.0, 64 - bits)/std::pow(2.0, job.zoom);
+    const double dx = (job.column + job.chunkWidth/2.0 - job.width/2.0)*units;
+    const double dy = (job.height/2.0 - job.row - job.chunkHeight/2.0)*units;
+    job.view.player.x = job.x + uint64_t(int64_t(std::llround(dx)));
+    job.view.player.y = job.y + uint64_t(int64_t(std::llround(dy)));
+
+    // Nothing carried over from the previous chunk, whose tiles may be gone
+    job.view.basemapVisible.clear();
+    job.view.blendVisible.clear();
+
+    window_state.width  = job.chunkWidth;
+    window_state.height = job.chunkHeight;
+    window_state.scale  = 1.0;
+    update_view(job.view);
+}
+
+void BatchRenderer::settle(const std::vector<Job *> & active)
+{
+    const double deadline = FramePacer::now() + m_timeout;
+
+    size_t uploaded;
+    do
+    {
+        while (!Loader::idle() && FramePacer::now() < deadline)
+        {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+
+        // Newly loaded tiles may need their ancestors no longer
+        uploaded = basemap.upload_images();
+        for (Job * job : active)
+        {
+            window_state.width  = job->chunkWidth;
+            window_state.height = job->chunkHeight;
+            update_view(job->view);
+        }
+    }
+    while ((uploaded || !Loader::idle()) && FramePacer::now() < deadline);
+
+    if (!Loader::idle())
+    {
+        for (Job * job : active)
+        {
+            job->complete = false;
+        }
+    }
+}
+
+void BatchRenderer::evict()
+{
+    // All but the tiles of the chunks about to be drawn, and the ancestors
+    // drawn in their place, once the loader is done with them
+    m_evicted += TileFactory::instance()->collect(basemap, 0, SIZE_MAX);
+}
+
+void BatchRenderer::draw(Job & job)
+{
+    window_state.width  = job.chunkWidth;
+    window_state.height = job.chunkHeight;
+    render_view(job.view);
+
+    // RGBA from the bottom up, to RGB rows of the band from the top down
+    std::vector<uint8_t> pixels;
+    Offscreen::read(job.chunkWidth, job.chunkHeight, pixels);
+    for (uint32_t j = 0; j < job.chunkHeight; ++j)
+    {
+        const uint8_t * src = pixels.data() + size_t(job.chunkHeight - 1 - j)*job.chunkWidth*4;
+        uint8_t * dst = job.band.data() + (size_t(j)*job.width + job.column)*3;
+        for (uint32_t i = 0; i < job.chunkWidth; ++i)
+        {
+            dst[i*3 + 0] = src[i*4 + 0];
+            dst[i*3 + 1] = src[i*4 + 1];
+            dst[i*3 + 2] = src[i*4 + 2];
+        }
+    }
+}
+
+bool BatchRenderer::advance(Job & job)
+{
+    job.column += job.chunkWidth;
+    if (job.column < job.width)
+    {
+        return false;
+    }
+
+    // The band is drawn, compress it once the previous one is written
+    if (job.encoded.valid() && !job.encoded.get())
+    {
+        job.ok = false;
+    }
+    job.encoding.swap(job.band);
+    const uint32_t rows = job.chunkHeight;
+    Job * j = &job;
+    job.encoded = std::async(std::launch::async, [j, rows]() { return j->png.write(j->encoding.data(), rows); });
+
+    job.column = 0;
+    job.row += rows;
+    if (job.row < job.height)
+    {
+        job.chunkHeight = std::min(job.chunkHeight, job.height - job.row);
+        job.band.resize(size_t(job.width)*job.chunkHeight*3);
+        return false;
+    }
+
+    // The last band
+    if (!job.encoded.get())
+    {
+        job.ok = false;
+    }
+    if (!job.png.close())
+    {
+        job.ok = false;
+    }
+    job.band.clear();
+    job.band.shrink_to_fit();
+    job.encoding.clear();
+    job.encoding.shrink_to_fit();
+    job.view.basemapVisible.clear();
+    job.view.blendVisible.clear();
+    job.seconds = FramePacer::now() - job.started;
+
+    std::cout << job.filename << " " << job.width << "x" << job.height << " zoom " << job.zoom
+              << ", " << job.seconds << " s" << (job.ok ? "" : ", failed") << (job.complete ? "" : ", incomplete") << std::endl;
+
+    return true;
+}
+
+size_t BatchRenderer::run(size_t concurrency)
+{
+    // No larger than the framebuffer or viewport allow
+    GLint dims[2] = { 0, 0 };
+    GLint renderbuffer = 0;
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, dims);
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &renderbuffer);
+    for (GLint limit : { dims[0], dims[1], renderbuffer })
+    {
+        if (limit > 0)
+        {
+            m_chunk = std::min(m_chunk, uint32_t(limit));
+        }
+    }
+
+    Offscreen offscreen;
+    if (!offscreen.resize(m_chunk, m_chunk))
+    {
+        std::cerr << "Could not draw offscreen" << std::endl;
+        return 0;
+    }
+
+    // The imagery alone
+    player_state.grid    = false;
+    player_state.cross   = false;
+    player_state.scroll  = false;
+    player_state.vector  = false;
+    player_state.terrain = false;
+    player_state.blend   = false;
+    viewport_state = s_viewport_state();
+
+    const double started = FramePacer::now();
+
+    std::vector<Job *> active;
+    size_t next = 0;
+    size_t written = 0;
+    while (next < m_jobs.size() || !active.empty())
+    {
+        while (active.size() < std::max<size_t>(concurrency, 1) && next < m_jobs.size())
+        {
+            Job & job = *m_jobs[next++];
+            if (start(job))
+            {
+                active.push_back(&job);
+            }
+        }
+        if (active.empty())
+        {
+            continue;
+        }
+
+        // Request the tiles of the next chunk of each job together
+        for (Job * job : active)
+        {
+            place(*job);
+        }
+        evict();
+        settle(active);
+
+        offscreen.bind();
+        for (Job * job : active)
+        {
+            draw(*job);
+        }
+        offscreen.unbind();
+
+        for (size_t i = 0; i < active.size(); )
+        {
+            if (advance(*active[i]))
+            {
+                written += active[i]->ok;
+                active.erase(active.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+
+    m_elapsed = FramePacer::now() - started;
+    offscreen.release();
+
+    return written;
+}
+
+void BatchRenderer::summary(std::ostream & os) const
+{
+    size_t images = 0;
+    double pixels = 0.0;
+    std::vector<double> seconds;
+    for (const auto & job : m_jobs)
+    {
+        if (job->ok)
+        {
+            ++images;
+            pixels += double(job->width)*job->height;
+            seconds.push_back(job->seconds);
+        }
+    }
+    std::sort(seconds.begin(), seconds.end());
+
+    os << images << " of " << m_jobs.size() << " images in " << m_elapsed << " s, "
+       << (m_elapsed > 0.0 ? images/m_elapsed : 0.0) << " images/s, "
+       << (m_elapsed > 0.0 ? pixels/m_elapsed/1.0e6 : 0.0) << " megapixels/s";
+    if (!seconds.empty())
+    {
+        os << ", per image median " << seconds[seconds.size()/2] << " s, slowest " << seconds.back() << " s";
+    }
+    os << ", " << m_evicted << " tiles freed" << std::endl;
+}
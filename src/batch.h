@@ -0,0 +1,82 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief static maps drawn offscreen from a list of jobs
+ *
+ * Each line of the job file is an output PNG, its width and height in
+ * pixels, and either a centre and zoom or a bounding box to fit:
+ *
+ *     zurich.png 1024 768 47.3769 8.5417 14
+ *     poster.png 20000 14000 8.40 47.30 8.70 47.45
+ *
+ * Images are drawn with the same views and loaders as the window, in
+ * chunks no larger than the framebuffer, a band of rows at a time.
+ * Each band is compressed while the next is drawn, so an image of any
+ * size needs only a couple of bands of memory.  Several jobs are drawn
+ * at once so that their tiles are fetched and decoded together, and
+ * tiles no longer needed by any of them are freed as they go.
+ */
+class BatchRenderer
+{
+public:
+    BatchRenderer();
+    ~BatchRenderer();
+
+    // Read the jobs, outputs are written under dir
+    bool open(const std::string & filename, const std::string & dir);
+
+    // Draw every job, up to concurrency at a time, returns the number written
+    size_t run(size_t concurrency);
+
+    // Images per second, and the time each job took
+    void summary(std::ostream & os) const;
+
+private:
+    BatchRenderer(const BatchRenderer &) = delete;
+
+    struct Job;
+
+    std::vector<std::unique_ptr<Job>> m_jobs;
+    uint32_t m_chunk;       // widest and tallest chunk drawn
+    double   m_timeout;     // longest wait for the tiles of a chunk
+    double   m_elapsed;
+    uint64_t m_evicted;
+
+    bool start(Job & job);
+    void place(Job & job);
+    void settle(const std::vector<Job *> & active);
+    void evict();
+    void draw(Job & job);
+    bool advance(Job & job);
+};
@@ -0,0 +1,137 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "bc1.h"
+
+static inline uint16_t pack565(int r, int g, int b)
+{
+    return uint16_t(((r*31 + 127)/255) << 11 | ((g*63 + 127)/255) << 5 | ((b*31 + 127)/255));
+}
+
+static inline void unpack565(uint16_t c, int rgb[3])
+{
+    rgb[0] = ((c >> 11) & 31)*255/31;
+    rgb[1] = ((c >> 5) & 63)*255/63;
+    rgb[2] = (c & 31)*255/31;
+}
+
+// Endpoints at the corners of the bounding box along the diagonal the
+// colours lie on, pulled in a little, and each pixel the nearest of the four
+static void encode_block(const uint8_t pixels[16][3], uint8_t * out)
+{
+    int lo[3] = { 255, 255, 255 };
+    int hi[3] = { 0, 0, 0 };
+    int mean[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            lo[c] = std::min<int>(lo[c], pixels[i][c]);
+            hi[c] = std::max<int>(hi[c], pixels[i][c]);
+            mean[c] += pixels[i][c];
+        }
+    }
+
+    // Green varies most in practice, flip red and blue to its diagonal
+    int covRG = 0, covBG = 0;
+    for (int i = 0; i < 16; ++i) {
+        const int dg = pixels[i][1]*16 - mean[1];
+        covRG += (pixels[i][0]*16 - mean[0])*dg/16;
+        covBG += (pixels[i][2]*16 - mean[2])*dg/16;
+    }
+    if (covRG < 0) {
+        std::swap(lo[0], hi[0]);
+    }
+    if (covBG < 0) {
+        std::swap(lo[2], hi[2]);
+    }
+    for (int c = 0; c < 3; ++c) {
+        const int inset = (hi[c] - lo[c])/16;
+        hi[c] -= inset;
+        lo[c] += inset;
+    }
+
+    uint16_t c0 = pack565(hi[0], hi[1], hi[2]);
+    uint16_t c1 = pack565(lo[0], lo[1], lo[2]);
+    if (c0 < c1) {
+        std::swap(c0, c1);
+    }
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        int palette[4][3];
+        unpack565(c0, palette[0]);
+        unpack565(c1, palette[1]);
+        for (int c = 0; c < 3; ++c) {
+            palette[2][c] = (2*palette[0][c] + palette[1][c])/3;
+            palette[3][c] = (palette[0][c] + 2*palette[1][c])/3;
+        }
+        for (int i = 0; i < 16; ++i) {
+            int best = 0, bestError = 1 << 30;
+            for (int p = 0; p < 4; ++p) {
+                int error = 0;
+                for (int c = 0; c < 3; ++c) {
+                    const int d = pixels[i][c] - palette[p][c];
+                    error += d*d;
+                }
+                if (error < bestError) {
+                    best = p;
+                    bestError = error;
+                }
+            }
+            indices |= uint32_t(best) << (2*i);
+        }
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for (int i = 0; i < 4; ++i) {
+        out[4 + i] = uint8_t(indices >> (8*i));
+    }
+}
+
+void bc1_encode(const uint8_t * pixels, uint32_t width, uint32_t height, size_t pitch,
+                int bpp, int r, int g, int b, std::vector<uint8_t> & blocks)
+{
+    blocks.resize(size_t(width/4)*(height/4)*8);
+    uint8_t * out = blocks.data();
+    uint8_t block[16][3];
+    for (uint32_t y = 0; y < height; y += 4) {
+        for (uint32_t x = 0; x < width; x += 4) {
+            for (int j = 0; j < 4; ++j) {
+                const uint8_t * row = pixels + (y + j)*pitch + x*bpp;
+                for (int i = 0; i < 4; ++i) {
+                    block[j*4 + i][0] = row[i*bpp + r];
+                    block[j*4 + i][1] = row[i*bpp + g];
+                    block[j*4 + i][2] = row[i*bpp + b];
+                }
+            }
+            encode_block(block, out);
+            out += 8;
+        }
+    }
+}
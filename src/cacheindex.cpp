@@ -0,0 +1,584 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "cacheindex.h"
+
+// Manifest: "SMI2", a count, then sorted keys each with the size of the
+// file and when it was last used, all little endian.  "SMI1" has keys alone.
+static const char magic[4]  = { 'S', 'M', 'I', '2' };
+static const char magic1[4] = { 'S', 'M', 'I', '1' };
+
+static uint32_t now()
+{
+    return uint32_t(std::time(NULL));
+}
+
+CacheIndex::CacheIndex(const std::string & dir, const std::string & extension)
+: m_dir(dir), m_extension(extension), m_manifest(dir + ".index"), m_bytes(0),
+  m_maxBytes(0), m_maxTiles(0), m_evicted(0), m_evictedBytes(0),
+  m_ready(false), m_cancel(false), m_frozen(false)
+{
+}
+
+void CacheIndex::build()
+{
+    if (m_cancel) {
+        return;
+    }
+
+    // The manifest is enough to start with, the scan then adds
+    // anything written since it was saved
+    if (load()) {
+        m_ready = true;
+    }
+    scan();
+
+    if (!m_cancel) {
+        m_ready = true;
+    }
+}
+
+CacheIndex::State CacheIndex::find(uint16_t z, uint64_t a, uint64_t b) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_entries.count(key(z, a, b))) {
+        return PRESENT;
+    }
+    return m_ready ? ABSENT : UNKNOWN;
+}
+
+// With the mutex held
+void CacheIndex::add(uint64_t key, Entry entry)
+{
+    auto i = m_entries.emplace(key, entry);
+    if (!i.second) {
+        // Replaced, the old blocks stay with any links to them
+        unlink(key);
+        m_bytes -= i.first->second.bytes;
+        i.first->second = entry;
+    }
+    m_bytes += entry.bytes;
+}
+
+// With the mutex held
+void CacheIndex::drop(uint64_t key)
+{
+    auto i = m_entries.find(key);
+    if (i != m_entries.end()) {
+        unlink(key);
+        m_bytes -= i->second.bytes;
+        m_entries.erase(i);
+    }
+}
+
+// With the mutex held, out of its group of hard links.  The tile
+// counting the blocks hands them to another link, if there is one.
+void CacheIndex::unlink(uint64_t key)
+{
+    auto l = m_linkedTo.find(key);
+    if (l != m_linkedTo.end()) {
+        auto o = m_links.find(l->second);
+        o->second.erase(std::find(o->second.begin(), o->second.end(), key));
+        if (o->second.empty()) {
+            m_links.erase(o);
+        }
+        m_linkedTo.erase(l);
+        return;
+    }
+
+    auto o = m_links.find(key);
+    if (o == m_links.end()) {
+        return;
+    }
+    std::vector<uint64_t> links;
+    links.swap(o->second);
+    m_links.erase(o);
+
+    const uint64_t owner = links.front();
+    const uint32_t bytes = m_entries[key].bytes;
+    m_entries[owner].bytes = bytes;
+    m_bytes += bytes;
+    m_linkedTo.erase(owner);
+    links.erase(links.begin());
+    for (uint64_t k : links) {
+        m_linkedTo[k] = owner;
+    }
+    if (!links.empty()) {
+        m_links[owner].swap(links);
+    }
+}
+
+void CacheIndex::insert(uint16_t z, uint64_t a, uint64_t b, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_frozen) {
+        add(key(z, a, b), Entry{ uint32_t(std::min<uint64_t>(bytes, UINT32_MAX)), now() });
+    }
+}
+
+void CacheIndex::erase(uint16_t z, uint64_t a, uint64_t b)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_frozen) {
+        drop(key(z, a, b));
+    }
+}
+
+void CacheIndex::link(uint16_t z, uint64_t a, uint64_t b, uint64_t bytes, uint16_t z0, uint64_t a0, uint64_t b0)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_frozen) {
+        return;
+    }
+    const uint64_t k = key(z, a, b);
+    uint64_t owner = key(z0, a0, b0);
+    auto l = m_linkedTo.find(owner);
+    if (l != m_linkedTo.end()) {
+        owner = l->second;
+    }
+
+    // Collected since, so these are the only blocks now
+    if (owner == k || !m_entries.count(owner)) {
+        add(k, Entry{ uint32_t(std::min<uint64_t>(bytes, UINT32_MAX)), now() });
+        return;
+    }
+    add(k, Entry{ 0, now() });
+    m_linkedTo[k] = owner;
+    m_links[owner].push_back(k);
+}
+
+void CacheIndex::touch(uint16_t z, uint64_t a, uint64_t b)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_entries.find(key(z, a, b));
+    if (i != m_entries.end()) {
+        i->second.used = now();
+    }
+}
+
+size_t CacheIndex::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+uint64_t CacheIndex::bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+void CacheIndex::quota(uint64_t bytes, uint64_t tiles)
+{
+    m_maxBytes = bytes;
+    m_maxTiles = tiles;
+}
+
+void CacheIndex::sidecar(const std::string & suffix)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (std::find(m_sidecars.begin(), m_sidecars.end(), suffix) == m_sidecars.end()) {
+        m_sidecars.push_back(suffix);
+    }
+}
+
+void CacheIndex::pin(uint16_t z, uint64_t a0, uint64_t a1, uint64_t b0, uint64_t b1)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pins.push_back(Pin{ z, a0, a1, b0, b1 });
+}
+
+// With the mutex held
+bool CacheIndex::pinned(uint64_t key) const
+{
+    const uint16_t z = key >> 58;
+    const uint64_t mask = (uint64_t(1) << 29) - 1;
+    const uint64_t a = (key >> 29) & mask;
+    const uint64_t b = key & mask;
+    for (const Pin & p : m_pins) {
+        if (p.z == z && a >= p.a0 && a <= p.a1 && b >= p.b0 && b <= p.b1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t CacheIndex::collect(size_t limit)
+{
+    if (!m_ready || m_frozen || m_cancel || !limited() || !limit) {
+        return 0;
+    }
+
+    // Down to 90% of the quota, so removal happens now and then in
+    // batches rather than a tile for every tile fetched
+    const uint64_t maxBytes = m_maxBytes;
+    const uint64_t maxTiles = m_maxTiles;
+
+    std::vector<std::pair<uint64_t, Entry>> victims;
+    std::vector<std::string> sidecars;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        sidecars = m_sidecars;
+        const uint64_t tiles = m_entries.size();
+        uint64_t excessBytes = maxBytes && m_bytes > maxBytes ? m_bytes - maxBytes/10*9 : 0;
+        uint64_t excessTiles = maxTiles && tiles > maxTiles ? tiles - maxTiles/10*9 : 0;
+        if (!excessBytes && !excessTiles) {
+            return 0;
+        }
+
+        // The oldest few, by last use
+        std::vector<std::pair<uint32_t, uint64_t>> candidates;
+        candidates.reserve(tiles);
+        for (const auto & i : m_entries) {
+            if (!pinned(i.first)) {
+                candidates.emplace_back(i.second.used, i.first);
+            }
+        }
+        const size_t n = std::min(limit, candidates.size());
+        std::nth_element(candidates.begin(), candidates.begin() + n, candidates.end());
+        std::sort(candidates.begin(), candidates.begin() + n);
+
+        // Out of the index first, so nobody reads what is about to go
+        for (size_t i = 0; i < n && (excessBytes || excessTiles); ++i) {
+            // Blocks still linked elsewhere aren't freed
+            const uint64_t k = candidates[i].second;
+            Entry entry = m_entries[k];
+            if (m_links.count(k)) {
+                entry.bytes = 0;
+            }
+            victims.emplace_back(k, entry);
+            drop(k);
+            excessBytes -= std::min<uint64_t>(excessBytes, entry.bytes);
+            excessTiles -= std::min<uint64_t>(excessTiles, 1);
+        }
+    }
+
+    using namespace boost::filesystem;
+    const uint64_t mask = (uint64_t(1) << 29) - 1;
+    boost::system::error_code error;
+    for (const auto & v : victims) {
+        const path z = path(m_dir) / std::to_string(v.first >> 58);
+        const path a = z / std::to_string((v.first >> 29) & mask);
+        const std::string name = std::to_string(v.first & mask) + m_extension;
+        remove(a / name, error);
+        for (const std::string & suffix : sidecars) {
+            remove(a / (name + suffix), error);
+        }
+
+        // Fails unless empty
+        remove(a, error);
+        remove(z, error);
+
+        m_evicted++;
+        m_evictedBytes += v.second.bytes;
+    }
+    return victims.size();
+}
+
+void CacheIndex::report(std::ostream & os) const
+{
+    size_t tiles, pins;
+    uint64_t bytes;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        tiles = m_entries.size();
+        bytes = m_bytes;
+        pins = m_pins.size();
+    }
+
+    const double MB = 1024.0*1024.0;
+    os << m_dir << ": " << tiles << " tiles";
+    if (m_maxTiles) {
+        os << " of " << m_maxTiles;
+    }
+    os << ", " << bytes/MB << " MB";
+    if (m_maxBytes) {
+        os << " of " << m_maxBytes/MB;
+    }
+    os << ", " << m_evicted << " evicted (" << m_evictedBytes/MB << " MB)";
+    if (pins) {
+        os << ", " << pins << " pinned tile ranges";
+    }
+}
+
+std::vector<uint64_t> CacheIndex::keys() const
+{
+    std::vector<uint64_t> keys;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        keys.reserve(m_entries.size());
+        for (const auto & i : m_entries) {
+            keys.push_back(i.first);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
+void CacheIndex::freeze(const std::vector<uint64_t> & keys)
+{
+    m_cancel = true;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_frozen = true;
+    m_entries.clear();
+    m_linkedTo.clear();
+    m_links.clear();
+    m_bytes = 0;
+    for (uint64_t k : keys) {
+        m_entries.emplace(k, Entry{ 0, 0 });
+    }
+    m_ready = true;
+}
+
+static void put(FILE * fp, uint64_t value)
+{
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = value >> (8*i);
+    }
+    fwrite(bytes, 1, 8, fp);
+}
+
+static void put32(FILE * fp, uint32_t value)
+{
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; ++i) {
+        bytes[i] = value >> (8*i);
+    }
+    fwrite(bytes, 1, 4, fp);
+}
+
+static bool get32(FILE * fp, uint32_t & value)
+{
+    unsigned char bytes[4];
+    if (fread(bytes, 1, 4, fp) != 4) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= uint32_t(bytes[i]) << (8*i);
+    }
+    return true;
+}
+
+static bool get(FILE * fp, uint64_t & value)
+{
+    unsigned char bytes[8];
+    if (fread(bytes, 1, 8, fp) != 8) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= uint64_t(bytes[i]) << (8*i);
+    }
+    return true;
+}
+
+bool CacheIndex::save() const
+{
+    if (!m_ready || m_frozen || !boost::filesystem::is_directory(m_dir)) {
+        return false;
+    }
+
+    std::vector<std::pair<uint64_t, Entry>> entries;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        entries.assign(m_entries.begin(), m_entries.end());
+
+        // Links aren't known as such next time, each is then a file
+        for (auto & e : entries) {
+            auto l = m_linkedTo.find(e.first);
+            if (l != m_linkedTo.end()) {
+                e.second.bytes = m_entries.at(l->second).bytes;
+            }
+        }
+    }
+    std::sort(entries.begin(), entries.end(),
+        [](const std::pair<uint64_t, Entry> & a, const std::pair<uint64_t, Entry> & b) { return a.first < b.first; });
+
+    // Written aside and renamed, never half a manifest
+    const std::string part = m_manifest + ".part";
+    FILE * fp = fopen(part.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    fwrite(magic, 1, sizeof(magic), fp);
+    put(fp, entries.size());
+    for (const auto & e : entries) {
+        put(fp, e.first);
+        put32(fp, e.second.bytes);
+        put32(fp, e.second.used);
+    }
+    if (fclose(fp) != 0 || std::rename(part.c_str(), m_manifest.c_str()) != 0) {
+        std::remove(part.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CacheIndex::load()
+{
+    FILE * fp = fopen(m_manifest.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    char header[4];
+    uint64_t count = 0;
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header) && get(fp, count);
+    const bool sized = ok && std::equal(header, header + sizeof(header), magic);
+    ok = sized || (ok && std::equal(header, header + sizeof(header), magic1));
+
+    // Sizes of an older manifest are filled in by the scan
+    std::vector<std::pair<uint64_t, Entry>> entries;
+    for (uint64_t i = 0; ok && i < count; ++i) {
+        uint64_t k = 0;
+        Entry e = { 0, 0 };
+        ok = get(fp, k) && (!sized || (get32(fp, e.bytes) && get32(fp, e.used)));
+        entries.emplace_back(k, e);
+    }
+    fclose(fp);
+
+    if (!ok) {
+        std::cerr << "Ignoring damaged cache manifest: " << m_manifest << std::endl;
+        return false;
+    }
+
+    // An empty file was never a tile, the scan removes it
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_frozen) {
+        m_entries.reserve(entries.size());
+        for (const auto & e : entries) {
+            if (!sized || e.second.bytes) {
+                add(e.first, e.second);
+            }
+        }
+    }
+    return true;
+}
+
+// Whole decimal number, not too large for a key
+static bool number(const std::string & s, uint64_t & value, uint64_t limit)
+{
+    if (s.empty() || s.size() > 10 || s.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    value = std::strtoull(s.c_str(), NULL, 10);
+    return value < limit;
+}
+
+void CacheIndex::scan()
+{
+    using namespace boost::filesystem;
+
+    boost::system::error_code error;
+    if (!is_directory(m_dir, error)) {
+        return;
+    }
+
+    const uint64_t limit = uint64_t(1) << 29;
+    std::vector<std::pair<uint64_t, path>> found;
+    std::vector<std::pair<uint64_t, Entry>> sized;
+    std::vector<uint64_t> empty;
+
+    for (directory_iterator z(m_dir, error), end; !error && z != end && !m_cancel; z.increment(error)) {
+        uint64_t zoom;
+        if (!number(z->path().filename().string(), zoom, 30)) {
+            continue;
+        }
+        for (directory_iterator a(z->path(), error); !error && a != end && !m_cancel; a.increment(error)) {
+            uint64_t av;
+            if (!number(a->path().filename().string(), av, limit)) {
+                continue;
+            }
+
+            // One directory at a time, so lookups aren't held up
+            found.clear();
+            for (directory_iterator b(a->path(), error); !error && b != end; b.increment(error)) {
+                std::string name = b->path().filename().string();
+                if (name.size() <= m_extension.size() ||
+                    name.compare(name.size() - m_extension.size(), m_extension.size(), m_extension) != 0) {
+                    continue;
+                }
+                name.resize(name.size() - m_extension.size());
+                uint64_t bv;
+                if (number(name, bv, limit)) {
+                    found.emplace_back(key(zoom, av, bv), b->path());
+                }
+            }
+            error.clear();
+
+            // Only files new to the index, or of unknown size, are looked at
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto known = [this](const std::pair<uint64_t, path> & f) {
+                    auto i = m_entries.find(f.first);
+                    return i != m_entries.end() && (i->second.bytes || m_linkedTo.count(f.first));
+                };
+                found.erase(std::remove_if(found.begin(), found.end(), known), found.end());
+            }
+
+            // Empty files are left by an interrupted write, they are
+            // removed so that the tile is downloaded again
+            sized.clear();
+            empty.clear();
+            const uint32_t used = now();
+            for (const auto & f : found) {
+                const uintmax_t bytes = file_size(f.second, error);
+                if (error) {
+                    error.clear();
+                } else if (bytes == 0) {
+                    remove(f.second, error);
+                    empty.push_back(f.first);
+                } else {
+                    sized.emplace_back(f.first, Entry{ uint32_t(std::min<uintmax_t>(bytes, UINT32_MAX)), used });
+                }
+            }
+            error.clear();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_frozen) {
+                for (uint64_t k : empty) {
+                    drop(k);
+                }
+                for (const auto & s : sized) {
+                    // Keep when it was last used, if the manifest knows
+                    auto i = m_entries.find(s.first);
+                    add(s.first, i != m_entries.end() && i->second.used ? Entry{ s.second.bytes, i->second.used } : s.second);
+                }
+            }
+        }
+        error.clear();
+    }
+}
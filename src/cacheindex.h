@@ -0,0 +1,160 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief in-memory index of the tiles in a loader's disk cache
+ *
+ * Tiles are {dir}{z}/{a}/{b}{extension}.  The index is built once on an
+ * I/O thread, from the manifest saved last time and a scan of the
+ * directory, and is kept up to date as tiles are downloaded.  Until it
+ * is ready, tiles not yet seen are unknown rather than absent.
+ *
+ * An entry may be stale if the cache was changed behind our back, so a
+ * tile that then can't be read is removed again.
+ *
+ * Each entry has the size of the file and when it was last used, saved
+ * with the manifest, so that a quota can be kept by removing the least
+ * recently used tiles.  Tiles in pinned regions are never removed.
+ * Hard links between identical tiles are counted once, until the next
+ * build, when each is counted as a file of its own.
+ */
+class CacheIndex
+{
+public:
+    enum State { UNKNOWN, ABSENT, PRESENT };
+
+    CacheIndex(const std::string & dir, const std::string & extension);
+
+    // Read the manifest or scan the directory, stopping if cancelled
+    void build();
+    void cancel() { m_cancel = true; }
+    bool ready() const { return m_ready; }
+
+    bool cancelled() const { return m_cancel; }
+
+    State find(uint16_t z, uint64_t a, uint64_t b) const;
+    void  insert(uint16_t z, uint64_t a, uint64_t b, uint64_t bytes = 0);
+    void  erase(uint16_t z, uint64_t a, uint64_t b);
+
+    // A hard link of bytes to the tile at z0, a0, b0.  The blocks are
+    // counted once, against whichever of the links remains.
+    void  link(uint16_t z, uint64_t a, uint64_t b, uint64_t bytes, uint16_t z0, uint64_t a0, uint64_t b0);
+
+    // The tile was used just now
+    void  touch(uint16_t z, uint64_t a, uint64_t b);
+
+    size_t size() const;
+    uint64_t bytes() const;
+
+    // Most bytes and tiles to keep, 0 for no limit
+    void quota(uint64_t bytes, uint64_t tiles);
+    bool limited() const { return m_maxBytes || m_maxTiles; }
+
+    // Files named as a tile plus the suffix go with it
+    void sidecar(const std::string & suffix);
+
+    // Never remove level z tiles from a0 to a1 and b0 to b1, inclusive
+    void pin(uint16_t z, uint64_t a0, uint64_t a1, uint64_t b0, uint64_t b1);
+
+    // Remove up to limit of the least recently used tiles that aren't
+    // pinned, and their empty directories, while over quota.  Returns the
+    // number removed.
+    size_t collect(size_t limit);
+
+    // Tiles and bytes against the quota, and what was removed
+    void report(std::ostream & os) const;
+
+    // Sorted keys of everything present
+    std::vector<uint64_t> keys() const;
+
+    // Exactly these keys from now on, ignoring the cache and downloads
+    void freeze(const std::vector<uint64_t> & keys);
+    bool frozen() const { return m_frozen; }
+
+    // Write the manifest for next time
+    bool save() const;
+
+private:
+    CacheIndex(const CacheIndex &) = delete;
+
+    // Zoom in the top bits, levels up to 29
+    static uint64_t key(uint16_t z, uint64_t a, uint64_t b)
+    {
+        return (uint64_t(z) << 58) | (a << 29) | b;
+    }
+
+    // Size of the file, and seconds since the epoch it was last used
+    struct Entry
+    {
+        uint32_t bytes;
+        uint32_t used;
+    };
+
+    struct Pin
+    {
+        uint16_t z;
+        uint64_t a0, a1;
+        uint64_t b0, b1;
+    };
+
+    bool load();
+    void scan();
+    bool pinned(uint64_t key) const;
+    void add(uint64_t key, Entry entry);
+    void drop(uint64_t key);
+    void unlink(uint64_t key);
+
+    const std::string            m_dir;
+    const std::string            m_extension;
+    const std::string            m_manifest;
+
+    mutable std::mutex           m_mutex;
+    std::unordered_map<uint64_t, Entry> m_entries;
+    uint64_t                     m_bytes;
+    std::vector<Pin>             m_pins;
+    std::vector<std::string>     m_sidecars;
+
+    // Hard links counted as no bytes, and the tile counting them
+    std::unordered_map<uint64_t, uint64_t>              m_linkedTo;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> m_links;
+
+    std::atomic<uint64_t>        m_maxBytes;
+    std::atomic<uint64_t>        m_maxTiles;
+    std::atomic<uint64_t>        m_evicted;
+    std::atomic<uint64_t>        m_evictedBytes;
+
+    std::atomic<bool>            m_ready;
+    std::atomic<bool>            m_cancel;
+    std::atomic<bool>            m_frozen;
+};
@@ -23,6 +23,7 @@
  * THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <iostream>
 
 #include <ctime>
@@ -34,6 +35,43 @@
 
 #include "global.h"
 #include "input.h"
+#include "render.h"
+#include "heatmap.h"
+#include "session.h"
+
+// Show the events from a tenth of the range of values further up or down
+static void filter_heatmap(int step)
+{
+    static int lower = 0;
+    if (heatmap) {
+        lower = std::max(0, std::min(9, lower + step));
+        heatmap->set_filter(heatmap->minimum() + (heatmap->maximum() - heatmap->minimum())*lower/10.0, heatmap->maximum());
+    }
+}
+
+// The next event replayed, or from SDL and recorded
+static bool next(SDL_Event & event)
+{
+    if (replaying) {
+        // Only closing the window is taken from SDL meanwhile
+        SDL_Event e;
+        while (SDL_PollEvent(&e)) {
+            if (e.type == SDL_QUIT) {
+                event = e;
+                return true;
+            }
+        }
+        return replaying->event(event);
+    }
+
+    if (!SDL_PollEvent(&event)) {
+        return false;
+    }
+    if (recording) {
+        recording->event(event);
+    }
+    return true;
+}
 
 /**
  * @brief poll for events
@@ -41,8 +79,34 @@
  */
 bool poll()
 {
+    // Bursts of motion and wheel events are combined, and handled
+    // once per frame or before any other input
+    SDL_MouseMotionEvent motion;
+    SDL_MouseWheelEvent  wheel;
+    bool moved = false;
+    bool wheeled = false;
+    auto flush = [&]()
+    {
+        if (moved) {
+            handle_mouse_motion(motion);
+            moved = false;
+        }
+        if (wheeled) {
+            handle_mouse_wheel(wheel);
+            wheeled = false;
+        }
+    };
+
+    if (replaying && replaying->finished()) {
+        return false;
+    }
+
     SDL_Event event;
-    while (SDL_PollEvent(&event)) {
+    while (next(event)) {
+        if (event.type != SDL_MOUSEMOTION && event.type != SDL_MOUSEWHEEL) {
+            flush();
+        }
+
         switch (event.type) {
             case SDL_QUIT:
                 return false;
@@ -60,6 +124,18 @@ bool poll()
                 {
                     case SDLK_c:     player_state.cross = !player_state.cross; break;
                     case SDLK_g:     player_state.grid = !player_state.grid; break;
+                    case SDLK_f:     player_state.scroll = !player_state.scroll; break;
+                    case SDLK_v:     player_state.vector = !player_state.vector; break;
+                    case SDLK_t:     player_state.terrain = !player_state.terrain; break;
+                    case SDLK_m:     player_state.minimap = !player_state.minimap; break;
+                    case SDLK_b:     player_state.blend = !player_state.blend; break;
+                    case SDLK_p:     player_state.tracks = !player_state.tracks; break;
+                    case SDLK_k:     player_state.markers = !player_state.markers; break;
+                    case SDLK_n:     player_state.animate = !player_state.animate; break;
+                    case SDLK_h:     player_state.heatmap = !player_state.heatmap; break;
+                    case SDLK_l:     player_state.labels = !player_state.labels; break;
+                    case SDLK_LEFTBRACKET:  filter_heatmap(-1); break;
+                    case SDLK_RIGHTBRACKET: filter_heatmap(1); break;
                     case SDLK_i:     player_state.zoom = std::min<double>(player_state.zoom+1, 19); break;
                     case SDLK_o:     player_state.zoom = std::max<double>(player_state.zoom-1,  0); break;
                     case SDLK_LEFT:  player_state.x -= delta; break;
@@ -78,7 +154,15 @@ bool poll()
             }
             case SDL_MOUSEMOTION:
                 redisplay = true;
-                handle_mouse_motion(event.motion);
+                if (moved) {
+                    motion.x = event.motion.x;
+                    motion.y = event.motion.y;
+                    motion.xrel += event.motion.xrel;
+                    motion.yrel += event.motion.yrel;
+                } else {
+                    motion = event.motion;
+                    moved = true;
+                }
                 break;
             case SDL_MOUSEBUTTONDOWN:
                 redisplay = true;
@@ -90,7 +174,13 @@ bool poll()
                 break;
             case SDL_MOUSEWHEEL:
                 redisplay = true;
-                handle_mouse_wheel(event.wheel);
+                if (wheeled) {
+                    wheel.x += event.wheel.x;
+                    wheel.y += event.wheel.y;
+                } else {
+                    wheel = event.wheel;
+                    wheeled = true;
+                }
                 break;
             case SDL_WINDOWEVENT:
                 switch (event.window.event) {
@@ -98,7 +188,8 @@ bool poll()
                         redisplay = true;
                         window_state.width = event.window.data1;
                         window_state.height = event.window.data2;
-                        glViewport(0, 0, window_state.width, window_state.height);
+                        update_scale();
+                        glViewport(0, 0, window_state.width*window_state.scale, window_state.height*window_state.scale);
                         break;
                 }
                 break;
@@ -119,5 +210,6 @@ bool poll()
                 break;
         }
     }
+    flush();
     return true;
 }
\ No newline at end of file
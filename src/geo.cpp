@@ -0,0 +1,61 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "geo.h"
+
+void to_quadtree(const double * longitude, const double * latitude, size_t n, uint64_t * x, uint64_t * y)
+{
+    // Fractions of the world first, in a loop without branches so that
+    // the compiler can vectorise it, ln(tan(pi/4 + phi/2)) as atanh(sin(phi))
+    static const size_t block = 1024;
+    static const double below = 1.0 - std::ldexp(1.0, -53);
+    const double limit = std::sin(maxLatitude*M_PI/180.0);
+
+    double u[block];
+    double v[block];
+    for (size_t start = 0; start < n; start += block)
+    {
+        const size_t count = std::min(block, n - start);
+        const double * lon = longitude + start;
+        const double * lat = latitude + start;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            u[i] = std::min(std::max((lon[i] + 180.0)*(1.0/360.0), 0.0), below);
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            const double s = std::min(std::max(std::sin(lat[i]*(M_PI/180.0)), -limit), limit);
+            v[i] = std::min(std::max(0.5 + std::log((1.0 + s)/(1.0 - s))*(0.25/M_PI), 0.0), below);
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            x[start + i] = uint64_t(u[i]*18446744073709551616.0);
+            y[start + i] = uint64_t(v[i]*18446744073709551616.0);
+        }
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// Web Mercator longitude and latitude in degrees to quad-tree
+// co-ordinates, x eastward and y northward across 2^64
+
+static const double maxLatitude = 85.0511287798;
+
+inline uint64_t longitude_to_x(double longitude)
+{
+    const double u = (longitude + 180.0)/360.0;
+    return u <= 0.0 ? 0 : u >= 1.0 ? ~uint64_t(0) : uint64_t(std::ldexp(u, 64));
+}
+
+inline uint64_t latitude_to_y(double latitude)
+{
+    const double phi = std::max(-maxLatitude, std::min(maxLatitude, latitude))*M_PI/180.0;
+    const double v = 0.5 + std::log(std::tan(M_PI/4.0 + phi/2.0))/(2.0*M_PI);
+    return v <= 0.0 ? 0 : v >= 1.0 ? ~uint64_t(0) : uint64_t(std::ldexp(v, 64));
+}
+
+// Many positions at once, from arrays of longitude and latitude
+extern void to_quadtree(const double * longitude, const double * latitude, size_t n, uint64_t * x, uint64_t * y);
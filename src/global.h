@@ -42,6 +42,10 @@ struct s_window_state {
      * @brief height of the window
      */
     int height;
+    /**
+     * @brief drawable pixels per window pixel, 2 on HiDPI displays
+     */
+    double scale = 1.0;
 };
 
 /**
@@ -51,6 +55,16 @@ struct s_player_state
 {
     bool grid = true;
     bool cross = true;
+    bool scroll = false;
+    bool vector = true;
+    bool terrain = false;
+    bool minimap = false;
+    bool blend = false;
+    bool tracks = true;
+    bool markers = true;
+    bool animate = true;
+    bool heatmap = true;
+    bool labels = false;
 
     // 17/121224/54208 @ level 64
     uint64_t x = uint64_t(121224)<<(64-17);
@@ -0,0 +1,673 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+#include "heatmap.h"
+#include "geo.h"
+#include "tilefactory.h"
+
+// Cells of a level z tile are level z+8
+static const int cellBits = 8;
+
+// Kernel radius in cells, the standard deviation a third of it
+static const int32_t radius = 12;
+
+// Grid with room for the kernel either side of the tile
+static const int32_t padded = HeatmapLayer::cells + 2*radius;
+
+// Neighbours are binned from the edge of their level z+4 tiles, 16 cells
+// across, only those within the kernel's reach of the tile
+static const int subBits = 4;
+static const uint32_t subCells = HeatmapLayer::cells >> subBits;
+
+// Points binned at a time, with branchless loops the compiler vectorises
+static const size_t block = 1024;
+
+static uint64_t spread(uint32_t v)
+{
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x <<  8)) & 0x00FF00FF00FF00FFull;
+    x = (x | (x <<  4)) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x <<  2)) & 0x3333333333333333ull;
+    x = (x | (x <<  1)) & 0x5555555555555555ull;
+    return x;
+}
+
+static uint64_t morton(uint32_t x, uint32_t y)
+{
+    return (spread(x) << 1) | spread(y);
+}
+
+// Transparent through blue, cyan, green and yellow to red, as packed RGBA
+static const std::vector<uint32_t> & ramp()
+{
+    static const std::vector<uint32_t> colours = []()
+    {
+        static const float stops[5][4] = {
+            {   0,   0, 255,   0 },
+            {   0, 255, 255, 150 },
+            {   0, 255,   0, 190 },
+            { 255, 255,   0, 220 },
+            { 255,   0,   0, 240 }
+        };
+        std::vector<uint32_t> colours(256);
+        for (size_t i = 0; i < colours.size(); ++i)
+        {
+            const float t = i/255.0f*4.0f;
+            const size_t k = std::min<size_t>(size_t(t), 3);
+            const float f = t - k;
+            uint32_t rgba = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                rgba |= uint32_t(stops[k][c] + f*(stops[k + 1][c] - stops[k][c]) + 0.5f) << (8*c);
+            }
+            colours[i] = rgba;
+        }
+        return colours;
+    }();
+    return colours;
+}
+
+// Normalised 1D Gaussian of the kernel radius
+static const std::vector<float> & kernel()
+{
+    static const std::vector<float> weights = []()
+    {
+        std::vector<float> weights(2*radius + 1);
+        const double sigma = radius/3.0;
+        double sum = 0.0;
+        for (int32_t k = -radius; k <= radius; ++k)
+        {
+            sum += weights[k + radius] = float(std::exp(-k*k/(2.0*sigma*sigma)));
+        }
+        for (float & w : weights)
+        {
+            w = float(w/sum);
+        }
+        return weights;
+    }();
+    return weights;
+}
+
+HeatmapLayer::HeatmapLayer()
+: m_minimum(0.0), m_maximum(0.0), m_filter(0), m_running(0), m_resident(0), m_budget(256), m_frame(0),
+  m_done(0), m_cancelled(0),
+  m_pool(new WorkerPool("heatmap", std::max<size_t>(std::thread::hardware_concurrency(), 2) - 1))
+{
+}
+
+HeatmapLayer::~HeatmapLayer()
+{
+    cancel();
+}
+
+bool HeatmapLayer::load(const std::string & filename)
+{
+    std::ifstream is(filename.c_str());
+    if (!is)
+    {
+        std::cerr << "Could not read " << filename << std::endl;
+        return false;
+    }
+
+    std::vector<double> longitude;
+    std::vector<double> latitude;
+    std::vector<float>  values;
+
+    // Latitude, longitude and value, separated by commas or spaces,
+    // anything else such as a header is skipped
+    std::string line;
+    while (std::getline(is, line))
+    {
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::stringstream ss(line);
+        double lat, lon;
+        if (!(ss >> lat >> lon))
+        {
+            continue;
+        }
+        double value;
+        if (!(ss >> value))
+        {
+            value = 0.0;
+        }
+        longitude.push_back(lon);
+        latitude.push_back(lat);
+        values.push_back(float(value));
+    }
+
+    if (values.empty())
+    {
+        std::cerr << "No points in " << filename << std::endl;
+        return false;
+    }
+
+    std::vector<uint64_t> x(values.size());
+    std::vector<uint64_t> y(values.size());
+    to_quadtree(longitude.data(), latitude.data(), values.size(), x.data(), y.data());
+
+    const auto range = std::minmax_element(values.begin(), values.end());
+    m_minimum = m_x.empty() ? *range.first  : std::min<double>(m_minimum, *range.first);
+    m_maximum = m_x.empty() ? *range.second : std::max<double>(m_maximum, *range.second);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        m_x.push_back(uint32_t(x[i] >> 32));
+        m_y.push_back(uint32_t(y[i] >> 32));
+    }
+    m_values.insert(m_values.end(), values.begin(), values.end());
+    return true;
+}
+
+void HeatmapLayer::index()
+{
+    cancel();
+    while (!idle())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Points in Morton order
+    std::vector<std::pair<uint64_t, uint32_t>> order(m_x.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = std::make_pair(morton(m_x[i], m_y[i]), uint32_t(i));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<uint32_t> x(order.size());
+    std::vector<uint32_t> y(order.size());
+    std::vector<float>    values(order.size());
+    m_keys.resize(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        m_keys[i] = order[i].first;
+        x[i] = m_x[order[i].second];
+        y[i] = m_y[order[i].second];
+        values[i] = m_values[order[i].second];
+    }
+    m_x.swap(x);
+    m_y.swap(y);
+    m_values.swap(values);
+
+    // The densest cell of each level, the longest run of a key prefix,
+    // a thread per level
+    m_peaks.assign(levels, 1);
+    std::vector<std::future<void>> tasks;
+    for (uint16_t z = 0; z < levels; ++z)
+    {
+        tasks.push_back(std::async(std::launch::async, [this, z]()
+        {
+            const int shift = 64 - 2*(z + cellBits);
+            uint32_t peak = 1;
+            for (size_t i = 0, j = 0; i < m_keys.size(); i = j)
+            {
+                for (j = i + 1; j < m_keys.size() && m_keys[j] >> shift == m_keys[i] >> shift; ++j)
+                {
+                }
+                peak = std::max(peak, uint32_t(j - i));
+            }
+            m_peaks[z] = peak;
+        }));
+    }
+    for (auto & i : tasks)
+    {
+        i.get();
+    }
+
+    // Everything computed so far is out of date
+    for (Textures & textures : m_textures)
+    {
+        for (const auto & i : textures)
+        {
+            m_free.push_back(i.second.texture);
+        }
+        textures.clear();
+    }
+    m_resident = 0;
+    if (m_filters.empty())
+    {
+        set_filter(m_minimum, m_maximum);
+    }
+}
+
+void HeatmapLayer::set_filter(double minimum, double maximum)
+{
+    const Filter filter = { float(minimum), float(maximum) };
+    size_t i = 0;
+    while (i < m_filters.size() && (m_filters[i].minimum != filter.minimum || m_filters[i].maximum != filter.maximum))
+    {
+        ++i;
+    }
+    if (i == m_filters.size())
+    {
+        m_filters.push_back(filter);
+        m_textures.emplace_back();
+    }
+    m_filter = i;
+}
+
+void HeatmapLayer::cancel()
+{
+    for (auto & i : m_jobs)
+    {
+        i.second->cancelled = true;
+    }
+    m_jobs.clear();
+}
+
+void HeatmapLayer::next_frame()
+{
+    ++m_frame;
+
+    // Tiles no view wanted last frame are no longer worth computing
+    const std::unordered_set<uint64_t> wanted(m_wanted.begin(), m_wanted.end());
+    for (auto i = m_jobs.begin(); i != m_jobs.end(); )
+    {
+        if (wanted.count(i->first))
+        {
+            ++i;
+            continue;
+        }
+        i->second->cancelled = true;
+        i = m_jobs.erase(i);
+    }
+    m_wanted.clear();
+}
+
+void HeatmapLayer::update(uint16_t z, const uint64_t tile[2], const uint64_t size[2])
+{
+    if (m_keys.empty() || m_filters.empty())
+    {
+        return;
+    }
+
+    // A few tiles a frame, the rest once the pool catches up
+    const size_t max_running = 2*m_pool->threads();
+
+    const uint64_t levelSize = uint64_t(1)<<z;
+    for (uint64_t j = 0; j <= size[1]; ++j)
+    {
+        for (uint64_t i = 0; i <= size[0]; ++i)
+        {
+            const uint64_t x = (tile[0] + i)%levelSize;
+            const uint64_t y = (tile[1] + j)%levelSize;
+            const uint64_t key = TileFactory::tile_key(z, x, y);
+            m_wanted.push_back(key);
+            if (m_textures[m_filter].count(key))
+            {
+                continue;
+            }
+
+            // A tile of an earlier filter is no longer wanted
+            auto found = m_jobs.find(key);
+            if (found != m_jobs.end())
+            {
+                if (found->second->index == m_filter)
+                {
+                    continue;
+                }
+                found->second->cancelled = true;
+                m_jobs.erase(found);
+            }
+
+            if (m_running >= max_running)
+            {
+                continue;
+            }
+            std::shared_ptr<Job> job(new Job());
+            job->z = z;
+            job->x = x;
+            job->y = y;
+            job->index = m_filter;
+            job->filter = m_filters[m_filter];
+            job->cancelled = false;
+            m_jobs[key] = job;
+            ++m_running;
+            m_pool->post([this, job]() { compute(job); });
+        }
+    }
+}
+
+void HeatmapLayer::bin(const Job & job, uint16_t l, uint64_t tx, uint64_t ty, int32_t gx, int32_t gy, std::vector<float> & grid) const
+{
+    // The points of the level l tile, one range in Morton order
+    const uint32_t ox = uint32_t(tx << (32 - l));
+    const uint32_t oy = uint32_t(ty << (32 - l));
+    const uint64_t first = morton(ox, oy);
+    const uint64_t last = first + (l ? (uint64_t(1) << (64 - 2*l)) - 1 : ~uint64_t(0));
+    const size_t begin = std::lower_bound(m_keys.begin(), m_keys.end(), first) - m_keys.begin();
+    const size_t end   = std::upper_bound(m_keys.begin() + begin, m_keys.end(), last) - m_keys.begin();
+
+    // Cells of the padded grid, out of it or filtered out adding nothing
+    const int shift = 32 - job.z - cellBits;
+    const float minimum = job.filter.minimum;
+    const float maximum = job.filter.maximum;
+    int32_t index[block];
+    float   weight[block];
+    for (size_t start = begin; start < end; start += block)
+    {
+        const size_t count = std::min(block, end - start);
+        const uint32_t * px = m_x.data() + start;
+        const uint32_t * py = m_y.data() + start;
+        const float    * pv = m_values.data() + start;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            const int32_t cx = gx + int32_t((px[i] - ox) >> shift);
+            const int32_t cy = gy + int32_t((py[i] - oy) >> shift);
+            const bool inside = cx >= 0 && cx < padded && cy >= 0 && cy < padded && pv[i] >= minimum && pv[i] <= maximum;
+            index[i]  = inside ? cy*padded + cx : 0;
+            weight[i] = inside ? 1.0f : 0.0f;
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            grid[index[i]] += weight[i];
+        }
+
+        if (job.cancelled)
+        {
+            return;
+        }
+    }
+}
+
+void HeatmapLayer::compute(const std::shared_ptr<Job> & job)
+{
+    if (job->cancelled)
+    {
+        ++m_cancelled;
+        --m_running;
+        return;
+    }
+
+    const uint16_t z = job->z;
+    std::vector<float> grid(padded*padded);
+
+    // The tile, then the edges of its neighbours, across the antimeridian
+    bin(*job, z, job->x, job->y, radius, radius, grid);
+    const int64_t levelSize = int64_t(1) << z;
+    const uint32_t across = 1 << subBits;
+    for (int dy = -1; dy <= 1; ++dy)
+    {
+        for (int dx = -1; dx <= 1; ++dx)
+        {
+            const int64_t ny = int64_t(job->y) + dy;
+            if ((dx == 0 && dy == 0) || ny < 0 || ny >= levelSize)
+            {
+                continue;
+            }
+            const uint64_t nx = uint64_t((int64_t(job->x) + dx + levelSize) % levelSize);
+            for (uint32_t r = dy < 0 ? across - 1 : 0; r <= (dy > 0 ? 0 : across - 1); ++r)
+            {
+                for (uint32_t c = dx < 0 ? across - 1 : 0; c <= (dx > 0 ? 0 : across - 1); ++c)
+                {
+                    bin(*job, z + subBits, (nx << subBits) + c, (uint64_t(ny) << subBits) + r,
+                        radius + dx*int32_t(cells) + int32_t(c*subCells), radius + dy*int32_t(cells) + int32_t(r*subCells), grid);
+                }
+            }
+        }
+    }
+    if (job->cancelled)
+    {
+        ++m_cancelled;
+        --m_running;
+        return;
+    }
+
+    // Separable smoothing, along the rows and then down the columns
+    const std::vector<float> & weights = kernel();
+    std::vector<float> rows(padded*cells);
+    for (int32_t y = 0; y < padded; ++y)
+    {
+        float * out = &rows[y*cells];
+        for (int32_t k = 0; k <= 2*radius; ++k)
+        {
+            const float w = weights[k];
+            const float * in = &grid[y*padded + k];
+            for (uint32_t x = 0; x < cells; ++x)
+            {
+                out[x] += w*in[x];
+            }
+        }
+    }
+    std::vector<float> density(cells*cells);
+    for (uint32_t y = 0; y < cells; ++y)
+    {
+        float * out = &density[y*cells];
+        for (int32_t k = 0; k <= 2*radius; ++k)
+        {
+            const float w = weights[k];
+            const float * in = &rows[(y + k)*cells];
+            for (uint32_t x = 0; x < cells; ++x)
+            {
+                out[x] += w*in[x];
+            }
+        }
+    }
+
+    // A lone point is 1 at its centre, the densest cell of the level 1
+    // on a log scale.  Rows from the north, as images are.
+    const std::vector<uint32_t> & colours = ramp();
+    const float scale = 1.0f/(weights[radius]*weights[radius]);
+    const float inv = 255.0f/std::log2(1.0f + m_peaks[z]);
+    Computed computed;
+    computed.job = job;
+    computed.pixels.resize(cells*cells);
+    for (uint32_t y = 0; y < cells; ++y)
+    {
+        const float * in = &density[y*cells];
+        uint32_t * out = &computed.pixels[(cells - 1 - y)*cells];
+        for (uint32_t x = 0; x < cells; ++x)
+        {
+            out[x] = colours[std::min(255, int(std::log2(1.0f + in[x]*scale)*inv))];
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_computed.push_back(std::move(computed));
+    }
+    --m_running;
+}
+
+size_t HeatmapLayer::upload_images(size_t max)
+{
+    std::vector<Computed> computed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_computed.empty())
+        {
+            return 0;
+        }
+        const size_t n = std::min(max, m_computed.size());
+        std::move(m_computed.begin(), m_computed.begin() + n, std::back_inserter(computed));
+        m_computed.erase(m_computed.begin(), m_computed.begin() + n);
+    }
+
+    // Kept even if cancelled meanwhile, for when it comes back into view
+    for (const Computed & c : computed)
+    {
+        const Job & job = *c.job;
+        const uint64_t key = TileFactory::tile_key(job.z, job.x, job.y);
+        auto found = m_jobs.find(key);
+        if (found != m_jobs.end() && found->second == c.job)
+        {
+            m_jobs.erase(found);
+        }
+
+        auto i = m_textures[job.index].insert(std::make_pair(key, Texture{0, m_frame}));
+        Texture & t = i.first->second;
+        if (!i.second)
+        {
+            glBindTexture(GL_TEXTURE_2D, t.texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cells, cells, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, c.pixels.data());
+        }
+        else if (!m_free.empty())
+        {
+            // All the same size, so reused in place
+            t.texture = m_free.back();
+            m_free.pop_back();
+            glBindTexture(GL_TEXTURE_2D, t.texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cells, cells, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, c.pixels.data());
+            ++m_resident;
+        }
+        else
+        {
+            glGenTextures(1, &t.texture);
+            glBindTexture(GL_TEXTURE_2D, t.texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cells, cells, 0, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, c.pixels.data());
+            ++m_resident;
+        }
+        t.frame = m_frame;
+        ++m_done;
+    }
+
+    evict();
+    return computed.size();
+}
+
+void HeatmapLayer::evict()
+{
+    // Least recently drawn first, of any filter, but not anything drawn recently
+    if (m_resident > m_budget) {
+        std::vector<std::pair<uint64_t, std::pair<size_t, uint64_t>>> candidates;
+        for (size_t f = 0; f < m_textures.size(); ++f) {
+            for (const auto & i : m_textures[f]) {
+                if (i.second.frame + 1 < m_frame) {
+                    candidates.push_back(std::make_pair(i.second.frame, std::make_pair(f, i.first)));
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        for (const auto & i : candidates) {
+            if (m_resident <= m_budget) {
+                break;
+            }
+            auto found = m_textures[i.second.first].find(i.second.second);
+            m_free.push_back(found->second.texture);
+            m_textures[i.second.first].erase(found);
+            --m_resident;
+        }
+    }
+
+    // A few spare for the next tiles, the rest deleted
+    static const size_t spare = 16;
+    if (m_free.size() > spare) {
+        glDeleteTextures(GLsizei(m_free.size() - spare), m_free.data() + spare);
+        m_free.resize(spare);
+    }
+}
+
+HeatmapLayer::Texture * HeatmapLayer::find(uint64_t key)
+{
+    // The current filter, or failing that whichever was drawn last
+    auto found = m_textures[m_filter].find(key);
+    if (found != m_textures[m_filter].end()) {
+        return &found->second;
+    }
+    Texture * best = NULL;
+    for (Textures & textures : m_textures) {
+        found = textures.find(key);
+        if (found != textures.end() && (!best || found->second.frame > best->frame)) {
+            best = &found->second;
+        }
+    }
+    return best;
+}
+
+void HeatmapLayer::draw(uint16_t z, uint64_t x, uint64_t y)
+{
+    if (m_filters.empty())
+    {
+        return;
+    }
+
+    // The tile, or the part of the nearest ancestor computed so far
+    for (uint16_t a = 0; a <= z; ++a)
+    {
+        if (z - a >= levels)
+        {
+            continue;
+        }
+        Texture * t = find(TileFactory::tile_key(z - a, x >> a, y >> a));
+        if (!t)
+        {
+            continue;
+        }
+        t->frame = m_frame;
+
+        const double size = std::ldexp(1.0, -a);
+        const GLfloat u0 = GLfloat((x & ((uint64_t(1) << a) - 1))*size);
+        const GLfloat v0 = GLfloat((y & ((uint64_t(1) << a) - 1))*size);
+        const GLfloat u1 = GLfloat(u0 + size);
+        const GLfloat v1 = GLfloat(v0 + size);
+
+        glBindTexture(GL_TEXTURE_2D, t->texture);
+        glBegin(GL_QUADS);
+            glTexCoord2f(u0, v0); glVertex2f(0.0, 0.0);
+            glTexCoord2f(u0, v1); glVertex2f(0.0, 1.0);
+            glTexCoord2f(u1, v1); glVertex2f(1.0, 1.0);
+            glTexCoord2f(u1, v0); glVertex2f(1.0, 0.0);
+        glEnd();
+        return;
+    }
+}
+
+void HeatmapLayer::release()
+{
+    for (Textures & textures : m_textures)
+    {
+        for (const auto & i : textures)
+        {
+            m_free.push_back(i.second.texture);
+        }
+        textures.clear();
+    }
+    if (!m_free.empty())
+    {
+        glDeleteTextures(GLsizei(m_free.size()), m_free.data());
+        m_free.clear();
+    }
+    m_resident = 0;
+}
+
+void HeatmapLayer::report(std::ostream & os) const
+{
+    os << "Heatmap: " << points() << " points, " << m_done << " tiles computed, " << m_cancelled << " cancelled, "
+       << m_resident << " of " << m_budget << " kept for " << m_filters.size() << " filters" << std::endl;
+}
@@ -0,0 +1,177 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "pool.h"
+
+/**
+ * @brief density of many weighted events, drawn as a colour ramped tile layer
+ *
+ * Points are kept in Morton order of their quadtree co-ordinates, so the
+ * points of any tile are one contiguous range.  A tile is a grid of 256
+ * cells, binned from the points of the tile and the edges of its
+ * neighbours, smoothed with a separable Gaussian and coloured on a log
+ * scale against the densest cell of the level.  Tiles are computed only
+ * when visible, on a pool of their own, and a tile that scrolls out of
+ * view before its turn is cancelled.
+ *
+ * The filter is a range of the value column.  Tiles are kept for each
+ * filter, so going back to an earlier filter needs no work, and until the
+ * tile of the new filter is ready that of another filter, or an ancestor,
+ * is drawn.
+ */
+class HeatmapLayer
+{
+public:
+    HeatmapLayer();
+    ~HeatmapLayer();
+
+    // Add the points of a CSV file of latitude, longitude and optional value
+    bool load(const std::string & filename);
+
+    // Sort everything loaded so far, before drawing
+    void index();
+
+    size_t points() const { return m_x.size(); }
+
+    // Values of the points, and the range of them shown
+    double minimum() const { return m_minimum; }
+    double maximum() const { return m_maximum; }
+    void   set_filter(double minimum, double maximum);
+
+    // Deepest level computed, deeper tiles are drawn from it
+    uint16_t maxZoom() const { return levels - 1; }
+
+    // Start of a frame, then the grid of each view, of level z tiles
+    void next_frame();
+    void update(uint16_t z, const uint64_t tile[2], const uint64_t size[2]);
+
+    // Upload computed tiles, returns the number uploaded
+    size_t upload_images(size_t max = SIZE_MAX);
+
+    // No tiles being computed
+    bool idle() const { return m_running == 0; }
+
+    // Draw the level z tile, in the unit square
+    void draw(uint16_t z, uint64_t x, uint64_t y);
+
+    // Free the textures, while the GL context is current
+    void release();
+
+    // Tiles computed, cancelled and kept
+    void report(std::ostream & os) const;
+
+    // Cells across a tile
+    static const uint32_t cells = 256;
+
+    static const uint16_t levels = 21;
+
+private:
+    HeatmapLayer(const HeatmapLayer &) = delete;
+
+    struct Filter
+    {
+        float minimum;
+        float maximum;
+    };
+
+    struct Job
+    {
+        uint16_t          z;
+        uint64_t          x;
+        uint64_t          y;
+        size_t            index;
+        Filter            filter;
+        std::atomic<bool> cancelled;
+    };
+
+    struct Computed
+    {
+        std::shared_ptr<Job> job;
+        std::vector<uint32_t> pixels;
+    };
+
+    struct Texture
+    {
+        GLuint   texture;
+        uint64_t frame;
+    };
+
+    typedef std::unordered_map<uint64_t, Texture> Textures;
+
+    void compute(const std::shared_ptr<Job> & job);
+    void bin(const Job & job, uint16_t l, uint64_t tx, uint64_t ty, int32_t gx, int32_t gy, std::vector<float> & grid) const;
+    Texture * find(uint64_t key);
+    void cancel();
+    void evict();
+
+    // Top 32 bits of the quadtree co-ordinates and the value, in Morton
+    // order once indexed
+    std::vector<uint64_t> m_keys;
+    std::vector<uint32_t> m_x;
+    std::vector<uint32_t> m_y;
+    std::vector<float>    m_values;
+
+    double m_minimum;
+    double m_maximum;
+
+    // Most points in a cell of each level, for the colour ramp
+    std::vector<uint32_t> m_peaks;
+
+    std::vector<Filter>   m_filters;
+    size_t                m_filter;
+
+    // Jobs of the current filter by tile key, and those wanted this frame
+    std::unordered_map<uint64_t, std::shared_ptr<Job>> m_jobs;
+    std::vector<uint64_t> m_wanted;
+    std::atomic<size_t>   m_running;
+
+    std::mutex            m_mutex;
+    std::vector<Computed> m_computed;
+
+    // Textures of each filter by tile key, and textures to reuse
+    std::vector<Textures> m_textures;
+    std::vector<GLuint>   m_free;
+    size_t                m_resident;
+    const size_t          m_budget;
+    uint64_t              m_frame;
+
+    uint64_t              m_done;
+    std::atomic<uint64_t> m_cancelled;
+
+    // Last, so that its threads stop before anything they use goes
+    std::unique_ptr<WorkerPool> m_pool;
+};
@@ -71,6 +71,9 @@ void handle_mouse_motion(SDL_MouseMotionEvent &motion) {
     if (input_state.middle_mouse_down)
 	{
         viewport_state.angle_rotate += motion.yrel/200.0 * 180.0;
+        viewport_state.angle_tilt += motion.xrel/200.0 * 90.0;
+        viewport_state.angle_tilt = std::max<double>(viewport_state.angle_tilt, 0);
+        viewport_state.angle_tilt = std::min<double>(viewport_state.angle_tilt, MAX_TILT);
         return;
     }
     if (input_state.left_mouse_down) 
@@ -0,0 +1,166 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdio>
+
+#include "ktx2.h"
+
+static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+// Header, index and one level, then the data format descriptor, then the level
+static const size_t header_size = 12 + 9*4;
+static const size_t index_size  = 4*4 + 2*8;
+static const size_t level_size  = 3*8;
+static const size_t dfd_offset  = header_size + index_size + level_size;
+
+static void put32(std::vector<uint8_t> & out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(uint8_t(value >> (8*i)));
+    }
+}
+
+static void put64(std::vector<uint8_t> & out, uint64_t value)
+{
+    put32(out, uint32_t(value));
+    put32(out, uint32_t(value >> 32));
+}
+
+static uint64_t get(const uint8_t * p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= uint64_t(p[i]) << (8*i);
+    }
+    return value;
+}
+
+// Basic data format descriptor, one sample for BC1 and four for RGBA8
+static std::vector<uint8_t> descriptor(Ktx2::Format format)
+{
+    const bool bc1 = format == Ktx2::BC1;
+    const uint32_t samples = bc1 ? 1 : 4;
+    const uint32_t block = 24 + 16*samples;
+
+    std::vector<uint8_t> dfd;
+    put32(dfd, 4 + block);
+    put32(dfd, 0);                                      // Khronos, basic
+    put32(dfd, 2 | block << 16);                        // version 1.3
+    put32(dfd, (bc1 ? 128 : 1) | 1 << 8 | 1 << 16);     // BC1A or RGBSDA, BT.709, linear
+    put32(dfd, bc1 ? 0x0303 : 0);                       // 4x4 or 1x1 texels
+    put32(dfd, bc1 ? 8 : 4);                            // bytes per block
+    put32(dfd, 0);
+    if (bc1) {
+        put32(dfd, 63 << 16);                           // 64 bits of colour
+        put32(dfd, 0);
+        put32(dfd, 0);
+        put32(dfd, 0xffffffff);
+    } else {
+        const uint32_t channels[4] = { 0, 1, 2, 15 };   // R, G, B, A
+        for (uint32_t i = 0; i < 4; ++i) {
+            put32(dfd, (8*i) | 7 << 16 | channels[i] << 24);
+            put32(dfd, 0);
+            put32(dfd, 0);
+            put32(dfd, 255);
+        }
+    }
+    return dfd;
+}
+
+bool Ktx2::write(const std::string & filename) const
+{
+    const std::vector<uint8_t> dfd = descriptor(format);
+    const size_t data_offset = (dfd_offset + dfd.size() + 7)/8*8;
+
+    std::vector<uint8_t> out(identifier, identifier + sizeof(identifier));
+    put32(out, format);
+    put32(out, 1);                                      // typeSize
+    put32(out, width);
+    put32(out, height);
+    put32(out, 0);                                      // depth
+    put32(out, 0);                                      // layers
+    put32(out, 1);                                      // faces
+    put32(out, 1);                                      // levels
+    put32(out, 0);                                      // supercompression
+    put32(out, uint32_t(dfd_offset));
+    put32(out, uint32_t(dfd.size()));
+    put32(out, 0);                                      // no key/value data
+    put32(out, 0);
+    put64(out, 0);                                      // no supercompression data
+    put64(out, 0);
+    put64(out, data_offset);
+    put64(out, data.size());
+    put64(out, data.size());
+    out.insert(out.end(), dfd.begin(), dfd.end());
+    out.resize(data_offset, 0);
+    out.insert(out.end(), data.begin(), data.end());
+
+    const std::string part = filename + ".part";
+    FILE * fp = fopen(part.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    const bool written = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    if (fclose(fp) != 0 || !written || std::rename(part.c_str(), filename.c_str()) != 0) {
+        std::remove(part.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Ktx2::read(const std::string & filename)
+{
+    FILE * fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t header[dfd_offset];
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header) &&
+              std::equal(identifier, identifier + sizeof(identifier), header);
+
+    const uint64_t vkFormat = ok ? get(header + 12, 4) : 0;
+    const uint64_t levels   = ok ? get(header + 12 + 7*4, 4) : 0;
+    const uint64_t offset   = ok ? get(header + header_size + index_size, 8) : 0;
+    const uint64_t length   = ok ? get(header + header_size + index_size + 8, 8) : 0;
+    width  = ok ? uint32_t(get(header + 12 + 2*4, 4)) : 0;
+    height = ok ? uint32_t(get(header + 12 + 3*4, 4)) : 0;
+    format = Format(vkFormat);
+
+    // Exactly the texels expected, nothing to trust blindly
+    uint64_t expected = 0;
+    if (vkFormat == BC1) {
+        expected = uint64_t((width + 3)/4)*((height + 3)/4)*8;
+    } else if (vkFormat == RGBA8) {
+        expected = uint64_t(width)*height*4;
+    }
+    ok = ok && levels <= 1 && expected && length == expected && length <= (uint64_t(64) << 20);
+
+    if (ok) {
+        data.resize(length);
+        ok = fseek(fp, long(offset), SEEK_SET) == 0 && fread(data.data(), 1, length, fp) == length;
+    }
+    fclose(fp);
+    return ok;
+}
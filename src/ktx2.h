@@ -0,0 +1,57 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief single level 2D textures in KTX2 files
+ *
+ * Enough of KTX2 for tiles transcoded ahead of time: BC1 blocks, or RGBA8
+ * texels such as the single one of a tile of one colour.  No
+ * supercompression, no mipmaps and no key/value data.
+ */
+class Ktx2
+{
+public:
+    enum Format
+    {
+        RGBA8 = 37,    // VK_FORMAT_R8G8B8A8_UNORM
+        BC1   = 131    // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+    };
+
+    Format               format = BC1;
+    uint32_t             width  = 0;
+    uint32_t             height = 0;
+    std::vector<uint8_t> data;
+
+    // Written aside and renamed, never half a file
+    bool write(const std::string & filename) const;
+
+    // False unless a texture of a supported format
+    bool read(const std::string & filename);
+};
@@ -29,35 +29,316 @@
 #include <curl/curl.h>
 #include <boost/thread.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/deadline_timer.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <random>
+#include <set>
+
+#include <strings.h>
 
 #include "loader.h"
 #include "tilefactory.h"
 #include "global.h"
+#include "pool.h"
+#include "cacheindex.h"
+#include "origin.h"
+#include "xxhash.h"
+#include "urltemplate.h"
+#include "bc1.h"
+#include "ktx2.h"
 
 static size_t count = 0;
 static boost::asio::io_service       * service = NULL;
 static boost::thread_group           * pool    = NULL;
 static boost::asio::io_service::work * work    = NULL;
+static WorkerPool                    * cpu     = NULL;
+
+static size_t                          threads = 0;
+static std::atomic<size_t>             queued(0);
+static std::atomic<uint64_t>           retried(0);
+static std::atomic<uint64_t>           failed(0);
+
+// Downloads are tried this many times before giving up
+static const int                       max_attempts = 4;
+// Backoff before the first retry, doubling to the most
+static const double                    min_backoff  = 0.2;
+static const double                    max_backoff  = 30.0;
+
+// Beside each cached tile once transcoded
+static const char                      ktx2_suffix[] = ".ktx2";
 
 std::atomic<uint64_t> downloaded;
 
+// Thread count from the environment, or the default
+static size_t threads_from_env(const char * name, size_t fallback)
+{
+    const char * value = std::getenv(name);
+    if (value && std::atoi(value) > 0) {
+        return std::atoi(value);
+    }
+    return fallback;
+}
+
+// Posted to either pool and not finished yet
+static std::atomic<size_t>             pending(0);
+
+// Post to the I/O threads, keeping count of what is waiting
+template<typename Handler>
+static void post_io(Handler handler)
+{
+    ++queued;
+    ++pending;
+    service->post([handler]() { --queued; handler(); --pending; });
+}
+
+template<typename Handler>
+static void post_cpu(Handler handler)
+{
+    ++pending;
+    cpu->post([handler]() { handler(); --pending; });
+}
+
+// Run handler on an I/O thread after a delay, without holding one meanwhile
+template<typename Handler>
+static void post_later(double seconds, Handler handler)
+{
+    ++pending;
+    std::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(*service));
+    timer->expires_from_now(boost::posix_time::microseconds(int64_t(seconds*1e6)));
+    timer->async_wait([handler, timer](const boost::system::error_code & error) {
+        if (!error) {
+            handler();
+        }
+        --pending;
+    });
+}
+
+// As post_later, but not waited for by idle(), for upkeep in the background
+template<typename Handler>
+static void post_background(double seconds, Handler handler)
+{
+    std::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(*service));
+    timer->expires_from_now(boost::posix_time::microseconds(int64_t(seconds*1e6)));
+    timer->async_wait([handler, timer](const boost::system::error_code & error) {
+        if (!error) {
+            handler();
+        }
+    });
+}
+
+// Keep the disk cache within quota, a batch at a time and only while
+// nothing else is queued or in progress, so it never holds up loading
+static void collect(std::shared_ptr<CacheIndex> index)
+{
+    if (index->cancelled()) {
+        return;
+    }
+    double wait = 1.0;
+    if (pending == 0) {
+        wait = index->collect(64) ? 0.05 : 10.0;
+    }
+    post_background(wait, [index]() { collect(index); });
+}
+
+// Start whatever the origin allows now, and look again when it allows more
+static void pump(Origin * origin)
+{
+    std::vector<std::function<void()>> starts;
+    const double wait = origin->ready(starts);
+    for (auto & start : starts) {
+        start();
+    }
+    if (wait > 0.0) {
+        post_later(wait, [origin]() { pump(origin); });
+    }
+}
+
+// Half the backoff, plus up to as much again at random, so that
+// failures at the same time aren't all retried at the same time
+static double backoff(int attempt)
+{
+    static thread_local std::minstd_rand random(std::random_device{}());
+    const double limit = std::min(min_backoff*(1 << attempt), max_backoff);
+    return limit/2.0 + std::uniform_real_distribution<double>(0.0, limit/2.0)(random);
+}
+
+Loader::Loader(bool tms, bool zxy, uint16_t maxZoom, const std::string & prefix, const std::string & extension, const std::string & dir)
+: m_tileSize(256), m_tms(tms), m_zxy(zxy), m_maxZoom(maxZoom),
+  m_density(prefix.find("@2x") != std::string::npos ? 2.0 : 1.0),
+  m_prefix(prefix), m_extension(extension), m_dir(dir),
+  m_index(std::make_shared<CacheIndex>(dir, extension))
+{
+    start();
+
+    // An origin for every host, shared with other loaders
+    if (!m_prefix.empty()) {
+        m_urls.reset(new UrlTemplate(m_prefix, tms, zxy, extension));
+        m_origins.resize(m_urls->mirrors());
+        for (size_t m = 0; m < m_urls->mirrors(); ++m) {
+            for (size_t s = 0; s < m_urls->shards(m); ++s) {
+                m_origins[m].push_back(&Origin::get(m_urls->host(m, s), threads));
+            }
+        }
+    }
+
+    // The index outlives the loader while it is built
+    std::shared_ptr<CacheIndex> index = m_index;
+    post_io([index]() { index->build(); });
+}
+
+Loader::~Loader()
+{
+    finish_tasks();
+    m_index->cancel();
+    m_index->save();
+    stop();
+    clear();
+}
+
+void Loader::finish_tasks()
+{
+    std::vector<std::function<void()>> timers;
+    {
+        std::lock_guard<std::mutex> lock(m_taskMutex);
+        if (m_stopping) {
+            return;
+        }
+        m_stopping = true;
+
+        // Downloads waiting for their origin never start
+        std::set<Origin *> origins;
+        for (const auto & mirror : m_origins) {
+            origins.insert(mirror.begin(), mirror.end());
+        }
+        for (Origin * origin : origins) {
+            const size_t cancelled = origin->cancel(this);
+            pending -= cancelled;
+            m_tasks -= cancelled;
+        }
+
+        for (auto & i : m_timers) {
+            timers.push_back(i.second);
+        }
+    }
+
+    // Retries waiting for their backoff go now, and do nothing
+    for (auto & cancel : timers) {
+        cancel();
+    }
+
+    // Queued work sees m_stopping and returns straight away
+    std::unique_lock<std::mutex> lock(m_taskMutex);
+    m_taskDone.wait(lock, [this]() { return m_tasks == 0; });
+}
+
+// Counted until it has run, so that the loader and tile outlive it
+std::function<void()> Loader::task(Tile * tile, std::function<void()> work)
+{
+    ++m_tasks;
+    hold(tile);
+    return [this, tile, work]() {
+        work();
+        done(tile);
+    };
+}
+
+// Nothing may touch the loader after this, it may be gone
+void Loader::done(Tile * tile)
+{
+    std::lock_guard<std::mutex> lock(m_taskMutex);
+    auto i = m_busy.find(tile);
+    if (i != m_busy.end() && --i->second == 0) {
+        m_busy.erase(i);
+    }
+    if (--m_tasks == 0) {
+        m_taskDone.notify_all();
+    }
+}
+
+// Not to be released by the TileFactory until let go
+void Loader::hold(const Tile * tile)
+{
+    std::lock_guard<std::mutex> lock(m_taskMutex);
+    ++m_busy[tile];
+}
+
+void Loader::unhold(const Tile * tile)
+{
+    std::lock_guard<std::mutex> lock(m_taskMutex);
+    auto i = m_busy.find(tile);
+    if (i != m_busy.end() && --i->second == 0) {
+        m_busy.erase(i);
+    }
+}
+
+bool Loader::busy(const Tile & tile) const
+{
+    std::lock_guard<std::mutex> lock(m_taskMutex);
+    return m_busy.count(&tile) > 0;
+}
+
+void Loader::forget(Tile & tile)
+{
+    release_texture(tile);
+}
+
+// As post_later, but cancelled when the loader goes
+void Loader::later(double seconds, Tile * tile, std::function<void()> work)
+{
+    std::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(*service));
+    {
+        std::lock_guard<std::mutex> lock(m_taskMutex);
+        if (m_stopping) {
+            return;
+        }
+        ++m_tasks;
+        ++m_busy[tile];
+        m_timers[timer.get()] = [timer]() { timer->cancel(); };
+    }
+
+    ++pending;
+    timer->expires_from_now(boost::posix_time::microseconds(int64_t(seconds*1e6)));
+    timer->async_wait([this, tile, work, timer](const boost::system::error_code & error) {
+        {
+            std::lock_guard<std::mutex> lock(m_taskMutex);
+            m_timers.erase(timer.get());
+        }
+        if (!error && !m_stopping) {
+            work();
+        }
+        done(tile);
+        --pending;
+    });
+}
+
 void Loader::start()
 {
     ++count;
     if (count==1)
     {
-        std::cout << "Loader::start" << std::endl;
+        // Network and disk waits are mostly idle, so the I/O pool is
+        // oversubscribed relative to the cores.  Decoding is CPU bound,
+        // leave a core for the render thread.
+        const size_t cores = std::max<size_t>(boost::thread::hardware_concurrency(), 1);
+        threads = threads_from_env("SLIPPYMAP_IO_THREADS", std::min<size_t>(std::max<size_t>(cores*2, 4), 32));
+        const size_t decoders = threads_from_env("SLIPPYMAP_CPU_THREADS", std::max<size_t>(cores-1, 1));
+
+        std::cout << "Loader::start " << threads << " I/O threads, " << decoders << " CPU threads" << std::endl;
 
         service = new boost::asio::io_service();
         work = new boost::asio::io_service::work(*service);
         pool = new boost::thread_group();
         downloaded = 0;
-        const size_t threads = 10;
         for (size_t i = 0; i < threads; i++) {
             pool->create_thread(boost::bind(&boost::asio::io_service::run, service));
         }
+        cpu = new WorkerPool("cpu", decoders);
     }
 }
 
@@ -70,12 +351,22 @@ void Loader::stop()
 
         service->stop();
         pool->join_all();
+        Origin::reset();
+        delete cpu;
         delete pool;
         delete work;
         delete service;
     }
 }
 
+size_t Loader::io_queued()   { return queued; }
+size_t Loader::cpu_queued()  { return cpu ? cpu->queued() : 0; }
+size_t Loader::io_threads()  { return threads; }
+size_t Loader::cpu_threads() { return cpu ? cpu->threads() : 0; }
+bool Loader::idle()          { return pending == 0; }
+uint64_t Loader::retries()   { return retried; }
+uint64_t Loader::failures()  { return failed; }
+
 size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
     size_t written;
@@ -83,11 +374,90 @@ size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream)
     return written;
 }
 
-void Loader::download_image(Tile* tile)
+// The whole file, for hashing and decoding from memory
+static bool read_file(const std::string & filename, std::vector<char> & data)
+{
+    FILE * fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    data.clear();
+    char buffer[16384];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    const bool ok = !ferror(fp);
+    fclose(fp);
+    return ok && !data.empty();
+}
+
+// Seconds from a Retry-After header, dates are ignored
+static size_t read_header(char * buffer, size_t size, size_t nitems, double * retryAfter)
 {
+    static const char name[] = "retry-after:";
+    const size_t length = size*nitems;
+    if (length > sizeof(name) - 1 && strncasecmp(buffer, name, sizeof(name) - 1) == 0) {
+        *retryAfter = std::atof(std::string(buffer + sizeof(name) - 1, length - (sizeof(name) - 1)).c_str());
+    }
+    return length;
+}
+
+size_t Loader::mirror(const Tile & tile, int attempt) const
+{
+    // If all are down, wait for one to recover
+    std::vector<const Origin *> mirrors;
+    for (size_t m = 0; m < m_origins.size(); ++m) {
+        mirrors.push_back(origin(tile, m));
+    }
+    return Origin::choose(mirrors, attempt);
+}
+
+Origin * Loader::origin(const Tile & tile, size_t mirror) const
+{
+    return m_origins[mirror][m_urls->shard(mirror, tile.zoom, tile.x, tile.y)];
+}
+
+void Loader::fetch(Tile * tile, int attempt)
+{
+    const size_t m = mirror(*tile, attempt);
+    Origin * o = origin(*tile, m);
+    {
+        // Not queued once finish_tasks has cancelled what is waiting
+        std::lock_guard<std::mutex> lock(m_taskMutex);
+        if (m_stopping) {
+            return;
+        }
+        ++m_tasks;
+        ++m_busy[tile];
+        ++pending;
+        o->submit(this, [this, tile, attempt, m]() {
+            post_io(task(tile, std::bind(&Loader::download_image, this, tile, attempt, m)));
+            --pending;
+            done(tile);
+        });
+    }
+    pump(o);
+}
+
+void Loader::download_image(Tile* tile, int attempt, size_t mirror)
+{
+    Origin * const shard = origin(*tile, mirror);
+
+    // Started by the origin, so its slot is given back
+    if (m_stopping) {
+        shard->finished(Origin::ABANDONED, 0.0, 0);
+        pump(shard);
+        return;
+    }
+
     CURL* curl = curl_easy_init();
     if (curl == nullptr) {
         std::cerr << "Failed to initialize curl" << std::endl;
+        shard->finished(Origin::ABANDONED, 0.0, 0);
+        pump(shard);
+        ++failed;
+        download_failed(tile);
         return;
     }
 
@@ -96,12 +466,48 @@ void Loader::download_image(Tile* tile)
     std::string dir = dirname.str();
     boost::filesystem::create_directories(dir);
     std::string filename = tile->get_filename(m_tms, m_zxy, m_extension);
-    std::string url = m_prefix + filename;
+    std::string url = m_urls->url(mirror, tile->zoom, tile->x, tile->y);
     std::string file = m_dir + filename;
-    FILE* fp = fopen(file.c_str(), "wb");
+
+    // Written aside and renamed when complete, the cache never
+    // holds an error page or a truncated tile
+    std::string part = file + ".part";
+    FILE* fp = fopen(part.c_str(), "wb");
+    if (fp == nullptr) {
+        // The directory may just have been collected, empty
+        boost::filesystem::create_directories(dir);
+        fp = fopen(part.c_str(), "wb");
+    }
+    if (fp == nullptr) {
+        std::cerr << "Failed to write: " << part << std::endl;
+        curl_easy_cleanup(curl);
+        shard->finished(Origin::ABANDONED, 0.0, 0);
+        pump(shard);
+        ++failed;
+        download_failed(tile);
+        return;
+    }
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+
+    // Whatever we can decode, the smallest first
+    curl_slist * headers = NULL;
+    if (const char * types = accept()) {
+        headers = curl_slist_append(headers, (std::string("Accept: ") + types).c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+    // Error responses are checked below, with their headers
+    double retryAfter = 0.0;
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &retryAfter);
+
+    // Give up on a stalled server rather than hold an I/O thread
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 256L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 5L);
 
     curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1);
 
@@ -111,104 +517,682 @@ void Loader::download_image(Tile* tile)
 
     // Buffer for error message
     char errorMessage[CURL_ERROR_SIZE];
+    errorMessage[0] = '\0';
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorMessage);
 
+    const auto started = std::chrono::steady_clock::now();
     CURLcode res = curl_easy_perform(curl);
-    fclose(fp);
+    const double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    const long bytes = ftell(fp);
+    const bool written = fclose(fp) == 0;
     curl_easy_cleanup(curl);
-    if (res != CURLE_OK) {
-        std::cerr << "Failed to download: " << url << " " << errorMessage << std::endl;
-    } else {
-        tile->texid = 0;
+    curl_slist_free_all(headers);
+
+    // An empty body is no tile, and would only be read back and fetched again
+    const bool ok = res == CURLE_OK && status < 400 && bytes > 0;
+    const bool linked = ok && written && link_duplicate(*tile, part, file, bytes);
+    if (linked || (ok && written && std::rename(part.c_str(), file.c_str()) == 0)) {
+        shard->finished(Origin::SUCCESS, latency, std::max(bytes, 0L));
+        pump(shard);
+
+        // Transcoded from what was there before
+        if (m_transcode) {
+            std::remove((file + ktx2_suffix).c_str());
+        }
+
+        // Hard links are already in the index
+        if (!linked) {
+            uint64_t a, b;
+            cache_location(*tile, a, b);
+            m_index->insert(tile->zoom, a, b, bytes);
+        }
         downloaded++;
+        read_image(tile);
+        return;
+    }
+    std::remove(part.c_str());
+
+    // Not found or forbidden won't change, anything else might
+    Origin::Outcome outcome = Origin::ABANDONED;
+    if (res != CURLE_OK) {
+        outcome = Origin::FAILED;
+    } else if (status == 429) {
+        outcome = Origin::THROTTLED;
+    } else if (status >= 500) {
+        outcome = Origin::FAILED;
+    } else if (status >= 400) {
+        outcome = Origin::REJECTED;
+    }
+    shard->finished(outcome, latency, 0, retryAfter);
+    pump(shard);
+
+    // Another mirror may have what this one hasn't
+    bool up = false;
+    for (size_t m = 0; m < m_origins.size(); ++m) {
+        up = up || origin(*tile, m)->available();
     }
+    const bool elsewhere = size_t(attempt + 1) < m_origins.size();
+    if ((outcome == Origin::REJECTED && !elsewhere) || attempt + 1 >= max_attempts || !up) {
+        std::cerr << "Failed to download: " << url << " ";
+        if (res == CURLE_OK) {
+            std::cerr << "HTTP " << status;
+        } else {
+            std::cerr << errorMessage;
+        }
+        std::cerr << std::endl;
+        ++failed;
+        download_failed(tile);
+        return;
+    }
+
+    // Try again later, after the origin asks, and queue behind its limits
+    ++retried;
+    const double delay = std::max(backoff(attempt), retryAfter);
+    later(delay, tile, [this, tile, attempt]() { fetch(tile, attempt + 1); });
 }
 
 void Loader::load_image(Tile& tile)
 {
-    std::string filename = m_dir + tile.get_filename(m_tms, m_zxy, m_extension);
-    if (!boost::filesystem::exists(filename)) {
-        service->post(boost::bind(&Loader::download_image, this, &tile));
+    // Deeper levels are drawn from an ancestor
+    if (tile.zoom > m_maxZoom) {
+        return;
+    }
+
+    // Decided in memory, no file system access here
+    uint64_t a, b;
+    cache_location(tile, a, b);
+    switch (m_index->find(tile.zoom, a, b))
+    {
+        case CacheIndex::PRESENT:
+            m_index->touch(tile.zoom, a, b);
+            post_io(task(&tile, std::bind(&Loader::read_image, this, &tile)));
+            break;
+
+        case CacheIndex::ABSENT:
+            // Offline, only what is already cached
+            if (online()) {
+                fetch(&tile, 0);
+            }
+            break;
+
+        case CacheIndex::UNKNOWN:
+            // The index isn't ready yet, look on an I/O thread
+            post_io(task(&tile, std::bind(&Loader::check_cache, this, &tile)));
+            break;
+    }
+}
+
+bool Loader::indexed() const
+{
+    return m_index->ready();
+}
+
+std::vector<uint64_t> Loader::cached() const
+{
+    return m_index->keys();
+}
+
+void Loader::freeze(const std::vector<uint64_t> & keys)
+{
+    m_index->freeze(keys);
+}
+
+void Loader::quota(uint64_t bytes, uint64_t tiles)
+{
+    const bool started = m_index->limited();
+    m_index->quota(bytes, tiles);
+    if (!started && m_index->limited()) {
+        std::shared_ptr<CacheIndex> index = m_index;
+        post_background(1.0, [index]() { collect(index); });
+    }
+}
+
+void Loader::pin(uint64_t west, uint64_t south, uint64_t east, uint64_t north, uint16_t minZoom, uint16_t maxZoom)
+{
+    for (uint16_t z = minZoom; z <= std::min(maxZoom, m_maxZoom); ++z) {
+        // Tiles across the region, mapped as cache_location
+        const uint64_t x0 = z ? west  >> (64 - z) : 0;
+        const uint64_t x1 = z ? east  >> (64 - z) : 0;
+        const uint64_t y0 = z ? south >> (64 - z) : 0;
+        const uint64_t y1 = z ? north >> (64 - z) : 0;
+        uint64_t a0 = x0, a1 = x1;
+        uint64_t b0 = m_tms ? y0 : (uint64_t(1)<<z) - 1 - y1;
+        uint64_t b1 = m_tms ? y1 : (uint64_t(1)<<z) - 1 - y0;
+        if (!m_zxy) {
+            std::swap(a0, b0);
+            std::swap(a1, b1);
+        }
+        m_index->pin(z, a0, a1, b0, b1);
+    }
+}
+
+uint64_t Loader::cache_bytes() const
+{
+    return m_index->bytes();
+}
+
+void Loader::report(std::ostream & os) const
+{
+    m_index->report(os);
+    os << ", " << m_linked << " linked to identical tiles, "
+       << m_sharedTiles << " shared decodes, " << m_uniformTiles << " uniform, "
+       << m_transcoded << " loaded transcoded";
+}
+
+bool Loader::online() const
+{
+    return !m_origins.empty() && !m_index->frozen();
+}
+
+void Loader::check_cache(Tile * tile)
+{
+    if (m_stopping) {
         return;
     }
-    if (boost::filesystem::file_size(filename) == 0) {
-        boost::filesystem::remove(filename);
-        service->post(boost::bind(&Loader::download_image, this, &tile));
+
+    uint64_t a, b;
+    cache_location(*tile, a, b);
+
+    std::string filename = cache_filename(*tile);
+    boost::system::error_code error;
+    const uintmax_t bytes = boost::filesystem::file_size(filename, error);
+    if (bytes > 0 && !error) {
+        m_index->insert(tile->zoom, a, b, bytes);
+        read_image(tile);
         return;
     }
 
-    open_image(tile);
+    if (online()) {
+        fetch(tile, 0);
+    }
 }
 
-void Loader::open_image(Tile &tile)
+void Loader::read_image(Tile * tile)
 {
-    std::string filename = m_dir + tile.get_filename(m_tms, m_zxy, m_extension);
-    SDL_Surface *texture = IMG_Load(filename.c_str());
+    if (m_stopping) {
+        return;
+    }
 
-    if (texture)
+    const std::string filename = cache_filename(*tile);
+
+    std::shared_ptr<Cached> cached = std::make_shared<Cached>();
+    if (!read_file(filename, cached->data))
     {
-        if (SDL_MUSTLOCK(texture))
-        {
-            SDL_LockSurface(texture);
+        read_failed(tile);
+        return;
+    }
+
+    // Transcoded before, so no image decoding at all
+    if (m_transcode)
+    {
+        std::shared_ptr<Ktx2> ktx2 = std::make_shared<Ktx2>();
+        if (ktx2->read(filename + ktx2_suffix)) {
+            cached->ktx2 = ktx2;
         }
+    }
 
-        GLenum format;
-        GLint internalFormat;
-        if (texture->format->BytesPerPixel == 4) {
-            if (texture->format->Rmask == 0x000000ff) {
-                format = GL_RGBA;
-                internalFormat = GL_RGBA8;
-            } else {
-                format = GL_BGRA;
-                internalFormat = GL_RGBA8;
+    // Only the decoding is left for the CPU threads
+    post_cpu(task(tile, [this, tile, cached] {
+        if (!m_stopping) {
+            decode_image(tile, *cached);
+        }
+    }));
+}
+
+void Loader::read_failed(Tile * tile)
+{
+    // Empty or unreadable, truncated by a crash or changed behind our
+    // back, so out of the cache and downloaded again
+    const std::string filename = cache_filename(*tile);
+    boost::system::error_code error;
+    boost::filesystem::remove(filename, error);
+    std::remove((filename + ktx2_suffix).c_str());
+
+    uint64_t a, b;
+    cache_location(*tile, a, b);
+    m_index->erase(tile->zoom, a, b);
+    if (online() && !boost::filesystem::exists(filename, error)) {
+        fetch(tile, 0);
+    }
+}
+
+void Loader::decode_failed(Tile * tile)
+{
+    // Read but not decodable, downloading again wouldn't help
+    if (boost::filesystem::exists(cache_filename(*tile))) {
+        return;
+    }
+
+    uint64_t a, b;
+    cache_location(*tile, a, b);
+    m_index->erase(tile->zoom, a, b);
+    if (online()) {
+        fetch(tile, 0);
+    }
+}
+
+bool Loader::link_duplicate(const Tile & tile, const std::string & part, const std::string & file, long bytes)
+{
+    // Identical tiles are mostly small, ocean or no data
+    std::vector<char> data;
+    if (bytes <= 0 || bytes > max_shared_bytes || !read_file(part, data)) {
+        return false;
+    }
+    const uint64_t hash = xxhash64(data.data(), data.size());
+
+    Blob blob = { file, tile.zoom, 0, 0 };
+    cache_location(tile, blob.a, blob.b);
+
+    Blob existing;
+    {
+        std::lock_guard<std::mutex> lock(m_blobMutex);
+        auto i = m_blobs.emplace(hash, blob);
+        if (i.second) {
+            return false;
+        }
+        existing = i.first->second;
+    }
+
+    // Only when byte for byte the same, and still there
+    std::vector<char> other;
+    boost::system::error_code error;
+    if (!read_file(existing.file, other) || other != data) {
+        std::lock_guard<std::mutex> lock(m_blobMutex);
+        m_blobs[hash] = blob;
+        return false;
+    }
+    boost::filesystem::remove(file, error);
+    boost::filesystem::create_hard_link(existing.file, file, error);
+    if (error) {
+        return false;
+    }
+    std::remove(part.c_str());
+    ++m_linked;
+
+    // The blocks are counted once, for whichever link is kept longest
+    m_index->link(tile.zoom, blob.a, blob.b, bytes, existing.z, existing.a, existing.b);
+    return true;
+}
+
+void Loader::cache_location(const Tile & tile, uint64_t & a, uint64_t & b) const
+{
+    // As get_filename, {z}/{a}/{b}
+    a = tile.x;
+    b = m_tms ? tile.y : (uint64_t(1)<<tile.zoom) - 1 - tile.y;
+    if (!m_zxy) std::swap(a, b);
+}
+
+std::string Loader::cache_filename(const Tile & tile) const
+{
+    return m_dir + tile.get_filename(m_tms, m_zxy, m_extension);
+}
+
+bool Loader::loaded(const Tile & tile) const
+{
+    return tile.texid != TileFactory::instance()->get_dummy();
+}
+
+// Every pixel the same, as RGBA
+static bool uniform(SDL_Surface * surface, uint32_t & colour)
+{
+    const int bpp = surface->format->BytesPerPixel;
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_LockSurface(surface);
+    }
+    const uint8_t * first = static_cast<const uint8_t *>(surface->pixels);
+    bool same = true;
+    for (int j = 0; same && j < surface->h; ++j) {
+        const uint8_t * row = first + size_t(j)*surface->pitch;
+        for (int i = 0; same && i < surface->w; ++i) {
+            same = std::memcmp(row + i*bpp, first, bpp) == 0;
+        }
+    }
+    if (same) {
+        uint32_t pixel = 0;
+        std::memcpy(&pixel, first, bpp);
+        uint8_t rgba[4];
+        SDL_GetRGBA(pixel, surface->format, &rgba[0], &rgba[1], &rgba[2], &rgba[3]);
+        std::memcpy(&colour, rgba, 4);
+    }
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_UnlockSurface(surface);
+    }
+    return same;
+}
+
+// Byte of the channel within a pixel
+static int channel(uint32_t mask)
+{
+    int offset = 0;
+    while (mask && !(mask & 0xff)) {
+        mask >>= 8;
+        ++offset;
+    }
+    return offset;
+}
+
+// The tile ready for the GPU, or none if it has to stay as it is
+static std::shared_ptr<Ktx2> to_ktx2(SDL_Surface * surface, bool uniform, uint32_t colour)
+{
+    std::shared_ptr<Ktx2> ktx2 = std::make_shared<Ktx2>();
+    if (uniform) {
+        ktx2->format = Ktx2::RGBA8;
+        ktx2->width = ktx2->height = 1;
+        ktx2->data.resize(4);
+        std::memcpy(ktx2->data.data(), &colour, 4);
+        return ktx2;
+    }
+
+    // BC1 has no alpha, and whole blocks only
+    const SDL_PixelFormat * format = surface->format;
+    const int bpp = format->BytesPerPixel;
+    if (surface->w % 4 || surface->h % 4) {
+        return nullptr;
+    }
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_LockSurface(surface);
+    }
+    const uint8_t * pixels = static_cast<const uint8_t *>(surface->pixels);
+    bool opaque = true;
+    if (bpp == 4 && format->Amask) {
+        const int a = channel(format->Amask);
+        for (int j = 0; opaque && j < surface->h; ++j) {
+            const uint8_t * row = pixels + size_t(j)*surface->pitch;
+            for (int i = 0; opaque && i < surface->w; ++i) {
+                opaque = row[i*4 + a] == 255;
             }
-        } else if (texture->format->BytesPerPixel == 3) {
-            if (texture->format->Rmask == 0x000000ff) {
-                format = GL_RGB;
-                internalFormat = GL_RGB8;
+        }
+    }
+    if (opaque) {
+        ktx2->format = Ktx2::BC1;
+        ktx2->width = surface->w;
+        ktx2->height = surface->h;
+        bc1_encode(pixels, surface->w, surface->h, surface->pitch, bpp,
+                   channel(format->Rmask), channel(format->Gmask), channel(format->Bmask), ktx2->data);
+    }
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_UnlockSurface(surface);
+    }
+    return opaque ? ktx2 : nullptr;
+}
+
+void Loader::decode_image(Tile * tile, const Cached & cached)
+{
+    const std::vector<char> & data = cached.data;
+
+    // Identical payloads are decoded once and share a texture, tiles
+    // arriving while the first is decoded wait for it
+    const uint64_t hash = xxhash64(data.data(), data.size());
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto i = m_shared.find(hash);
+        if (i != m_shared.end()) {
+            if (i->second.texid) {
+                // Held for the tile until it is uploaded
+                ++m_textures[i->second.texid].refs;
+                m_decoded.push_back(Decoded{tile, NULL, 0, 0, hash, i->second.texid, false, 0, nullptr});
             } else {
-                format = GL_BGR;
-                internalFormat = GL_RGB8;
+                i->second.waiting.push_back(tile);
             }
+            hold(tile);
+            ++m_sharedTiles;
+            return;
+        }
+        m_shared[hash];
+    }
+
+    // Transcoded before, so no image decoding at all
+    if (cached.ktx2)
+    {
+        const std::shared_ptr<Ktx2> & ktx2 = cached.ktx2;
+        Decoded d = { tile, NULL, 0, 0, hash, 0, false, 0, nullptr };
+        if (ktx2->format == Ktx2::RGBA8 && ktx2->width == 1 && ktx2->height == 1) {
+            d.uniform = true;
+            std::memcpy(&d.colour, ktx2->data.data(), 4);
+        } else if (ktx2->format == Ktx2::BC1) {
+            m_tileSize = ktx2->width;
+            d.ktx2 = ktx2;
+        }
+        if (d.uniform || d.ktx2) {
+            ++m_transcoded;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_decoded.push_back(d);
+            hold(tile);
+            return;
+        }
+    }
+
+    SDL_Surface *texture = IMG_Load_RW(SDL_RWFromConstMem(data.data(), int(data.size())), 1);
+    if (texture && texture->format->BytesPerPixel != 3 && texture->format->BytesPerPixel != 4) {
+        SDL_PixelFormat* pformat = SDL_AllocFormat(SDL_PIXELFORMAT_BGR24);
+        SDL_Surface* tmp = SDL_ConvertSurface(texture, pformat, 0);
+        SDL_FreeFormat(pformat);
+        SDL_FreeSurface(texture);
+        texture = tmp;
+    }
+
+    if (!texture)
+    {
+        std::vector<Tile *> waiting;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto i = m_shared.find(hash);
+            waiting.swap(i->second.waiting);
+            m_shared.erase(i);
+        }
+        decode_failed(tile);
+        for (Tile * t : waiting) {
+            decode_failed(t);
+            unhold(t);
+        }
+        return;
+    }
+
+    // Whatever the source serves, 256 until known
+    m_tileSize = texture->w;
+
+    GLenum format;
+    GLint internalFormat;
+    if (texture->format->BytesPerPixel == 4) {
+        if (texture->format->Rmask == 0x000000ff) {
+            format = GL_RGBA;
+            internalFormat = GL_RGBA8;
+        } else {
+            format = GL_BGRA;
+            internalFormat = GL_RGBA8;
+        }
+    } else {
+        if (texture->format->Rmask == 0x000000ff) {
+            format = GL_RGB;
+            internalFormat = GL_RGB8;
         } else {
-//            std::cout << "INVALID (" << SDL_GetPixelFormatName(texture->format->format);
-            SDL_PixelFormat* pformat = SDL_AllocFormat(SDL_PIXELFORMAT_BGR24);
-            SDL_Surface* tmp = SDL_ConvertSurface(texture, pformat, 0);
             format = GL_BGR;
             internalFormat = GL_RGB8;
-            if (SDL_MUSTLOCK(texture)) {
-                SDL_UnlockSurface(texture);
+        }
+    }
+
+    Decoded d = { tile, texture, format, internalFormat, hash, 0, false, 0, nullptr };
+    d.uniform = uniform(texture, d.colour);
+
+    // Ready for the GPU, for this upload and from the disk next time
+    if (m_transcode)
+    {
+        std::shared_ptr<Ktx2> ktx2 = to_ktx2(texture, d.uniform, d.colour);
+        if (ktx2)
+        {
+            const std::string transcoded = cache_filename(*tile) + ktx2_suffix;
+            post_io([ktx2, transcoded]() { ktx2->write(transcoded); });
+            if (!d.uniform) {
+                d.ktx2 = ktx2;
             }
-            SDL_FreeSurface(texture);
-            texture = tmp;
-            if (SDL_MUSTLOCK(texture)) {
-                SDL_LockSurface(texture);
+        }
+    }
+
+    // One colour, or compressed, needs no pixels
+    if (d.uniform || d.ktx2) {
+        SDL_FreeSurface(texture);
+        d.surface = NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_decoded.push_back(d);
+    hold(tile);
+}
+
+size_t Loader::upload_images(size_t max)
+{
+    std::vector<Decoded> decoded;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_decoded.empty()) {
+            return 0;
+        }
+        if (m_decoded.size() <= max) {
+            decoded.swap(m_decoded);
+        } else {
+            // Leave the remainder for the next frame
+            decoded.assign(m_decoded.begin(), m_decoded.begin() + max);
+            m_decoded.erase(m_decoded.begin(), m_decoded.begin() + max);
+        }
+    }
+
+    for (auto & i : decoded)
+    {
+        // Already uploaded for an identical tile
+        if (i.texid) {
+            i.tile->texid = i.texid;
+            unhold(i.tile);
+            continue;
+        }
+
+        SDL_Surface *texture = i.surface;
+        GLuint texid = 0;
+
+        // One texel for each colour of uniform tiles
+        if (i.uniform) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto c = m_colours.find(i.colour);
+            if (c != m_colours.end()) {
+                texid = c->second;
             }
-//            std::cout << " -> " << SDL_GetPixelFormatName(texture->format->format) << ") ";
         }
 
-        GLuint texid;
-        glGenTextures(1, &texid);
-        glBindTexture(GL_TEXTURE_2D, texid);
+        if (!texid) {
+            glGenTextures(1, &texid);
+            glBindTexture(GL_TEXTURE_2D, texid);
 
-        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, texture->w, texture->h, 0, format, GL_UNSIGNED_BYTE, texture->pixels);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            if (i.uniform) {
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, &i.colour);
+            } else if (i.ktx2) {
+                glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, i.ktx2->width, i.ktx2->height, 0,
+                                       GLsizei(i.ktx2->data.size()), i.ktx2->data.data());
+            } else {
+                if (SDL_MUSTLOCK(texture)) {
+                    SDL_LockSurface(texture);
+                }
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, texture->pitch / texture->format->BytesPerPixel);
+                glTexImage2D(GL_TEXTURE_2D, 0, i.internalFormat, texture->w, texture->h, 0, i.format, GL_UNSIGNED_BYTE, texture->pixels);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                if (SDL_MUSTLOCK(texture)) {
+                    SDL_UnlockSurface(texture);
+                }
+            }
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        if (texture) {
+            SDL_FreeSurface(texture);
+        }
 
-        if (SDL_MUSTLOCK(texture)) {
-            SDL_UnlockSurface(texture);
+        // The tile, and any identical ones that waited for it
+        std::vector<Tile *> waiting;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Shared & shared = m_shared[i.hash];
+            shared.texid = texid;
+            waiting.swap(shared.waiting);
+
+            Texture & t = m_textures[texid];
+            t.refs += 1 + waiting.size();
+            t.hashes.push_back(i.hash);
+            if (i.uniform) {
+                t.uniform = true;
+                t.colour = i.colour;
+                m_colours[i.colour] = texid;
+                ++m_uniformTiles;
+            }
         }
-        SDL_FreeSurface(texture);
+        i.tile->texid = texid;
+        unhold(i.tile);
+        for (Tile * tile : waiting) {
+            tile->texid = texid;
+            unhold(tile);
+        }
+        m_uploads += waiting.size();
+    }
 
-        tile.texid = texid;
+    m_uploads += decoded.size();
+    return decoded.size();
+}
 
-//        std::cout << "SUCCESS" << std::endl;
-    } else {
-        tile.texid = TileFactory::instance()->get_dummy();
-//        std::cout << "FAILED" << std::endl;
+const char * Loader::accept() const
+{
+    // AVIF isn't decoded by SDL_image, so isn't asked for
+    return "image/webp,image/png,image/jpeg;q=0.9,*/*;q=0.5";
+}
+
+void Loader::transcode(bool enable)
+{
+    m_transcode = enable;
+    if (enable) {
+        m_index->sidecar(ktx2_suffix);
+    }
+}
+
+void Loader::release_texture(Tile & tile)
+{
+    const GLuint dummy = TileFactory::instance()->get_dummy();
+    if (tile.texid == dummy) {
+        return;
+    }
+
+    // Deleted with the last tile sharing it
+    bool last = true;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto i = m_textures.find(tile.texid);
+        if (i != m_textures.end()) {
+            last = --i->second.refs == 0;
+            if (last) {
+                for (uint64_t hash : i->second.hashes) {
+                    m_shared.erase(hash);
+                }
+                if (i->second.uniform) {
+                    m_colours.erase(i->second.colour);
+                }
+                m_textures.erase(i);
+            }
+        }
+    }
+    if (last) {
+        glDeleteTextures(1, &tile.texid);
+    }
+    tile.texid = dummy;
+}
+
+void Loader::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto & i : m_decoded) {
+        SDL_FreeSurface(i.surface);
     }
+    m_decoded.clear();
 }
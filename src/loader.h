@@ -25,31 +25,139 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "tile.h"
 
+struct SDL_Surface;
+class CacheIndex;
+class Ktx2;
+class Origin;
+class UrlTemplate;
+
 extern std::atomic<uint64_t> downloaded;
 
 class Loader
 {
 public:
-    Loader(bool tms, bool zxy, uint16_t maxZoom, const std::string & prefix, const std::string & extension, const std::string & dir)
-    : m_tms(tms), m_zxy(zxy), m_maxZoom(maxZoom), m_prefix(prefix), m_extension(extension), m_dir(dir)
-    { 
-        start(); 
-    }
-
-    ~Loader()
-    { 
-        stop();
-    }
+    // Tiles are downloaded from a URL template, see UrlTemplate, or from
+    // {prefix}{filename}, and cached under dir as {filename}.  An empty
+    // prefix for offline use of the cache alone.
+    Loader(bool tms, bool zxy, uint16_t maxZoom, const std::string & prefix, const std::string & extension, const std::string & dir);
+    virtual ~Loader();
 
     void load_image(Tile & tile);
-    void open_image(Tile & tile);
+
+    // Upload decoded images to OpenGL textures, returns the number uploaded
+    virtual size_t upload_images(size_t max = SIZE_MAX);
+
+    // Is there something to draw for the tile?
+    virtual bool loaded(const Tile & tile) const;
+
+    // Give back the tile's texture, deleted once no identical tile uses it
+    void release_texture(Tile & tile);
+
+    // Is the tile being loaded, or decoded and waiting for upload?
+    bool busy(const Tile & tile) const;
+
+    // Drop whatever is kept for a tile no longer busy, before the
+    // TileFactory releases it
+    virtual void forget(Tile & tile);
+
+    // Keep decoded tiles beside the cache as BC1 in KTX2, loaded again
+    // without decoding and uploaded compressed.  Needs S3TC support.
+    void transcode(bool enable);
 
     uint16_t maxZoom() const { return m_maxZoom; }
 
+    // Pixels across a tile, as decoded so far, and pixels of the source
+    // per logical pixel, 2 for @2x tiles
+    uint32_t tileSize() const { return m_tileSize; }
+    double   density() const  { return m_density; }
+
+    const std::string & prefix() const { return m_prefix; }
+    const std::string & extension() const { return m_extension; }
+    bool tms() const { return m_tms; }
+    bool zxy() const { return m_zxy; }
+    const std::string & dir()    const { return m_dir; }
+
+    // Is the cache index built, so that loading needs no I/O to decide?
+    bool indexed() const;
+
+    // Keys of the cached tiles, see CacheIndex
+    std::vector<uint64_t> cached() const;
+
+    // Only ever load these cached tiles, and download nothing
+    void freeze(const std::vector<uint64_t> & keys);
+
+    // Most bytes and tiles to keep in the disk cache, 0 for no limit.
+    // The least recently used are removed in the background while idle.
+    void quota(uint64_t bytes, uint64_t tiles);
+
+    // Keep the tiles of a region in quadtree coordinates, from minZoom
+    // to maxZoom, whatever the quota
+    void pin(uint64_t west, uint64_t south, uint64_t east, uint64_t north, uint16_t minZoom, uint16_t maxZoom);
+
+    // Size of the disk cache, its state against the quota, and what was
+    // shared between identical tiles
+    uint64_t cache_bytes() const;
+    void report(std::ostream & os) const;
+
+    // Number of textures uploaded so far
+    uint64_t uploads() const { return m_uploads; }
+
+    // Tasks waiting for the I/O threads (downloads, disk reads)
+    static size_t io_queued();
+    // Tasks waiting for the CPU threads (decode)
+    static size_t cpu_queued();
+    static size_t io_threads();
+    static size_t cpu_threads();
+    // No work queued or in progress for any loader
+    static bool idle();
+    // Downloads tried again after a transient failure, and given up
+    static uint64_t retries();
+    static uint64_t failures();
+
+protected:
+    // A cached tile as read from disk by an I/O thread
+    struct Cached
+    {
+        std::vector<char>     data;
+        // The transcoded copy beside it, when transcoding and present
+        std::shared_ptr<Ktx2> ktx2;
+    };
+
+    // Runs on the CPU pool with the bytes of the cached tile
+    virtual void decode_image(Tile * tile, const Cached & cached);
+
+    // Media types for the Accept header of downloads, or none
+    virtual const char * accept() const;
+
+    // Runs on an I/O thread when a download is given up
+    virtual void download_failed(Tile * /*tile*/) {}
+
+    // The cached tile couldn't be decoded, download it again if it has gone
+    void decode_failed(Tile * tile);
+
+    // Path of the tile in the disk cache
+    std::string cache_filename(const Tile & tile) const;
+
+    // Start no more work for this loader, drop what is queued and wait
+    // for what is running.  Called by the destructor, and first thing by
+    // that of a subclass whose decode_image uses its own members.
+    void finish_tasks();
+
+    uint64_t              m_uploads = 0;
+    std::atomic<uint32_t> m_tileSize;
+
 private:
     Loader(const Loader&) = delete;
 
@@ -59,11 +167,101 @@ private:
     bool              m_tms;
     bool              m_zxy;
     uint16_t          m_maxZoom;
+    const double      m_density;
 
     const std::string m_prefix;
     const std::string m_extension;
     const std::string m_dir;
 
+    // What is in the disk cache, so the render thread needn't look
+    std::shared_ptr<CacheIndex> m_index;
+
+    // Limits and health of each host of each mirror, shared with other loaders
+    std::unique_ptr<UrlTemplate>        m_urls;
+    std::vector<std::vector<Origin *>>  m_origins;
+
+    // Decoded by the CPU pool, waiting for upload by the render thread.
+    // The texture of an identical tile, a colour, compressed blocks, or
+    // else a surface.
+    struct Decoded
+    {
+        Tile        * tile;
+        SDL_Surface * surface;
+        GLenum        format;
+        GLint         internalFormat;
+        uint64_t      hash;
+        GLuint        texid;
+        bool          uniform;
+        uint32_t      colour;
+        std::shared_ptr<Ktx2> ktx2;
+    };
+
+    // Texture of a payload, 0 while decoding, with the tiles waiting for it
+    struct Shared
+    {
+        GLuint              texid = 0;
+        std::vector<Tile *> waiting;
+    };
+
+    // Tiles using a texture, and the payloads, or colour, it is for
+    struct Texture
+    {
+        uint32_t              refs    = 0;
+        std::vector<uint64_t> hashes;
+        bool                  uniform = false;
+        uint32_t              colour  = 0;
+    };
+
+    std::mutex           m_mutex;
+    std::vector<Decoded> m_decoded;
+    std::unordered_map<uint64_t, Shared>  m_shared;
+    std::unordered_map<GLuint, Texture>   m_textures;
+    std::unordered_map<uint32_t, GLuint>  m_colours;
+
+    // First cached file of each small payload, for hard links to it,
+    // and its tile as cache_location
+    struct Blob
+    {
+        std::string file;
+        uint16_t    z;
+        uint64_t    a, b;
+    };
+    static const long    max_shared_bytes = 16384;
+    std::mutex           m_blobMutex;
+    std::unordered_map<uint64_t, Blob> m_blobs;
+
+    std::atomic<uint64_t> m_linked{0};
+    std::atomic<uint64_t> m_sharedTiles{0};
+    std::atomic<uint64_t> m_uniformTiles{0};
+
+    std::atomic<bool>     m_transcode{false};
+    std::atomic<uint64_t> m_transcoded{0};
+
+    // Work of this loader queued or running, and timers to cancel
+    std::atomic<size_t>     m_tasks{0};
+    std::atomic<bool>       m_stopping{false};
+    mutable std::mutex      m_taskMutex;
+    std::condition_variable m_taskDone;
+    std::unordered_map<const void *, std::function<void()>> m_timers;
+
+    // Tasks and decoded images of each busy tile
+    std::unordered_map<const Tile *, uint32_t> m_busy;
+
+    std::function<void()> task(Tile * tile, std::function<void()> work);
+    void done(Tile * tile);
+    void later(double seconds, Tile * tile, std::function<void()> work);
+    void hold(const Tile * tile);
+    void unhold(const Tile * tile);
 
-    void download_image(Tile * tile);
+    void fetch(Tile * tile, int attempt);
+    void download_image(Tile * tile, int attempt, size_t mirror);
+    size_t mirror(const Tile & tile, int attempt) const;
+    Origin * origin(const Tile & tile, size_t mirror) const;
+    void check_cache(Tile * tile);
+    void read_image(Tile * tile);
+    void read_failed(Tile * tile);
+    bool link_duplicate(const Tile & tile, const std::string & part, const std::string & file, long bytes);
+    bool online() const;
+    void cache_location(const Tile & tile, uint64_t & a, uint64_t & b) const;
+    void clear();
 };
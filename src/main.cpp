@@ -24,6 +24,11 @@
  */
 
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
 
 #include <unistd.h>
 #include <time.h>
@@ -43,218 +48,208 @@
 #include "loader.h"
 #include "input.h"
 #include "global.h"
+#include "vectorloader.h"
+#include "terrain.h"
+#include "render.h"
+#include "pacer.h"
+#include "server.h"
+#include "session.h"
+#include "offscreen.h"
+#include "origin.h"
+#include "batch.h"
+#include "track.h"
+#include "marker.h"
+#include "timeseries.h"
+#include "heatmap.h"
+#include "geo.h"
 
 #include <cmath>
 
-// Compute the bottom left tile, and tile grid size
-void visibleBounds(uint64_t width, uint64_t height, uint64_t bits, uint64_t z, uint64_t x, uint64_t y, uint64_t tile[2], uint64_t size[2])
+// Upload decoded tiles, one at a time from each loader, until the deadline
+static size_t upload(double deadline)
 {
-   tile[0] = x - ((width >>1)<<(64-z-bits));
-   tile[1] = y - ((height>>1)<<(64-z-bits));
-
-   if (z>0)
-   {
-       tile[0] >>= (64-z);
-       tile[1] >>= (64-z);
-   }
-   else
-   {
-       tile[0] = 0;
-       tile[1] = 0;
-   }
-
-   const uint64_t tileSize = uint64_t(1)<<bits;
-   size[0] = (width/tileSize) + 2;
-   size[1] = (height/tileSize) + 2;
-}
-
-void drawTiles(Loader & loader, GLsizei width, GLsizei height, double zf, uint16_t z, uint64_t x, uint64_t y)
-{
-    const uint16_t bits = 9;
-    const uint64_t tileSize = uint64_t(1)<<bits;
-    const uint64_t levelSize = uint64_t(1)<<z;
-
-    // View bounds in quad-tree co-ordinates, based on viewport center at x, y
-    uint64_t tile[2];
-    uint64_t size[2];
-    visibleBounds(width/zf, height/zf, bits, z, x, y, tile, size);
-
-    // Offset in pixels from bottom left to center
-    const uint64_t fx = (x - (tile[0]<<(64-z))) >> (64-bits-z);
-    const uint64_t fy = (y - (tile[1]<<(64-z))) >> (64-bits-z);
-
-//  std::cout << bits << " " << tileSize << " " << " " << fx << " " << fy << std::endl;
+    Loader * loaders[] = { &basemap, vectors.get(), terrain.get() };
 
-    // Render the slippy map parts
-
-    uint64_t j = 0;
-    for (uint64_t y = tile[1]; j<=size[1]; ++y, ++j)
+    size_t total = 0;
+    size_t uploaded;
+    do
     {
-        uint64_t i = 0;
-        for (uint64_t x = tile[0]; i<=size[0]; ++x, ++i)
+        uploaded = 0;
+        for (Loader * loader : loaders)
         {
-//            std::cout << z << "/" << (x>>16) << "/" << (y>>16) << std::endl;
-            Tile * current = TileFactory::instance()->get_tile(loader, z, x%levelSize, y%levelSize);
-            if (current->valid())
+            if (loader)
             {
-                float minUV[2] = { 0, 0 };
-                float maxUV[2] = { 1, 1 };
-
-                // Dummy means it doesn't exist or hasn't loaded yet
-                // If so, look for an ancestor
-                if (current->texid == TileFactory::instance()->get_dummy())
-                {
-                     while (current && current->texid==TileFactory::instance()->get_dummy())
-                     {
-                        current = current->get_parent(loader, minUV, maxUV);
-                        if (current && current->texid == 0)
-                        {
-                            loader.open_image(*current);
-                        }
-                    }
-                }
-                else
-                {
-                    if (current && current->texid == 0)
-                    {
-                        loader.open_image(*current);
-                    }
-                }
-
-                if (current && current->texid != TileFactory::instance()->get_dummy())
-                {
-                    glBindTexture(GL_TEXTURE_2D, current->texid);
-                    glPushMatrix();
-                        glScaled(zf, zf, 1);
-                        glTranslated(-double(fx), -double(fy), 0);
-                        glScaled(tileSize, tileSize, 1);
-                        glTranslated(i, j, 0);
-                        glBegin(GL_QUADS);
-                            glTexCoord2f(minUV[0], minUV[1]); glVertex2f(0.0, 0.0);
-                            glTexCoord2f(minUV[0], maxUV[1]); glVertex2f(0.0, 1.0);
-                            glTexCoord2f(maxUV[0], maxUV[1]); glVertex2f(1.0, 1.0);
-                            glTexCoord2f(maxUV[0], minUV[1]); glVertex2f(1.0, 0.0);
-                        glEnd();
-                    glPopMatrix();
-                }
+                uploaded += loader->upload_images(1);
             }
         }
+        if (series)
+        {
+            uploaded += series->upload_images(1);
+        }
+        if (heatmap)
+        {
+            uploaded += heatmap->upload_images(1);
+        }
+        total += uploaded;
     }
-}
+    while (uploaded && FramePacer::now() < deadline);
 
-Loader basemap(false, false, 19, "https://server.arcgisonline.com/ArcGIS/rest/services/World_Topo_Map/MapServer/tile/", "", "./base/");
-//Loader basemap(false, true, "https://tile.openstreetmap.org/", ".png", "./osm/");
+    return total;
+}
 
-void render(double zoom, uint64_t x, uint64_t y)
+// Draw a replayed frame once every tile it needs has been loaded, so that
+// it is the same every time, and time the drawing alone
+static void replay_frame(const Simulation & simulation, Offscreen * offscreen, ReplayReport & report)
 {
-//    std::cout << zoom << std::endl;
-
-    const uint16_t z = std::ceil(zoom);
-    const double zf = std::pow(2.0, zoom-z);
-
-    // Clear with black
-    glClearColor(0.0, 0.0, 0.0, 0.0);
-    glClear(GL_COLOR_BUFFER_BIT);
+    s_player_state camera = player_state;
+    simulation.interpolate(camera.x, camera.y);
 
-    glMatrixMode(GL_TEXTURE);
-    glLoadIdentity();
-    glScalef(1.0,-1.0,1.0);
-    glTranslatef(0.0,-1.0,0.0);
+    const double start = FramePacer::now();
+    size_t uploads = 0;
+    size_t uploaded;
+    do
+    {
+        update_views(camera);
+        while (!Loader::idle() || (heatmap && !heatmap->idle()))
+        {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+        uploaded = upload(std::numeric_limits<double>::infinity());
+        uploads += uploaded;
+    }
+    while (uploaded);
+    const double settled = FramePacer::now();
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(-(window_state.width / 2), (window_state.width / 2), -(window_state.height / 2), (window_state.height / 2), -1000, 1000);
+    const GLsizei width  = window_state.width*window_state.scale;
+    const GLsizei height = window_state.height*window_state.scale;
+    if (offscreen && offscreen->resize(width, height))
+    {
+        offscreen->bind();
+    }
+    else
+    {
+        offscreen = NULL;
+    }
 
-    glPushMatrix();
+    render_views();
+    glFinish();
+    const double drawn = FramePacer::now();
 
-        // Rotate and and tilt the world geometry
-        glRotated(viewport_state.angle_tilt, 1.0, 0.0, 0.0);
-        glRotated(viewport_state.angle_rotate, 0.0, 0.0, -1.0);
+    std::vector<uint8_t> pixels;
+    Offscreen::read(width, height, pixels);
 
-        // Draw tiles
-        glEnable(GL_BLEND);
-        glEnable(GL_TEXTURE_2D);
+    if (offscreen)
+    {
+        offscreen->unbind();
+    }
+    else
+    {
+        SDL_GL_SwapWindow(window);
+    }
 
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-            glColor4d(1.0, 1.0, 1.0, 1.0);
+    report.frame(settled - start, drawn - settled, uploads, ReplayReport::hash(pixels));
+}
 
-            drawTiles(basemap, window_state.width, window_state.height, zf, z, x, y);
+// Extra views as fractions of the window and a zoom offset,
+// e.g. "0,0,0.5,1,0;0.5,0,0.5,1,-3" for side by side
+static void parse_views(const char * spec)
+{
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ';'))
+    {
+        View * v = new View();
+        char sep;
+        std::stringstream is(item);
+        if (is >> v->left >> sep >> v->bottom >> sep >> v->width >> sep >> v->height >> sep >> v->zoomOffset)
+        {
+            v->orient = v->zoomOffset == 0.0;
+            views.emplace_back(v);
+        }
+        else
+        {
+            std::cerr << "Could not parse view: " << item << std::endl;
+            delete v;
+        }
+    }
+}
 
-        glDisable(GL_TEXTURE_2D);
-        glDisable(GL_BLEND);
+// Bytes with an optional K, M or G suffix
+static uint64_t parse_size(const std::string & s)
+{
+    char * end = NULL;
+    const double value = std::strtod(s.c_str(), &end);
+    switch (end ? *end : 0)
+    {
+        case 'k': case 'K': return uint64_t(value*1024.0);
+        case 'm': case 'M': return uint64_t(value*1024.0*1024.0);
+        case 'g': case 'G': return uint64_t(value*1024.0*1024.0*1024.0);
+        default:            return uint64_t(value);
+    }
+}
 
-        // Draw grid
-        if (player_state.grid)
+// Disk cache quotas, [dir=]bytes[,tiles] for each, all caches without a dir,
+// e.g. "2G;./terrain/=500M,100000".  Pinned regions are kept whatever the
+// quota, west,south,east,north[,minzoom,maxzoom] in degrees,
+// e.g. "-123.3,49.1,-122.9,49.4,0,16"
+static void configure_cache(const std::vector<Loader *> & loaders)
+{
+    if (const char * spec = std::getenv("SLIPPYMAP_CACHE_QUOTA"))
+    {
+        std::stringstream ss(spec);
+        std::string item;
+        while (std::getline(ss, item, ';'))
         {
-            // Translation as fraction of 512
-            const uint64_t fx = (x<<z)>>(64-9);
-            const uint64_t fy = (y<<z)>>(64-9);
-
-            glColor3d(1.0, 1.0, 1.0);
-            glPushMatrix();
-                glScalef(zf, zf, 1.0);
-                glTranslated(-double(fx), -double(fy), 0);
-                glScalef(512.0, 512.0, 1.0);
-
-                static const int left = -4;
-                static const int right = 4;
-                static const int top = 3;
-                static const int bottom = -3;
-
-                // Start 'left' and 'top' tiles from the center tile and render down to 'bottom' and
-                // 'right' tiles from the center tile
-                Tile * center = TileFactory::instance()->get_tile_at(basemap, z+1, x, y);
-                Tile* current = center->get(basemap, left, bottom);
-                for (int y = bottom; y <= top; y++) {
-                    for (int x = left; x <= right; x++) {
-
-                        if (current->valid())
-                        {
-                            // Render the tile itself at the correct position
-                            glPushMatrix();
-                                glTranslated(x, y, 0);
-                                glBegin(GL_LINE_LOOP);
-                                    glVertex2f(0.0, 0.0);
-                                    glVertex2f(0.0, 1.0);
-                                    glVertex2f(1.0, 1.0);
-                                    glVertex2f(1.0, 0.0);
-                                    glVertex2f(0.0, 0.0);
-                                glEnd();
-                            glPopMatrix();
-                        }
-                        current = current->get_west(basemap);
-                    }
-                    current = current->get(basemap, -(std::abs(left) + std::abs(right) + 1), 1);
+            std::string dir;
+            const size_t eq = item.find('=');
+            if (eq != std::string::npos)
+            {
+                dir = item.substr(0, eq);
+                item = item.substr(eq + 1);
+            }
+            const size_t comma = item.find(',');
+            const uint64_t bytes = parse_size(item.substr(0, comma));
+            const uint64_t tiles = comma == std::string::npos ? 0 : std::strtoull(item.c_str() + comma + 1, NULL, 10);
+            for (Loader * loader : loaders)
+            {
+                if (loader && (dir.empty() || dir == loader->dir()))
+                {
+                    loader->quota(bytes, tiles);
                 }
-            glPopMatrix();
+            }
         }
+    }
 
-    glPopMatrix();
-
-    // Draw grid
-    if (player_state.cross)
-    {
-        glColor3d(0.0, 0.0, 0.0);
-        glLineWidth(3.0);
-        glBegin(GL_LINES);
-            glVertex2f(-6,  0);
-            glVertex2f( 6,  0);
-            glVertex2f( 0, -6);
-            glVertex2f( 0,  6);
-        glEnd();
-
-        glColor3d(1.0, 1.0, 1.0);
-        glLineWidth(1.0);
-        glBegin(GL_LINES);
-            glVertex2f(-5,  0);
-            glVertex2f( 5,  0);
-            glVertex2f( 0, -5);
-            glVertex2f( 0,  5);
-        glEnd();
+    if (const char * spec = std::getenv("SLIPPYMAP_CACHE_PINS"))
+    {
+        std::stringstream ss(spec);
+        std::string item;
+        while (std::getline(ss, item, ';'))
+        {
+            double west, south, east, north;
+            int minZoom = 0, maxZoom = 30;
+            char sep;
+            std::stringstream is(item);
+            if (!(is >> west >> sep >> south >> sep >> east >> sep >> north))
+            {
+                std::cerr << "Could not parse pinned region: " << item << std::endl;
+                continue;
+            }
+            is >> sep >> minZoom >> sep >> maxZoom;
+            for (Loader * loader : loaders)
+            {
+                if (loader)
+                {
+                    loader->pin(longitude_to_x(west), latitude_to_y(south),
+                                longitude_to_x(east), latitude_to_y(north),
+                                std::max(minZoom, 0), std::max(maxZoom, 0));
+                }
+            }
+        }
     }
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     // Initialize CURL
     if (curl_global_init(CURL_GLOBAL_ALL) != 0)
@@ -263,17 +258,51 @@ int main()
         return 1;
     }
 
+    // Serve the basemap cache to other instances, e.g. --serve 8080
+    if (argc > 1 && std::string(argv[1]) == "--serve")
+    {
+        TileServer server(argc > 2 ? std::atoi(argv[2]) : 8080,
+                          argc > 3 ? argv[3] : basemap.prefix(),
+                          argc > 4 ? argv[4] : basemap.dir(),
+                          basemap.tms(), basemap.zxy(), basemap.extension());
+        server.run();
+        return 0;
+    }
+
+    // Replay a recorded session, e.g. SLIPPYMAP_REPLAY=session.log
+    std::unique_ptr<SessionPlayer> player;
+    if (const char * filename = std::getenv("SLIPPYMAP_REPLAY"))
+    {
+        player.reset(new SessionPlayer());
+        if (!player->open(filename))
+        {
+            return 1;
+        }
+        replaying = player.get();
+    }
+
+    // Static maps from a job file, e.g. --render jobs.txt maps 4
+    const bool batch = argc > 2 && std::string(argv[1]) == "--render";
+
+    // Replay with the window hidden, drawing offscreen
+    const bool headless = batch || (replaying && std::getenv("SLIPPYMAP_HEADLESS"));
+
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cerr << "Could not initialize SDL video: " << SDL_GetError() << std::endl;
         return 1;
     }
 
-    // Swap on vsync
-    SDL_GL_SetSwapInterval(1);
+    // Swap on vsync, unless replaying as fast as possible
+    SDL_GL_SetSwapInterval(replaying ? 0 : 1);
+
+    // Depth buffer for terrain
+    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
 
     // Create an OpenGL window
-    window = SDL_CreateWindow("slippymap3d", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1024, 768, SDL_WINDOW_SHOWN | SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+    window = SDL_CreateWindow("slippymap3d", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                              replaying ? replaying->width() : 1024, replaying ? replaying->height() : 768,
+                              (headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN) | SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
     if (!window) {
         std::cerr << "Could not create SDL window: " << SDL_GetError() << std::endl;
         SDL_Quit();
@@ -281,22 +310,212 @@ int main()
     }
     SDL_GetWindowSize(window, &window_state.width, &window_state.height);
     SDL_GLContext context = SDL_GL_CreateContext(window);
+    update_scale();
+
+    // Initialize GLEW for framebuffer objects
+    GLenum err = glewInit();
+    if (err != GLEW_OK) {
+        std::cerr << "Could not initialize GLEW: " << glewGetErrorString(err) << std::endl;
+    }
+
+    // Basemap tiles kept compressed for the GPU, e.g. SLIPPYMAP_TRANSCODE=1
+    if (const char * transcode = std::getenv("SLIPPYMAP_TRANSCODE"))
+    {
+        if (!GLEW_EXT_texture_compression_s3tc) {
+            std::cerr << "No S3TC texture compression, tiles are not transcoded" << std::endl;
+        } else if (std::atoi(transcode)) {
+            basemap.transcode(true);
+        }
+    }
+
+    // GPS tracks over the map, e.g. SLIPPYMAP_TRACKS="ride.gpx;fleet.geojson"
+    if (const char * files = std::getenv("SLIPPYMAP_TRACKS"))
+    {
+        tracks.reset(new TrackLayer());
+        std::stringstream ss(files);
+        std::string filename;
+        while (std::getline(ss, filename, ';'))
+        {
+            tracks->load(filename);
+        }
+        const double start = FramePacer::now();
+        tracks->index();
+        std::cout << tracks->points() << " track points in " << tracks->lines() << " lines, indexed in "
+                  << FramePacer::now() - start << " s" << std::endl;
+    }
+
+    // Point markers, e.g. SLIPPYMAP_MARKERS=assets.csv of latitude, longitude and id
+    if (const char * files = std::getenv("SLIPPYMAP_MARKERS"))
+    {
+        markers.reset(new MarkerLayer());
+        std::stringstream ss(files);
+        std::string filename;
+        while (std::getline(ss, filename, ';'))
+        {
+            markers->load(filename);
+        }
+        const double start = FramePacer::now();
+        markers->index();
+        std::cout << markers->points() << " markers, clustered in " << FramePacer::now() - start << " s" << std::endl;
+    }
+
+    // Density of events, e.g. SLIPPYMAP_HEATMAP=events.csv of latitude, longitude and value
+    if (const char * files = std::getenv("SLIPPYMAP_HEATMAP"))
+    {
+        heatmap.reset(new HeatmapLayer());
+        std::stringstream ss(files);
+        std::string filename;
+        while (std::getline(ss, filename, ';'))
+        {
+            heatmap->load(filename);
+        }
+        const double start = FramePacer::now();
+        heatmap->index();
+        std::cout << heatmap->points() << " heatmap points, sorted in " << FramePacer::now() - start << " s" << std::endl;
+    }
+
+    if (batch)
+    {
+        configure_cache({ &basemap });
+
+        BatchRenderer renderer;
+        size_t written = 0;
+        if (renderer.open(argv[2], argc > 3 ? argv[3] : ""))
+        {
+            written = renderer.run(argc > 4 ? std::atoi(argv[4]) : 4);
+            renderer.summary(std::cout);
+            Origin::report(std::cout);
+            basemap.report(std::cout);
+            std::cout << std::endl;
+        }
+
+        release_views();
+        SDL_GL_DeleteContext(context);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+
+        return written ? 0 : 1;
+    }
+
+    // Vector tiles, e.g. https://example.com/tiles/ for {z}/{x}/{y}.pbf
+    if (const char * url = std::getenv("SLIPPYMAP_VECTOR_URL"))
+    {
+        vectors.reset(new VectorLoader(false, true, 14, url, ".pbf", "./vector/"));
+    }
+
+    // Elevation, Terrarium by default or Mapbox Terrain-RGB
+    {
+        const char * url = std::getenv("SLIPPYMAP_TERRAIN_URL");
+        const char * encoding = std::getenv("SLIPPYMAP_TERRAIN_ENCODING");
+        terrain.reset(new TerrainLoader(
+            encoding && std::string(encoding) == "mapbox" ? TerrainLoader::MAPBOX : TerrainLoader::TERRARIUM,
+            false, true, 15, url ? url : "https://s3.amazonaws.com/elevation-tiles-prod/terrarium/", ".png", "./terrain/"));
+    }
+
+    // Animated overlay, e.g. SLIPPYMAP_TIMESERIES_URL=https://example.com/radar/{t}/{z}/{x}/{y}.png
+    // and SLIPPYMAP_TIMESERIES_TIMES="2026-10-19T12:00;2026-10-19T12:10;..."
+    if (const char * url = std::getenv("SLIPPYMAP_TIMESERIES_URL"))
+    {
+        std::vector<std::string> times;
+        if (const char * list = std::getenv("SLIPPYMAP_TIMESERIES_TIMES"))
+        {
+            std::stringstream ss(list);
+            std::string time;
+            while (std::getline(ss, time, ';'))
+            {
+                if (!time.empty())
+                {
+                    times.push_back(time);
+                }
+            }
+        }
+        const char * fps = std::getenv("SLIPPYMAP_TIMESERIES_FPS");
+        const char * budget = std::getenv("SLIPPYMAP_TIMESERIES_BUDGET");
+        const char * maxZoom = std::getenv("SLIPPYMAP_TIMESERIES_MAXZOOM");
+        series.reset(new TimeSeries(url, times, maxZoom ? std::atoi(maxZoom) : 10, "", "./series/",
+                                    budget ? parse_size(budget) : 256*1024*1024));
+        series->set_rate(fps ? std::atof(fps) : 4.0);
+        std::cout << series->frames() << " time series frames" << std::endl;
+    }
+
+    // The main view fills the window, unless configured otherwise
+    if (const char * spec = std::getenv("SLIPPYMAP_VIEWS"))
+    {
+        parse_views(spec);
+    }
+    if (views.empty())
+    {
+        views.emplace_back(new View());
+    }
+
+    // Overview in the bottom right corner
+    {
+        View * minimap = new View();
+        minimap->left = 0.73;
+        minimap->bottom = 0.02;
+        minimap->width = 0.25;
+        minimap->height = 0.25;
+        minimap->zoomOffset = -5;
+        minimap->orient = false;
+        minimap->minimap = true;
+        views.emplace_back(minimap);
+    }
+
+    // Replays start from the camera and cache of the recording
+    const std::vector<Loader *> loaders = { &basemap, vectors.get(), terrain.get() };
+    configure_cache(loaders);
+    std::unique_ptr<SessionRecorder> recorder;
+    if (replaying)
+    {
+        replaying->start(loaders);
+    }
+    else if (const char * filename = std::getenv("SLIPPYMAP_RECORD"))
+    {
+        for (Loader * loader : loaders)
+        {
+            while (loader && !loader->indexed())
+            {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+            }
+        }
+        recorder.reset(new SessionRecorder());
+        if (recorder->open(filename, loaders))
+        {
+            recording = recorder.get();
+        }
+    }
+    Offscreen offscreen;
+    ReplayReport report;
+    bool replayed = false;
 
     clock_gettime(CLOCK_REALTIME, &timeKeyboardMouse);
 
+    FramePacer pacer;
+    SDL_DisplayMode mode;
+    if (SDL_GetWindowDisplayMode(window, &mode) == 0 && mode.refresh_rate > 0)
+    {
+        pacer.set_interval(1.0/mode.refresh_rate);
+    }
+    Simulation simulation;
+
     struct timespec spec;
     clock_gettime(CLOCK_REALTIME, &spec);
     long base_time = spec.tv_sec * 1000 + round(spec.tv_nsec / 1.0e6);
     int frames = 0;
     uint64_t d = 0;
+    double last = FramePacer::now();
 
     while (true)
     {
+        pacer.begin();
+
         if (!poll())
         {
             break;
         }
 
+        pacer.input();
+
         clock_gettime(CLOCK_REALTIME, &spec);
         long now = spec.tv_sec * 1000 + round(spec.tv_nsec / 1.0e6);
         long idle = timeKeyboardMouse.tv_sec * 1000 + round(timeKeyboardMouse.tv_nsec / 1.0e6);
@@ -304,25 +523,67 @@ int main()
         // Hide mouse after 5s user idle
         SDL_ShowCursor((now - idle) < 5000.0);
 
+        // Update position, if moving, in fixed steps
+        const double t = FramePacer::now();
+        const double elapsed = replaying ? replaying->elapsed() : t - last;
+        const bool moving = simulation.advance(elapsed);
+        last = t;
+
+        if (recording)
+        {
+            recording->frame(elapsed);
+        }
+
+        // Every change is drawn, however long the tiles take
+        if (replaying)
+        {
+            if (redisplay || moving || !replayed)
+            {
+                replay_frame(simulation, headless ? &offscreen : NULL, report);
+                redisplay = false;
+                replayed = true;
+            }
+            continue;
+        }
+
+        // Step the animation, once the next frame has loaded
+        if (series && series->advance(elapsed, player_state.animate))
+        {
+            redisplay = true;
+        }
+
+        // Upload tiles decoded by the loader threads, as time allows
+        if (upload(pacer.upload_deadline()))
+        {
+            redisplay = true;
+        }
+
         // Check for redisplay or new tiles downloaded
-        if (redisplay || d!=downloaded || velocity.x || velocity.y)
+        if (redisplay || d!=downloaded || moving)
         {
             d = downloaded;
             frames++;
 
-            // Update position, if moving
-            player_state.x += velocity.x;
-            player_state.y += velocity.y;
-
             if ((now - base_time) > 1000) {
-                std::cout << frames * 1000.0 / (now - base_time) << " fps" << std::endl;
+                std::cout << frames * 1000.0 / (now - base_time) << " fps";
+                std::cout << ", queued " << Loader::io_queued() << " I/O " << Loader::cpu_queued() << " CPU";
+                std::cout << ", missed " << pacer.missed() << ", upload budget " << pacer.upload_budget()*1000.0 << " ms";
+                std::cout << ", cache " << basemap.cache_bytes()/(1024*1024) << " MB" << std::endl;
                 base_time = now;
                 frames=0;
+                pacer.reset();
             }
 
-            render(player_state.zoom, player_state.x, player_state.y);
+            // Draw part way between simulation steps
+            s_player_state camera = player_state;
+            simulation.interpolate(camera.x, camera.y);
+
+            update_views(camera);
+            render_views();
             SDL_GL_SwapWindow(window);
             redisplay = false;
+
+            pacer.drawn();
         }
         else
         {
@@ -331,6 +592,37 @@ int main()
         }
     }
 
+    if (replaying)
+    {
+        const char * filename = std::getenv("SLIPPYMAP_REPLAY_REPORT");
+        report.write(filename ? filename : "replay.csv");
+        report.summary(std::cout);
+        replaying = NULL;
+    }
+    recording = NULL;
+
+    // How each tile server coped, and the disk caches
+    Origin::report(std::cout);
+    for (Loader * loader : loaders)
+    {
+        if (loader)
+        {
+            loader->report(std::cout);
+            std::cout << std::endl;
+        }
+    }
+    if (series)
+    {
+        series->report(std::cout);
+    }
+    if (heatmap)
+    {
+        heatmap->report(std::cout);
+    }
+
+    offscreen.release();
+    release_views();
+
     SDL_GL_DeleteContext(context);
     SDL_DestroyWindow(window);
     SDL_Quit();
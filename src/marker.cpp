@@ -0,0 +1,503 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+
+#include "marker.h"
+#include "geo.h"
+#include "render.h"
+#include "tilefactory.h"
+
+// Cells of a level z tile are level z+3, 8 across
+static const int cellBits = 3;
+
+// Deepest level a tile of markers is drawn at
+static const uint16_t deepest = 29;
+
+// Level 2 tiles, each a shard of the cells of the deeper levels
+static const size_t shards = 16;
+
+static size_t shard(uint64_t x, uint64_t y)
+{
+    return size_t(((y >> 62) << 2) | (x >> 62));
+}
+
+MarkerLayer::MarkerLayer()
+: m_texture(0), m_budget(1024), m_frame(0)
+{
+}
+
+MarkerLayer::~MarkerLayer()
+{
+}
+
+bool MarkerLayer::load(const std::string & filename)
+{
+    std::ifstream is(filename.c_str());
+    if (!is)
+    {
+        std::cerr << "Could not read " << filename << std::endl;
+        return false;
+    }
+
+    std::vector<double>   longitude;
+    std::vector<double>   latitude;
+    std::vector<uint64_t> ids;
+
+    // Latitude, longitude and id, separated by commas or spaces,
+    // anything else such as a header is skipped
+    std::string line;
+    while (std::getline(is, line))
+    {
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::stringstream ss(line);
+        double lat, lon;
+        if (!(ss >> lat >> lon))
+        {
+            continue;
+        }
+        uint64_t id;
+        if (!(ss >> id))
+        {
+            id = m_points.size() + ids.size();
+        }
+        longitude.push_back(lon);
+        latitude.push_back(lat);
+        ids.push_back(id);
+    }
+
+    std::vector<uint64_t> x(ids.size());
+    std::vector<uint64_t> y(ids.size());
+    to_quadtree(longitude.data(), latitude.data(), ids.size(), x.data(), y.data());
+
+    const bool indexed = !m_cells.empty();
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        if (indexed)
+        {
+            insert(ids[i], x[i], y[i]);
+            continue;
+        }
+        auto found = m_ids.find(ids[i]);
+        if (found != m_ids.end())
+        {
+            m_points[found->second].x = x[i];
+            m_points[found->second].y = y[i];
+            continue;
+        }
+        m_ids[ids[i]] = uint32_t(m_points.size());
+        m_points.push_back(Point{x[i], y[i], ids[i]});
+    }
+
+    if (ids.empty())
+    {
+        std::cerr << "No points in " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void MarkerLayer::add(Cells & cells, uint16_t z, const Point & p, int sign)
+{
+    const int shift = 64 - z - cellBits;
+    const uint64_t key = TileFactory::tile_key(z + cellBits, p.x >> shift, p.y >> shift);
+    const uint64_t mask = (uint64_t(1) << shift) - 1;
+
+    Cell & cell = cells[key];
+    cell.count += sign;
+    cell.sx += sign*double(p.x & mask);
+    cell.sy += sign*double(p.y & mask);
+    if (cell.count == 0)
+    {
+        cells.erase(key);
+    }
+}
+
+void MarkerLayer::coarsen(const Cells & fine, uint16_t z, Cells & coarse)
+{
+    // A level z cell is four level z+1 cells, with their sums moved
+    // from the corner of each to the corner of the larger cell
+    const int shift = 64 - (z + 1) - cellBits;
+    const uint64_t mask = (uint64_t(1) << 29) - 1;
+    coarse.reserve(coarse.size() + fine.size());
+    for (const auto & i : fine)
+    {
+        const uint64_t cx = (i.first >> 29) & mask;
+        const uint64_t cy = i.first & mask;
+        const Cell & f = i.second;
+
+        Cell & c = coarse[TileFactory::tile_key(z + cellBits, cx >> 1, cy >> 1)];
+        c.count += f.count;
+        c.sx += f.sx + f.count*double((cx & 1) << shift);
+        c.sy += f.sy + f.count*double((cy & 1) << shift);
+    }
+}
+
+MarkerLayer::Cells & MarkerLayer::cells(uint16_t z, uint64_t x, uint64_t y)
+{
+    return m_cells[z][z < 2 ? 0 : shard(x, y)];
+}
+
+const MarkerLayer::Cells & MarkerLayer::cells(uint16_t z, uint64_t x, uint64_t y) const
+{
+    return m_cells[z][z < 2 ? 0 : shard(x, y)];
+}
+
+void MarkerLayer::index()
+{
+    m_cells.assign(levels, std::vector<Cells>(shards));
+    m_members.clear();
+
+    std::vector<std::vector<uint32_t>> sharded(shards);
+    for (uint32_t i = 0; i < m_points.size(); ++i)
+    {
+        sharded[shard(m_points[i].x, m_points[i].y)].push_back(i);
+    }
+
+    // The points of the deepest tiles, alongside the clusters
+    std::vector<std::future<void>> tasks;
+    tasks.push_back(std::async(std::launch::async, [this]()
+    {
+        const uint16_t z = levels - 1;
+        for (uint32_t i = 0; i < m_points.size(); ++i)
+        {
+            m_members[TileFactory::tile_key(z, m_points[i].x >> (64 - z), m_points[i].y >> (64 - z))].push_back(i);
+        }
+    }));
+
+    // Each shard from the points up to level 2
+    for (size_t k = 0; k < shards; ++k)
+    {
+        tasks.push_back(std::async(std::launch::async, [this, k, &sharded]()
+        {
+            Cells & deepest = m_cells[levels - 1][k];
+            deepest.reserve(sharded[k].size());
+            for (uint32_t i : sharded[k])
+            {
+                add(deepest, levels - 1, m_points[i], 1);
+            }
+            for (uint16_t z = levels - 1; z-- > 2; )
+            {
+                coarsen(m_cells[z + 1][k], z, m_cells[z][k]);
+            }
+        }));
+    }
+    for (auto & i : tasks)
+    {
+        i.get();
+    }
+
+    // Levels 1 and 0 from every shard
+    for (size_t k = 0; k < shards; ++k)
+    {
+        coarsen(m_cells[2][k], 1, m_cells[1][0]);
+    }
+    coarsen(m_cells[1][0], 0, m_cells[0][0]);
+
+    for (auto & i : m_batches)
+    {
+        if (i.second.buffer)
+        {
+            m_stale.push_back(i.second.buffer);
+        }
+    }
+    m_batches.clear();
+}
+
+void MarkerLayer::update(uint32_t index, int sign)
+{
+    const Point & p = m_points[index];
+
+    if (!m_cells.empty())
+    {
+        for (uint16_t z = 0; z < levels; ++z)
+        {
+            add(cells(z, p.x, p.y), z, p, sign);
+        }
+
+        const uint16_t z = levels - 1;
+        const uint64_t key = TileFactory::tile_key(z, p.x >> (64 - z), p.y >> (64 - z));
+        std::vector<uint32_t> & members = m_members[key];
+        if (sign > 0)
+        {
+            members.push_back(index);
+        }
+        else
+        {
+            members.erase(std::find(members.begin(), members.end(), index));
+            if (members.empty())
+            {
+                m_members.erase(key);
+            }
+        }
+    }
+
+    // The tiles of every level containing the point are drawn again
+    for (uint16_t z = 0; z <= deepest; ++z)
+    {
+        auto found = m_batches.find(TileFactory::tile_key(z, z ? p.x >> (64 - z) : 0, z ? p.y >> (64 - z) : 0));
+        if (found != m_batches.end())
+        {
+            if (found->second.buffer)
+            {
+                m_stale.push_back(found->second.buffer);
+            }
+            m_batches.erase(found);
+        }
+    }
+}
+
+void MarkerLayer::insert(uint64_t id, uint64_t x, uint64_t y)
+{
+    remove(id);
+
+    const uint32_t index = uint32_t(m_points.size());
+    m_ids[id] = index;
+    m_points.push_back(Point{x, y, id});
+    update(index, 1);
+}
+
+bool MarkerLayer::remove(uint64_t id)
+{
+    auto found = m_ids.find(id);
+    if (found == m_ids.end())
+    {
+        return false;
+    }
+    const uint32_t index = found->second;
+    update(index, -1);
+    m_ids.erase(found);
+
+    // The last point takes its place
+    const uint32_t last = uint32_t(m_points.size() - 1);
+    if (index != last)
+    {
+        const Point & p = m_points[last];
+        if (!m_cells.empty())
+        {
+            const uint16_t z = levels - 1;
+            std::vector<uint32_t> & members = m_members[TileFactory::tile_key(z, p.x >> (64 - z), p.y >> (64 - z))];
+            *std::find(members.begin(), members.end(), last) = index;
+        }
+        m_ids[p.id] = index;
+        m_points[index] = p;
+    }
+    m_points.pop_back();
+
+    return true;
+}
+
+void MarkerLayer::build(uint16_t z, uint64_t x, uint64_t y, std::vector<Vertex> & vertices) const
+{
+    // A disc of radius pixels at u, v in the tile, larger and warmer for more points
+    auto marker = [&](double u, double v, uint32_t count)
+    {
+        const double t = std::min(1.0, std::log10(double(count))/5.0);
+        const double radius = (count == 1 ? 5.0 : 8.0 + 12.0*t)/tileSize;
+        const GLubyte r = count == 1 ?  30 : 255;
+        const GLubyte g = count == 1 ? 110 : GLubyte(200 - 160*t);
+        const GLubyte b = count == 1 ? 230 : 0;
+
+        const GLfloat x0 = GLfloat(u - radius), x1 = GLfloat(u + radius);
+        const GLfloat y0 = GLfloat(v - radius), y1 = GLfloat(v + radius);
+        vertices.push_back(Vertex{x0, y0, 0, 0, {r, g, b, 255}});
+        vertices.push_back(Vertex{x0, y1, 0, 1, {r, g, b, 255}});
+        vertices.push_back(Vertex{x1, y1, 1, 1, {r, g, b, 255}});
+        vertices.push_back(Vertex{x1, y0, 1, 0, {r, g, b, 255}});
+    };
+
+    if (z < levels)
+    {
+        // The centroid of each cell, in tile units
+        const Cells & cells = this->cells(z, z ? x << (64 - z) : 0, z ? y << (64 - z) : 0);
+        const double scale = std::ldexp(1.0, -(64 - z - cellBits));
+        for (uint64_t j = 0; j < 8; ++j)
+        {
+            for (uint64_t i = 0; i < 8; ++i)
+            {
+                auto found = cells.find(TileFactory::tile_key(z + cellBits, (x << cellBits) + i, (y << cellBits) + j));
+                if (found != cells.end())
+                {
+                    const Cell & c = found->second;
+                    marker((i + c.sx/c.count*scale)/8.0, (j + c.sy/c.count*scale)/8.0, c.count);
+                }
+            }
+        }
+        return;
+    }
+
+    // The points of the tile, from those of its clustered ancestor
+    const uint16_t a = levels - 1;
+    auto found = m_members.find(TileFactory::tile_key(a, x >> (z - a), y >> (z - a)));
+    if (found == m_members.end())
+    {
+        return;
+    }
+    const uint64_t ox = x << (64 - z);
+    const uint64_t oy = y << (64 - z);
+    const double scale = std::ldexp(1.0, -(64 - z));
+    for (uint32_t i : found->second)
+    {
+        const Point & p = m_points[i];
+        if (p.x >> (64 - z) == x && p.y >> (64 - z) == y)
+        {
+            marker(double(p.x - ox)*scale, double(p.y - oy)*scale, 1);
+        }
+    }
+}
+
+void MarkerLayer::draw(uint16_t z, uint64_t x, uint64_t y)
+{
+    if (!m_stale.empty())
+    {
+        glDeleteBuffers(GLsizei(m_stale.size()), m_stale.data());
+        m_stale.clear();
+    }
+
+    if (m_cells.empty() || z > deepest)
+    {
+        return;
+    }
+
+    if (!m_texture)
+    {
+        // A white disc with a dark rim and soft edge, tinted by the vertex colour
+        static const int size = 32;
+        std::vector<GLubyte> pixels(size*size*4);
+        for (int j = 0; j < size; ++j)
+        {
+            for (int i = 0; i < size; ++i)
+            {
+                const double d = std::hypot(i + 0.5 - size/2.0, j + 0.5 - size/2.0)/(size/2.0);
+                const GLubyte shade = d < 0.75 ? 255 : 60;
+                GLubyte * p = &pixels[(j*size + i)*4];
+                p[0] = p[1] = p[2] = shade;
+                p[3] = GLubyte(255*std::max(0.0, std::min(1.0, (1.0 - d)*size/2.0)));
+            }
+        }
+        glGenTextures(1, &m_texture);
+        glBindTexture(GL_TEXTURE_2D, m_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    }
+
+    const uint64_t key = TileFactory::tile_key(z, x, y);
+    auto found = m_batches.find(key);
+    if (found == m_batches.end())
+    {
+        std::vector<Vertex> vertices;
+        build(z, x, y, vertices);
+
+        Batch batch;
+        batch.buffer = 0;
+        batch.vertices = GLsizei(vertices.size());
+        batch.frame = m_frame;
+        if (!vertices.empty())
+        {
+            glGenBuffers(1, &batch.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, batch.buffer);
+            glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        found = m_batches.insert(std::make_pair(key, batch)).first;
+        evict();
+    }
+
+    Batch & batch = found->second;
+    batch.frame = m_frame;
+    if (!batch.buffer)
+    {
+        return;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glBindBuffer(GL_ARRAY_BUFFER, batch.buffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(Vertex), reinterpret_cast<const GLvoid *>(offsetof(Vertex, x)));
+    glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), reinterpret_cast<const GLvoid *>(offsetof(Vertex, u)));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), reinterpret_cast<const GLvoid *>(offsetof(Vertex, rgba)));
+
+    glDrawArrays(GL_QUADS, 0, batch.vertices);
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void MarkerLayer::evict()
+{
+    if (m_batches.size() <= m_budget) {
+        return;
+    }
+
+    // Least recently drawn first, but not anything drawn recently
+    std::vector<std::pair<uint64_t, uint64_t>> candidates;
+    for (const auto & i : m_batches) {
+        if (i.second.frame + 1 < m_frame) {
+            candidates.push_back(std::make_pair(i.second.frame, i.first));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const auto & i : candidates) {
+        if (m_batches.size() <= m_budget) {
+            break;
+        }
+        auto batch = m_batches.find(i.second);
+        if (batch->second.buffer) {
+            glDeleteBuffers(1, &batch->second.buffer);
+        }
+        m_batches.erase(batch);
+    }
+}
+
+void MarkerLayer::release()
+{
+    for (auto & i : m_batches) {
+        if (i.second.buffer) {
+            m_stale.push_back(i.second.buffer);
+        }
+    }
+    m_batches.clear();
+    if (!m_stale.empty()) {
+        glDeleteBuffers(GLsizei(m_stale.size()), m_stale.data());
+        m_stale.clear();
+    }
+    if (m_texture) {
+        glDeleteTextures(1, &m_texture);
+        m_texture = 0;
+    }
+}
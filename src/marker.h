@@ -0,0 +1,135 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/glew.h>
+
+/**
+ * @brief many point markers, clustered on a grid for each level
+ *
+ * Every level has cells an eighth of a tile across, 64 pixels, holding
+ * the number of points in the cell and the sum of their offsets, so a
+ * cell is drawn as one marker at the centroid of its points.  The deepest
+ * level is built from the points and each shallower level from the one
+ * below, a thread for each quarter of a quarter of the world.  A point is
+ * added or removed by updating one cell per level.  Deeper than the clustered
+ * levels the points are drawn individually.  The markers of a tile are
+ * expanded into quads of one vertex buffer, drawn in a single call, and
+ * rebuilt only when points in the tile change.
+ */
+class MarkerLayer
+{
+public:
+    MarkerLayer();
+    ~MarkerLayer();
+
+    // Add the points of a CSV file of latitude, longitude and optional id
+    bool load(const std::string & filename);
+
+    // Cluster everything loaded so far, in parallel, before drawing
+    void index();
+
+    // Add or move a point, and remove it, updating the clusters
+    void insert(uint64_t id, uint64_t x, uint64_t y);
+    bool remove(uint64_t id);
+
+    size_t points() const { return m_points.size(); }
+
+    // Draw the markers in a level z tile, in the unit square
+    void draw(uint16_t z, uint64_t x, uint64_t y);
+
+    // Start of a frame, buffers not drawn recently may be freed
+    void next_frame() { ++m_frame; }
+
+    // Free the buffers and texture, while the GL context is current
+    void release();
+
+    // Clustered levels, deeper tiles draw the points themselves
+    static const uint16_t levels = 17;
+
+private:
+    MarkerLayer(const MarkerLayer &) = delete;
+
+    struct Point
+    {
+        uint64_t x;
+        uint64_t y;
+        uint64_t id;
+    };
+
+    // Points in one cell, the sums are offsets from the cell's corner
+    struct Cell
+    {
+        uint32_t count;
+        double   sx;
+        double   sy;
+    };
+
+    typedef std::unordered_map<uint64_t, Cell>                  Cells;
+    typedef std::unordered_map<uint64_t, std::vector<uint32_t>> Members;
+
+    struct Vertex
+    {
+        GLfloat x, y;
+        GLfloat u, v;
+        GLubyte rgba[4];
+    };
+
+    // Quads of the markers of a tile
+    struct Batch
+    {
+        GLuint   buffer;
+        GLsizei  vertices;
+        uint64_t frame;
+    };
+
+    static void add(Cells & cells, uint16_t z, const Point & p, int sign);
+    static void coarsen(const Cells & fine, uint16_t z, Cells & coarse);
+
+    // Cells of a level containing a point, split into shards by level 2
+    // tile below level 2, so that each shard is built by its own thread
+    Cells & cells(uint16_t z, uint64_t x, uint64_t y);
+    const Cells & cells(uint16_t z, uint64_t x, uint64_t y) const;
+    void update(uint32_t index, int sign);
+    void build(uint16_t z, uint64_t x, uint64_t y, std::vector<Vertex> & vertices) const;
+    void evict();
+
+    std::vector<Point>                     m_points;
+    std::unordered_map<uint64_t, uint32_t> m_ids;
+
+    std::vector<std::vector<Cells>> m_cells;    // per clustered level and shard
+    Members            m_members;   // points of each tile of the deepest level
+
+    std::unordered_map<uint64_t, Batch> m_batches;
+    std::vector<GLuint>                 m_stale;    // buffers of changed tiles
+    GLuint       m_texture;
+    const size_t m_budget;
+    uint64_t     m_frame;
+};
@@ -0,0 +1,270 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <zlib.h>
+
+#include "mvt.h"
+
+// Protocol buffer wire format, as far as the vector tile spec needs it
+// https://github.com/mapbox/vector-tile-spec/tree/master/2.1
+
+namespace {
+
+enum WireType { VARINT = 0, FIXED64 = 1, LENGTH = 2, FIXED32 = 5 };
+
+struct Reader
+{
+    const uint8_t * p;
+    const uint8_t * end;
+
+    Reader(const uint8_t * begin, const uint8_t * end) : p(begin), end(end) {}
+
+    bool more() const { return p < end; }
+
+    bool varint(uint64_t & value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && p < end; shift += 7) {
+            const uint8_t byte = *p++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool key(uint32_t & field, uint32_t & type)
+    {
+        uint64_t value;
+        if (!varint(value)) {
+            return false;
+        }
+        field = uint32_t(value >> 3);
+        type  = uint32_t(value & 7);
+        return true;
+    }
+
+    bool bytes(Reader & sub)
+    {
+        uint64_t size;
+        if (!varint(size) || size > uint64_t(end - p)) {
+            return false;
+        }
+        sub = Reader(p, p + size);
+        p += size;
+        return true;
+    }
+
+    bool skip(uint32_t type)
+    {
+        uint64_t value;
+        switch (type) {
+            case VARINT:  return varint(value);
+            case FIXED64: if (end - p < 8) return false; p += 8; return true;
+            case FIXED32: if (end - p < 4) return false; p += 4; return true;
+            case LENGTH:
+            {
+                Reader sub(p, p);
+                return bytes(sub);
+            }
+            default:      return false;
+        }
+    }
+};
+
+inline int32_t zigzag(uint32_t value)
+{
+    return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+// Geometry is a packed sequence of commands and zigzag encoded deltas
+bool decode_geometry(Reader geometry, MvtFeature & feature)
+{
+    enum { MOVE_TO = 1, LINE_TO = 2, CLOSE_PATH = 7 };
+
+    int32_t x = 0;
+    int32_t y = 0;
+    while (geometry.more()) {
+        uint64_t command;
+        if (!geometry.varint(command)) {
+            return false;
+        }
+        const uint32_t id    = command & 0x7;
+        const uint32_t count = uint32_t(command >> 3);
+
+        if (id == CLOSE_PATH) {
+            if (!feature.paths.empty() && !feature.paths.back().empty()) {
+                feature.paths.back().push_back(feature.paths.back().front());
+            }
+            continue;
+        }
+        if (id != MOVE_TO && id != LINE_TO) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t dx, dy;
+            if (!geometry.varint(dx) || !geometry.varint(dy)) {
+                return false;
+            }
+            x += zigzag(uint32_t(dx));
+            y += zigzag(uint32_t(dy));
+
+            // Each MoveTo starts a new point, line string or ring
+            if (id == MOVE_TO || feature.paths.empty()) {
+                feature.paths.push_back(std::vector<MvtPoint>());
+            }
+            feature.paths.back().push_back(MvtPoint{x, y});
+        }
+    }
+    return true;
+}
+
+bool decode_feature(Reader feature, MvtFeature & out)
+{
+    uint32_t field, type;
+    while (feature.more()) {
+        if (!feature.key(field, type)) {
+            return false;
+        }
+        if (field == 3 && type == VARINT) {
+            uint64_t value;
+            if (!feature.varint(value)) {
+                return false;
+            }
+            out.type = uint32_t(value);
+        } else if (field == 4 && type == LENGTH) {
+            Reader geometry(NULL, NULL);
+            if (!feature.bytes(geometry) || !decode_geometry(geometry, out)) {
+                return false;
+            }
+        } else if (!feature.skip(type)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool decode_layer(Reader layer, MvtLayer & out)
+{
+    uint32_t field, type;
+    while (layer.more()) {
+        if (!layer.key(field, type)) {
+            return false;
+        }
+        if (field == 1 && type == LENGTH) {
+            Reader name(NULL, NULL);
+            if (!layer.bytes(name)) {
+                return false;
+            }
+            out.name.assign(reinterpret_cast<const char *>(name.p), name.end - name.p);
+        } else if (field == 2 && type == LENGTH) {
+            Reader feature(NULL, NULL);
+            if (!layer.bytes(feature)) {
+                return false;
+            }
+            out.features.push_back(MvtFeature());
+            if (!decode_feature(feature, out.features.back())) {
+                return false;
+            }
+        } else if (field == 5 && type == VARINT) {
+            uint64_t value;
+            if (!layer.varint(value)) {
+                return false;
+            }
+            out.extent = value ? uint32_t(value) : 4096;
+        } else if (!layer.skip(type)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+bool mvt_inflate(const std::string & in, std::string & out)
+{
+    z_stream stream = z_stream();
+    stream.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    stream.avail_in = uInt(in.size());
+
+    // Detect gzip or zlib headers
+    if (inflateInit2(&stream, 32 + MAX_WBITS) != Z_OK) {
+        return false;
+    }
+
+    out.clear();
+    char buffer[16384];
+    int ret;
+    do {
+        stream.next_out  = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = sizeof(buffer);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&stream);
+            return false;
+        }
+        out.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (ret != Z_STREAM_END);
+
+    inflateEnd(&stream);
+    return true;
+}
+
+bool mvt_decode(const std::string & data, std::vector<MvtLayer> & layers)
+{
+    // Tiles are commonly served gzipped
+    std::string inflated;
+    const std::string * tile = &data;
+    if (data.size() >= 2 && uint8_t(data[0]) == 0x1f && uint8_t(data[1]) == 0x8b) {
+        if (!mvt_inflate(data, inflated)) {
+            return false;
+        }
+        tile = &inflated;
+    }
+
+    const uint8_t * begin = reinterpret_cast<const uint8_t *>(tile->data());
+    Reader reader(begin, begin + tile->size());
+
+    uint32_t field, type;
+    while (reader.more()) {
+        if (!reader.key(field, type)) {
+            return false;
+        }
+        if (field == 3 && type == LENGTH) {
+            Reader layer(NULL, NULL);
+            if (!reader.bytes(layer)) {
+                return false;
+            }
+            layers.push_back(MvtLayer());
+            if (!decode_layer(layer, layers.back())) {
+                return false;
+            }
+        } else if (!reader.skip(type)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief a point of a feature, in tile extent units with y down
+ */
+struct MvtPoint
+{
+    int32_t x;
+    int32_t y;
+};
+
+/**
+ * @brief a feature of a Mapbox Vector Tile layer
+ */
+struct MvtFeature
+{
+    enum Type { UNKNOWN = 0, POINT = 1, LINESTRING = 2, POLYGON = 3 };
+
+    uint32_t type = UNKNOWN;
+
+    // Points, line strings or polygon rings
+    std::vector<std::vector<MvtPoint>> paths;
+};
+
+/**
+ * @brief a layer of a Mapbox Vector Tile
+ */
+struct MvtLayer
+{
+    std::string             name;
+    uint32_t                extent = 4096;
+    std::vector<MvtFeature> features;
+};
+
+// Inflate gzip or zlib compressed data, returns false on error
+extern bool mvt_inflate(const std::string & in, std::string & out);
+
+// Decode the layers of a (possibly compressed) Mapbox Vector Tile
+extern bool mvt_decode(const std::string & data, std::vector<MvtLayer> & layers);
@@ -0,0 +1,67 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+/**
+ * @brief framebuffer to draw into instead of the window
+ *
+ * Colour and depth renderbuffers the size of the window, for drawing
+ * with the window hidden and reading back what was drawn.
+ */
+class Offscreen
+{
+public:
+    Offscreen();
+    ~Offscreen();
+
+    // (Re)allocate when the size changes, false if unsupported
+    bool resize(GLsizei width, GLsizei height);
+
+    // Draw into the framebuffer, or back to the window
+    void bind();
+    void unbind();
+
+    // RGBA rows from the bottom up, of whatever is bound
+    static void read(GLsizei width, GLsizei height, std::vector<uint8_t> & pixels);
+
+    void release();
+
+    GLsizei width() const  { return m_width; }
+    GLsizei height() const { return m_height; }
+
+private:
+    Offscreen(const Offscreen &) = delete;
+
+    GLuint  m_fbo;
+    GLuint  m_color;
+    GLuint  m_depth;
+    GLsizei m_width;
+    GLsizei m_height;
+};
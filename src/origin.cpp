@@ -0,0 +1,343 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+
+#include "origin.h"
+
+// A run of this many failures opens the circuit
+static const unsigned max_failures = 8;
+// Cool-off before the first probe, doubling to the most
+static const double   min_cooloff  = 1.0;
+static const double   max_cooloff  = 60.0;
+// Latency samples per epoch of the least latency
+static const size_t   epoch        = 64;
+static const size_t   buckets      = 80;
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Every origin there has been, never freed as loaders may outlive statics
+static std::mutex                                       registry;
+static std::map<std::string, std::unique_ptr<Origin>> * origins = NULL;
+
+Origin & Origin::get(const std::string & url, size_t maxWindow)
+{
+    // scheme://host:port
+    const size_t scheme = url.find("://");
+    const size_t path = url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+    const std::string host = url.substr(0, path);
+
+    std::lock_guard<std::mutex> lock(registry);
+    if (!origins) {
+        origins = new std::map<std::string, std::unique_ptr<Origin>>();
+    }
+    std::unique_ptr<Origin> & origin = (*origins)[host];
+    if (!origin) {
+        origin.reset(new Origin(host, maxWindow));
+    }
+    return *origin;
+}
+
+Origin::Origin(const std::string & host, size_t maxWindow)
+: m_host(host),
+  m_rate(0.0), m_tokens(0.0), m_refilled(now()),
+  m_window(4.0), m_maxWindow(double(std::max<size_t>(maxWindow, 1))), m_inflight(0), m_decreased(0.0),
+  m_smoothed(0.0), m_least{ 0.0, 0.0 }, m_samples(0),
+  m_pausedUntil(0.0), m_timerAt(0.0),
+  m_circuit(CLOSED), m_failures(0), m_cooloff(min_cooloff), m_openUntil(0.0),
+  m_first(0.0), m_sent(0), m_succeeded(0), m_rejected(0), m_throttled(0), m_failed(0), m_opened(0), m_bytes(0),
+  m_histogram(buckets, 0)
+{
+    // Requests per second, per origin
+    if (const char * rate = std::getenv("SLIPPYMAP_RATE_LIMIT")) {
+        m_rate = std::max(0.0, std::atof(rate));
+    }
+    if (const char * window = std::getenv("SLIPPYMAP_MAX_CONCURRENCY")) {
+        if (std::atoi(window) > 0) {
+            m_maxWindow = std::atoi(window);
+        }
+    }
+    m_window = std::min(m_window, m_maxWindow);
+    m_tokens = std::max(m_rate, 1.0);
+}
+
+void Origin::submit(const void * owner, std::function<void()> start)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_waiting.push_back(Waiting{owner, std::move(start)});
+}
+
+size_t Origin::cancel(const void * owner)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const size_t before = m_waiting.size();
+    m_waiting.erase(std::remove_if(m_waiting.begin(), m_waiting.end(),
+                                   [owner](const Waiting & w) { return w.owner == owner; }),
+                    m_waiting.end());
+    return before - m_waiting.size();
+}
+
+double Origin::ready(std::vector<std::function<void()>> & starts)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const double t = now();
+
+    // A second's worth of burst
+    if (m_rate > 0.0) {
+        m_tokens = std::min(m_tokens + (t - m_refilled)*m_rate, std::max(m_rate, 1.0));
+    }
+    m_refilled = t;
+
+    double wait = 0.0;
+    while (!m_waiting.empty()) {
+        if (t < m_pausedUntil) {
+            wait = m_pausedUntil - t;
+            break;
+        }
+        if (m_circuit == OPEN) {
+            if (t < m_openUntil) {
+                wait = m_openUntil - t;
+                break;
+            }
+            m_circuit = HALF_OPEN;
+        }
+        // One probe at a time
+        if (m_circuit == HALF_OPEN && m_inflight > 0) {
+            break;
+        }
+        if (m_inflight >= size_t(m_window)) {
+            break;
+        }
+        if (m_rate > 0.0) {
+            if (m_tokens < 1.0) {
+                wait = (1.0 - m_tokens)/m_rate;
+                break;
+            }
+            m_tokens -= 1.0;
+        }
+
+        if (!m_sent) {
+            m_first = t;
+        }
+        ++m_sent;
+        ++m_inflight;
+        starts.push_back(std::move(m_waiting.front().start));
+        m_waiting.pop_front();
+    }
+
+    // Only one timer at a time, unless this is sooner
+    if (wait > 0.0) {
+        const double at = t + wait;
+        if (m_timerAt > t && m_timerAt <= at) {
+            return 0.0;
+        }
+        m_timerAt = at;
+    }
+    return wait;
+}
+
+void Origin::finished(Outcome outcome, double latency, size_t bytes, double retryAfter)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const double t = now();
+
+    if (m_inflight) {
+        --m_inflight;
+    }
+
+    switch (outcome) {
+        case SUCCESS:
+        {
+            ++m_succeeded;
+            m_bytes += bytes;
+
+            const double ms = latency*1000.0;
+            const size_t bucket = ms > 1.0 ? std::min<size_t>(size_t(4.0*std::log2(ms)), buckets - 1) : 0;
+            ++m_histogram[bucket];
+
+            m_smoothed = m_samples ? 0.875*m_smoothed + 0.125*latency : latency;
+            if (m_samples % epoch == 0) {
+                m_least[1] = m_least[0];
+                m_least[0] = latency;
+            }
+            m_least[0] = std::min(m_least[0], latency);
+            ++m_samples;
+
+            m_failures = 0;
+            m_circuit = CLOSED;
+            m_cooloff = min_cooloff;
+
+            // Queueing at the server, typical responses well beyond the quickest
+            const double least = m_samples > epoch ? std::min(m_least[0], m_least[1]) : m_least[0];
+            if (m_samples > 8 && m_smoothed > 2.0*least + 0.05) {
+                decrease(t);
+            } else if (m_inflight + 1 >= size_t(m_window)) {
+                // Only grow a window that is being used
+                m_window = std::min(m_window + 1.0/m_window, m_maxWindow);
+            }
+            break;
+        }
+        case REJECTED:
+            ++m_rejected;
+            m_failures = 0;
+            m_circuit = CLOSED;
+            m_cooloff = min_cooloff;
+            break;
+        case THROTTLED:
+            ++m_throttled;
+            decrease(t);
+            if (retryAfter > 0.0) {
+                m_pausedUntil = std::max(m_pausedUntil, t + std::min(retryAfter, max_cooloff));
+            }
+            if (m_circuit == HALF_OPEN) {
+                failure(t);
+            }
+            break;
+        case FAILED:
+            ++m_failed;
+            decrease(t);
+            failure(t);
+            break;
+        case ABANDONED:
+            break;
+    }
+}
+
+bool Origin::available() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_circuit == CLOSED;
+}
+
+double Origin::latency() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_samples ? m_smoothed : 0.0;
+}
+
+size_t Origin::choose(const std::vector<const Origin *> & mirrors, int attempt)
+{
+    std::vector<std::pair<double, size_t>> up;
+    for (size_t m = 0; m < mirrors.size(); ++m) {
+        if (mirrors[m]->available()) {
+            up.emplace_back(mirrors[m]->latency(), m);
+        }
+    }
+    if (up.empty()) {
+        return attempt % mirrors.size();
+    }
+    std::sort(up.begin(), up.end());
+    return up[attempt % up.size()].second;
+}
+
+void Origin::failure(double now)
+{
+    ++m_failures;
+    if (m_circuit == HALF_OPEN || (m_circuit == CLOSED && m_failures >= max_failures)) {
+        m_circuit = OPEN;
+        m_openUntil = now + m_cooloff;
+        m_cooloff = std::min(m_cooloff*2.0, max_cooloff);
+        ++m_opened;
+        std::cerr << "Origin " << m_host << " not responding, pausing for " << (m_openUntil - now) << " s" << std::endl;
+    }
+}
+
+void Origin::decrease(double now)
+{
+    // Responses to requests sent before the last decrease say nothing new
+    if (now - m_decreased > std::max(m_smoothed, 0.01)) {
+        m_window = std::max(m_window*0.5, 1.0);
+        m_decreased = now;
+    }
+}
+
+void Origin::report(std::ostream & os)
+{
+    std::lock_guard<std::mutex> registered(registry);
+    if (!origins) {
+        return;
+    }
+
+    for (const auto & i : *origins) {
+        const Origin & o = *i.second;
+        std::lock_guard<std::mutex> lock(o.m_mutex);
+
+        // Upper edge of the bucket at the percentile
+        auto percentile = [&o](double p) {
+            uint64_t total = 0;
+            for (uint64_t n : o.m_histogram) {
+                total += n;
+            }
+            uint64_t seen = 0;
+            for (size_t b = 0; b < o.m_histogram.size(); ++b) {
+                seen += o.m_histogram[b];
+                if (total && seen >= p*total) {
+                    return std::pow(2.0, (b + 1)/4.0);
+                }
+            }
+            return 0.0;
+        };
+
+        const double seconds = o.m_sent ? now() - o.m_first : 0.0;
+        const char * circuit = o.m_circuit == CLOSED ? "closed" : (o.m_circuit == OPEN ? "open" : "half-open");
+
+        os << o.m_host << ": " << o.m_sent << " sent, " << o.m_succeeded << " ok";
+        if (seconds > 0.0) {
+            os << " (" << std::fixed << std::setprecision(1) << o.m_succeeded/seconds << "/s, "
+               << o.m_bytes/seconds/1024.0 << " KiB/s)";
+        }
+        os << std::defaultfloat << std::setprecision(6);
+        os << ", " << o.m_rejected << " rejected, " << o.m_throttled << " throttled, " << o.m_failed << " failed"
+           << ", ms p50 " << percentile(0.5) << " p95 " << percentile(0.95)
+           << ", window " << std::setprecision(3) << o.m_window << std::setprecision(6)
+           << ", rate " << (o.m_rate > 0.0 ? std::to_string(int(o.m_rate)) + "/s" : std::string("unlimited"))
+           << ", circuit " << circuit << " (opened " << o.m_opened << ")"
+           << ", " << o.m_waiting.size() << " waiting" << std::endl;
+    }
+}
+
+void Origin::reset()
+{
+    std::lock_guard<std::mutex> registered(registry);
+    if (!origins) {
+        return;
+    }
+
+    for (auto & i : *origins) {
+        std::lock_guard<std::mutex> lock(i.second->m_mutex);
+        i.second->m_inflight = 0;
+        i.second->m_waiting.clear();
+        i.second->m_timerAt = 0.0;
+    }
+}
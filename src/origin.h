@@ -0,0 +1,148 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief politeness towards, and health of, one tile server
+ *
+ * Requests wait here until the server may be sent another.  A token
+ * bucket limits the request rate, and a window limits the number in
+ * flight.  The window grows by one for each window of timely responses,
+ * and halves at most once a round trip when the server throttles us,
+ * fails, or responds much slower than the quickest responses lately
+ * (AIMD).  A Retry-After pauses everything for the server.  After a run
+ * of failures the circuit opens and nothing is sent until a single probe,
+ * after a cool-off that doubles while the server stays down.  Requests
+ * wait meanwhile, but retries are better given up.
+ */
+class Origin
+{
+public:
+    enum Outcome
+    {
+        SUCCESS,    // the tile
+        REJECTED,   // 404 and the like, the server is fine
+        THROTTLED,  // 429
+        FAILED,     // 5xx, timeouts, refused or dropped connections
+        ABANDONED   // nothing to do with the server
+    };
+
+    // Shared by every loader using the same scheme://host:port
+    static Origin & get(const std::string & url, size_t maxWindow);
+
+    // Queue a request, start() sends it once allowed
+    void submit(const void * owner, std::function<void()> start);
+
+    // Drop the requests of an owner not yet started, returns how many
+    size_t cancel(const void * owner);
+
+    // Requests allowed now, to be started by the caller, and the seconds
+    // until it is worth asking again, or zero if finished() will do
+    double ready(std::vector<std::function<void()>> & starts);
+
+    // A started request is done, after latency seconds
+    void finished(Outcome outcome, double latency, size_t bytes, double retryAfter = 0.0);
+
+    // Is the circuit closed, so that retries are worthwhile?
+    bool available() const;
+
+    // Smoothed seconds to a response lately, 0 before any
+    double latency() const;
+
+    // Of the origins serving a tile on each mirror, the quickest lately of
+    // those up, the next quickest on a retry, or if all are down each in turn
+    static size_t choose(const std::vector<const Origin *> & mirrors, int attempt);
+
+    const std::string & host() const { return m_host; }
+
+    // One line per origin
+    static void report(std::ostream & os);
+
+    // Forget what was in flight, when the I/O threads are stopped
+    static void reset();
+
+private:
+    Origin(const std::string & host, size_t maxWindow);
+    Origin(const Origin &) = delete;
+
+    void failure(double now);
+    void decrease(double now);
+
+    enum Circuit { CLOSED, OPEN, HALF_OPEN };
+
+    struct Waiting
+    {
+        const void *          owner;
+        std::function<void()> start;
+    };
+
+    mutable std::mutex  m_mutex;
+    const std::string   m_host;
+
+    // Token bucket, no limit at a rate of zero
+    double   m_rate;
+    double   m_tokens;
+    double   m_refilled;
+
+    // Concurrency
+    double   m_window;
+    double   m_maxWindow;
+    size_t   m_inflight;
+    double   m_decreased;
+
+    // Latency, smoothed and the least in this and the previous epoch
+    double   m_smoothed;
+    double   m_least[2];
+    size_t   m_samples;
+
+    double   m_pausedUntil;
+    double   m_timerAt;
+
+    Circuit  m_circuit;
+    unsigned m_failures;   // in a row
+    double   m_cooloff;
+    double   m_openUntil;
+
+    std::deque<Waiting> m_waiting;
+
+    // Stats
+    double   m_first;
+    uint64_t m_sent;
+    uint64_t m_succeeded;
+    uint64_t m_rejected;
+    uint64_t m_throttled;
+    uint64_t m_failed;
+    uint64_t m_opened;
+    uint64_t m_bytes;
+    std::vector<uint64_t> m_histogram;   // latency, quarter octaves of ms
+};
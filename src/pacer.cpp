@@ -0,0 +1,105 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <ctime>
+
+#include "pacer.h"
+#include "global.h"
+
+FramePacer::FramePacer(double interval)
+: m_interval(interval), m_begin(0.0), m_input(0.0), m_uploads(0.0), m_draw(0.0), m_budget(interval*0.25), m_missed(0)
+{
+}
+
+double FramePacer::now()
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec + spec.tv_nsec / 1.0e9;
+}
+
+void FramePacer::begin()
+{
+    m_begin = now();
+}
+
+void FramePacer::input()
+{
+    m_input = now() - m_begin;
+}
+
+double FramePacer::upload_deadline() const
+{
+    // Whatever is left after input and drawing, but at least enough
+    // for one upload so that loading always makes progress
+    const double left = m_interval*0.9 - m_input - m_draw;
+    return m_begin + m_input + std::max(0.0, std::min(left, m_budget));
+}
+
+void FramePacer::drawn()
+{
+    const double end = now();
+    const double draw = end - m_begin - m_input;
+    m_draw = m_draw*0.9 + draw*0.1;
+
+    // Shed upload work quickly when late, recover slowly
+    if (end - m_begin > m_interval)
+    {
+        ++m_missed;
+        m_budget = std::max(m_budget*0.5, 0.0005);
+    }
+    else
+    {
+        m_budget = std::min(m_budget + 0.0005, m_interval);
+    }
+}
+
+bool Simulation::advance(double elapsed)
+{
+    // Don't try to catch up after a long stall
+    m_accumulator = std::min(m_accumulator + elapsed, 0.25);
+
+    // Velocity is per 60th of a second
+    const double scale = m_step*60.0;
+
+    while (m_accumulator >= m_step)
+    {
+        m_last[0] = int64_t(velocity.x*scale);
+        m_last[1] = int64_t(velocity.y*scale);
+        player_state.x += m_last[0];
+        player_state.y += m_last[1];
+        m_accumulator -= m_step;
+    }
+
+    return velocity.x || velocity.y;
+}
+
+void Simulation::interpolate(uint64_t & x, uint64_t & y) const
+{
+    // Back from the latest step by the time not yet simulated
+    const double alpha = m_accumulator/m_step;
+    x -= uint64_t(int64_t(m_last[0]*(1.0 - alpha)));
+    y -= uint64_t(int64_t(m_last[1]*(1.0 - alpha)));
+}
@@ -0,0 +1,94 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief splits each frame interval between input, uploads and drawing
+ *
+ * The time left for uploading textures is what remains of the frame
+ * interval after input and the recent cost of drawing.  When a frame
+ * misses its deadline the upload budget is halved, and it recovers
+ * gradually while frames are on time.
+ */
+class FramePacer
+{
+public:
+    FramePacer(double interval = 1.0/60.0);
+
+    // Seconds, from a monotonic clock
+    static double now();
+
+    void set_interval(double interval) { m_interval = interval; }
+    double interval() const { return m_interval; }
+
+    // Start of a frame, before polling input
+    void begin();
+    // Input has been handled
+    void input();
+    // Deadline for uploads this frame
+    double upload_deadline() const;
+    // Drawing and swapping is done
+    void drawn();
+
+    // Frames that missed the interval, since the last report
+    uint64_t missed() const { return m_missed; }
+    double   upload_budget() const { return m_budget; }
+    void     reset() { m_missed = 0; }
+
+private:
+    double   m_interval;
+    double   m_begin;
+    double   m_input;
+    double   m_uploads;
+    double   m_draw;       // recent drawing time, smoothed
+    double   m_budget;     // seconds allowed for uploads
+    uint64_t m_missed;
+};
+
+/**
+ * @brief fixed timestep integration of the camera velocity
+ *
+ * Motion is stepped at a fixed rate regardless of frame rate, and the
+ * camera is drawn part way through the latest step so that motion is
+ * smooth whatever the frame rate.
+ */
+class Simulation
+{
+public:
+    Simulation(double step = 1.0/120.0) : m_step(step) {}
+
+    // Advance by elapsed seconds, returns true if moving
+    bool advance(double elapsed);
+
+    // Camera position to draw, between the last two steps
+    void interpolate(uint64_t & x, uint64_t & y) const;
+
+private:
+    const double m_step;
+    double       m_accumulator = 0.0;
+    int64_t      m_last[2] = { 0, 0 };
+};
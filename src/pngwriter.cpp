@@ -0,0 +1,141 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <csetjmp>
+#include <iostream>
+
+#include "pngwriter.h"
+
+PngWriter::PngWriter()
+: m_file(NULL), m_png(NULL), m_info(NULL), m_width(0), m_height(0), m_written(0), m_failed(false)
+{
+}
+
+PngWriter::~PngWriter()
+{
+    destroy();
+}
+
+bool PngWriter::open(const std::string & filename, uint32_t width, uint32_t height)
+{
+    destroy();
+
+    m_file = std::fopen(filename.c_str(), "wb");
+    if (!m_file) {
+        std::cerr << "Could not create " << filename << std::endl;
+        return false;
+    }
+
+    m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    m_info = m_png ? png_create_info_struct(m_png) : NULL;
+    if (!m_info) {
+        destroy();
+        return false;
+    }
+
+    // libpng reports errors by longjmp back here
+    if (setjmp(png_jmpbuf(m_png))) {
+        destroy();
+        return false;
+    }
+
+    png_init_io(m_png, m_file);
+
+    // Fast filtering and compression, the rows are mostly imagery
+    png_set_filter(m_png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB | PNG_FILTER_UP);
+    png_set_compression_level(m_png, 3);
+
+    png_set_IHDR(m_png, m_info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_write_info(m_png, m_info);
+
+    m_width   = width;
+    m_height  = height;
+    m_written = 0;
+    m_failed  = false;
+
+    return true;
+}
+
+bool PngWriter::write(const uint8_t * rows, uint32_t count)
+{
+    if (!m_png || m_failed || m_written + count > m_height) {
+        m_failed = true;
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(m_png))) {
+        m_failed = true;
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        png_write_row(m_png, const_cast<png_bytep>(rows + size_t(i)*m_width*3));
+    }
+    m_written += count;
+
+    return true;
+}
+
+// The trailer, in a frame of its own so that the longjmp of a libpng
+// error clobbers nothing of the caller's
+static bool write_end(png_structp png)
+{
+    if (setjmp(png_jmpbuf(png))) {
+        return false;
+    }
+    png_write_end(png, NULL);
+    return true;
+}
+
+bool PngWriter::close()
+{
+    if (!m_png) {
+        return false;
+    }
+
+    bool ok = !m_failed && m_written == m_height && write_end(m_png);
+
+    png_destroy_write_struct(&m_png, &m_info);
+    m_png  = NULL;
+    m_info = NULL;
+
+    ok = std::fclose(m_file) == 0 && ok;
+    m_file = NULL;
+
+    return ok;
+}
+
+void PngWriter::destroy()
+{
+    if (m_png) {
+        png_destroy_write_struct(&m_png, m_info ? &m_info : NULL);
+        m_png  = NULL;
+        m_info = NULL;
+    }
+    if (m_file) {
+        std::fclose(m_file);
+        m_file = NULL;
+    }
+}
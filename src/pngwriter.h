@@ -0,0 +1,69 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <png.h>
+
+/**
+ * @brief PNG file written a band of rows at a time
+ *
+ * Rows are compressed as they arrive, so an image of any size
+ * needs no more memory than the band being written.
+ */
+class PngWriter
+{
+public:
+    PngWriter();
+    ~PngWriter();
+
+    // 8-bit RGB, false if the file can't be created
+    bool open(const std::string & filename, uint32_t width, uint32_t height);
+
+    // Rows of RGB from the top down, width*3 bytes apart
+    bool write(const uint8_t * rows, uint32_t count);
+
+    // Finish the file, false if it is incomplete or couldn't be written
+    bool close();
+
+    uint32_t width() const  { return m_width; }
+    uint32_t height() const { return m_height; }
+
+private:
+    PngWriter(const PngWriter &) = delete;
+
+    FILE *      m_file;
+    png_structp m_png;
+    png_infop   m_info;
+    uint32_t    m_width;
+    uint32_t    m_height;
+    uint32_t    m_written;
+    bool        m_failed;
+
+    void destroy();
+};
@@ -0,0 +1,126 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "pool.h"
+
+namespace {
+
+// Index of the worker running on this thread, if any
+thread_local const WorkerPool * current_pool  = nullptr;
+thread_local size_t             current_index = 0;
+
+}
+
+WorkerPool::WorkerPool(const std::string & name, size_t threads)
+: m_name(name), m_next(0), m_queued(0), m_active(0), m_stolen(0)
+{
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        m_queues.emplace_back(new Queue());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        m_threads.emplace_back(&WorkerPool::run, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto & thread : m_threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::post(Task task)
+{
+    const size_t i = current_pool == this ? current_index : m_next++ % m_queues.size();
+    {
+        // Count before pushing so that queued() never underflows, and hold
+        // the wake mutex so that an idle worker can't miss the notification
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_queued;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_queues[i]->mutex);
+        m_queues[i]->tasks.push_back(std::move(task));
+    }
+    m_wake.notify_one();
+}
+
+bool WorkerPool::pop(size_t i, Task & task)
+{
+    // Own queue, most recent first
+    {
+        Queue & queue = *m_queues[i];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // Steal the oldest task of another worker
+    for (size_t j = 1; j < m_queues.size(); ++j) {
+        Queue & queue = *m_queues[(i + j) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            ++m_stolen;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkerPool::run(size_t i)
+{
+    current_pool = this;
+    current_index = i;
+
+    while (true) {
+        Task task;
+        if (pop(i, task)) {
+            --m_queued;
+            ++m_active;
+            task();
+            --m_active;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+        if (m_stop) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief fixed size pool of CPU worker threads
+ *
+ * Each worker owns a queue.  Tasks posted from a worker go to its own
+ * queue and are run newest first, tasks posted from elsewhere are dealt
+ * round-robin.  An idle worker steals the oldest task of another worker.
+ */
+class WorkerPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    WorkerPool(const std::string & name, size_t threads);
+    ~WorkerPool();
+
+    void post(Task task);
+
+    const std::string & name() const { return m_name; }
+
+    size_t threads() const { return m_queues.size(); }
+    size_t queued()  const { return m_queued; }
+    size_t active()  const { return m_active; }
+    size_t stolen()  const { return m_stolen; }
+
+private:
+    WorkerPool(const WorkerPool &) = delete;
+
+    struct Queue
+    {
+        std::mutex      mutex;
+        std::deque<Task> tasks;
+    };
+
+    void run(size_t i);
+    bool pop(size_t i, Task & task);
+
+    const std::string m_name;
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread>            m_threads;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_wake;
+    bool                    m_stop = false;
+
+    std::atomic<size_t>     m_next;
+    std::atomic<size_t>     m_queued;
+    std::atomic<size_t>     m_active;
+    std::atomic<size_t>     m_stolen;
+};
@@ -0,0 +1,755 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+#include "render.h"
+#include "tile.h"
+#include "tilefactory.h"
+#include "loader.h"
+#include "vectorloader.h"
+#include "terrain.h"
+#include "track.h"
+#include "marker.h"
+#include "timeseries.h"
+#include "heatmap.h"
+
+// Imagery from ArcGIS, or SLIPPYMAP_BASEMAP_URL such as a tile server or mock origin
+static std::string basemap_url()
+{
+    const char * url = std::getenv("SLIPPYMAP_BASEMAP_URL");
+    return url ? url : "https://server.arcgisonline.com/ArcGIS/rest/services/World_Topo_Map/MapServer/tile/";
+}
+
+Loader basemap(false, false, 19, basemap_url(), "", "./base/");
+//Loader basemap(false, true, "https://tile.openstreetmap.org/", ".png", "./osm/");
+
+// Optional vector tile layer, see SLIPPYMAP_VECTOR_URL
+std::unique_ptr<VectorLoader> vectors;
+
+// Elevation, see SLIPPYMAP_TERRAIN_URL
+std::unique_ptr<TerrainLoader> terrain;
+
+// GPS tracks, see SLIPPYMAP_TRACKS
+std::unique_ptr<TrackLayer> tracks;
+
+// Point markers, see SLIPPYMAP_MARKERS
+std::unique_ptr<MarkerLayer> markers;
+
+// Animated overlay, see SLIPPYMAP_TIMESERIES_URL
+std::unique_ptr<TimeSeries> series;
+
+// Density of events, see SLIPPYMAP_HEATMAP
+std::unique_ptr<HeatmapLayer> heatmap;
+
+std::vector<std::unique_ptr<View>> views;
+
+// Tiles of each loader kept once out of view, for panning back
+static const size_t spareTiles = 256;
+
+// Levels deeper (sharper) or shallower (fewer tiles) than the display needs
+static double lodBias()
+{
+    static const double bias = std::getenv("SLIPPYMAP_LOD_BIAS") ? std::atof(std::getenv("SLIPPYMAP_LOD_BIAS")) : 0.0;
+    return bias;
+}
+
+// Fraction of a level either side of the switch between levels
+// over which the next level is faded in, when blending
+static const double blendWidth = 0.25;
+
+void update_scale()
+{
+    int width = 0;
+    int height = 0;
+    SDL_GL_GetDrawableSize(window, &width, &height);
+    window_state.scale = window_state.width > 0 && width > 0 ? double(width)/window_state.width : 1.0;
+}
+
+// Pixels drawn for each pixel of a raster source: 256 pixel tiles have
+// always been drawn 512 window pixels across at integer zooms.  Geometry
+// is sharp at any scale and is drawn with one to one.
+static const double rasterMagnification = 2.0;
+
+// Level of detail with magnification pixels drawn to each pixel of the
+// source, where a tile of the source is tileSize() pixels, or
+// tileSize()/density() logical pixels, and a level z tile is drawn
+// tileSize*2^(zoom-z) window pixels across
+static double lod(const Loader & loader, double zoom, double magnification = rasterMagnification)
+{
+    return zoom + std::log2(tileSize*window_state.scale*loader.density()/(magnification*loader.tileSize())) + lodBias();
+}
+
+// The nearest level, so tiles are drawn at between 0.71 and 1.41 of that
+static uint16_t level(double lod, uint16_t maxZoom)
+{
+    return uint16_t(std::max(0.0, std::min<double>(std::floor(lod + 0.5), maxZoom)));
+}
+
+// Grid of level z tiles around x, y
+static s_grid grid(GLsizei width, GLsizei height, double zoom, uint16_t z, uint64_t x, uint64_t y)
+{
+    s_grid g;
+    g.z  = z;
+    g.zf = std::pow(2.0, zoom-g.z);
+
+    // View bounds in quad-tree co-ordinates, based on viewport center at x, y,
+    // a pixel wider either side for a centre between pixels
+    visibleBounds(width/g.zf + 2, height/g.zf + 2, bits, g.z, x, y, g.tile, g.size);
+
+    // Offset in pixels from bottom left to center, to the fraction
+    // of a pixel so that neighbouring views line up
+    g.fx = std::ldexp(double(x - (g.tile[0]<<(64-g.z))), -(64-bits-g.z));
+    g.fy = std::ldexp(double(y - (g.tile[1]<<(64-g.z))), -(64-bits-g.z));
+
+    return g;
+}
+
+void update_views(const s_player_state & camera)
+{
+    if (terrain)
+    {
+        terrain->next_frame();
+    }
+    if (tracks)
+    {
+        tracks->next_frame();
+    }
+    if (markers)
+    {
+        markers->next_frame();
+    }
+    if (series)
+    {
+        series->next_frame();
+    }
+    if (heatmap)
+    {
+        heatmap->next_frame();
+    }
+
+    // One pass over the views, so that a tile needed by several
+    // of them is requested once, by whichever sees it first
+    for (auto & i : views)
+    {
+        View & v = *i;
+        if (!v.shown())
+        {
+            continue;
+        }
+
+        if (v.follow)
+        {
+            v.player.x = camera.x;
+            v.player.y = camera.y;
+            v.player.zoom = std::max<double>(0, std::min<double>(19, camera.zoom + v.zoomOffset));
+        }
+        if (v.orient)
+        {
+            v.viewport = viewport_state;
+        }
+
+        update_view(v);
+    }
+
+    // What no view holds any more, a little at a time
+    TileFactory * factory = TileFactory::instance();
+    factory->collect(basemap, spareTiles);
+    if (vectors)
+    {
+        factory->collect(*vectors, spareTiles);
+    }
+    if (terrain)
+    {
+        factory->collect(*terrain, spareTiles);
+    }
+}
+
+void update_view(View & v)
+{
+    v.x = GLint(v.left   * window_state.width);
+    v.y = GLint(v.bottom * window_state.height);
+    v.w = std::max<GLsizei>(GLsizei(v.width  * window_state.width),  1);
+    v.h = std::max<GLsizei>(GLsizei(v.height * window_state.height), 1);
+
+    // Imagery, and elevation over the same grid
+    const double basemapLod = lod(basemap, v.player.zoom);
+    v.basemapGrid = grid(v.w, v.h, v.player.zoom, level(basemapLod, basemap.maxZoom()), v.player.x, v.player.y);
+
+    // Near the switch, fade the finer of the two levels in
+    // over the coarser, rather than swapping one for the other.
+    // Each set is updated once, so that it pans by its deltas.
+    v.blend = 0.0;
+    if (player_state.blend && !(terrain && player_state.terrain))
+    {
+        const double coarse = std::floor(basemapLod);
+        const double t = (basemapLod - coarse - (0.5 - blendWidth))/(2.0*blendWidth);
+        if (t > 0.0 && t < 1.0 && coarse >= 0.0 && coarse + 1 <= basemap.maxZoom())
+        {
+            v.blend = t;
+            v.basemapGrid = grid(v.w, v.h, v.player.zoom, uint16_t(coarse), v.player.x, v.player.y);
+            v.blendGrid   = grid(v.w, v.h, v.player.zoom, uint16_t(coarse + 1), v.player.x, v.player.y);
+        }
+    }
+
+    // Layers not shown let go of their tiles, for TileFactory::collect
+    v.basemapVisible.update(basemap, v.basemapGrid.z, v.basemapGrid.tile, v.basemapGrid.size);
+    if (terrain && player_state.terrain)
+    {
+        v.terrainVisible.update(*terrain, v.basemapGrid.z, v.basemapGrid.tile, v.basemapGrid.size);
+    }
+    else
+    {
+        v.terrainVisible.clear();
+    }
+
+    if (v.blend > 0.0)
+    {
+        v.blendVisible.update(basemap, v.blendGrid.z, v.blendGrid.tile, v.blendGrid.size);
+    }
+    else
+    {
+        v.blendVisible.clear();
+    }
+
+    // Beyond the deepest level of the source, scale up the geometry
+    if (vectors && player_state.vector)
+    {
+        v.vectorsGrid = grid(v.w, v.h, v.player.zoom, level(lod(*vectors, v.player.zoom, 1.0), vectors->maxZoom()), v.player.x, v.player.y);
+        v.vectorsVisible.update(*vectors, v.vectorsGrid.z, v.vectorsGrid.tile, v.vectorsGrid.size);
+    }
+    else
+    {
+        v.vectorsVisible.clear();
+    }
+
+    // The current frame and those ahead of it
+    if (series)
+    {
+        v.seriesGrid = grid(v.w, v.h, v.player.zoom, level(lod(series->loader(), v.player.zoom), series->maxZoom()), v.player.x, v.player.y);
+        series->update(v.seriesGrid.z, v.seriesGrid.tile, v.seriesGrid.size);
+    }
+
+    // A cell of the heatmap to each pixel, computed for the visible tiles only
+    if (heatmap && player_state.heatmap)
+    {
+        const double heatmapLod = v.player.zoom + std::log2(tileSize*window_state.scale/HeatmapLayer::cells) + lodBias();
+        v.heatmapGrid = grid(v.w, v.h, v.player.zoom, level(heatmapLod, heatmap->maxZoom()), v.player.x, v.player.y);
+        heatmap->update(v.heatmapGrid.z, v.heatmapGrid.tile, v.heatmapGrid.size);
+    }
+}
+
+static void drawTiles(const VisibleSet & visible, ScrollCache * cache, const s_grid & g)
+{
+    // Only draw the tiles that scrolled into view, if caching
+    if (cache && cache->draw(visible, basemap.tileSize(), tileSize, g.zf, g.fx, g.fy))
+    {
+        return;
+    }
+
+    // Render the slippy map parts
+
+    for (const auto & i : visible.tiles())
+    {
+        if (i.draw)
+        {
+            glBindTexture(GL_TEXTURE_2D, i.draw->texid);
+            glPushMatrix();
+                glScaled(g.zf, g.zf, 1);
+                glTranslated(-g.fx, -g.fy, 0);
+                glScaled(tileSize, tileSize, 1);
+                glTranslated(i.i, i.j, 0);
+                glBegin(GL_QUADS);
+                    glTexCoord2f(i.minUV[0], i.minUV[1]); glVertex2f(0.0, 0.0);
+                    glTexCoord2f(i.minUV[0], i.maxUV[1]); glVertex2f(0.0, 1.0);
+                    glTexCoord2f(i.maxUV[0], i.maxUV[1]); glVertex2f(1.0, 1.0);
+                    glTexCoord2f(i.maxUV[0], i.minUV[1]); glVertex2f(1.0, 0.0);
+                glEnd();
+            glPopMatrix();
+        }
+    }
+}
+
+static void drawVectorTiles(const VectorLoader & loader, const VisibleSet & visible, const s_grid & g)
+{
+    // Geometry extends beyond the tile, and ancestors cover
+    // more than the tile, so clip to the tile itself
+    glEnable(GL_CLIP_PLANE0);
+    glEnable(GL_CLIP_PLANE1);
+    glEnable(GL_CLIP_PLANE2);
+    glEnable(GL_CLIP_PLANE3);
+
+    for (const auto & i : visible.tiles())
+    {
+        if (i.draw)
+        {
+            glPushMatrix();
+                glScaled(g.zf, g.zf, 1);
+                glTranslated(-g.fx, -g.fy, 0);
+                glScaled(tileSize, tileSize, 1);
+                glTranslated(i.i, i.j, 0);
+                glScaled(1.0/(i.maxUV[0]-i.minUV[0]), 1.0/(i.maxUV[1]-i.minUV[1]), 1);
+                glTranslated(-i.minUV[0], -i.minUV[1], 0);
+
+                // Planes are in vertex co-ordinates, the modelview is identity
+                const GLdouble planes[4][4] = {
+                    {  1,  0, 0, -i.minUV[0] },
+                    { -1,  0, 0,  i.maxUV[0] },
+                    {  0,  1, 0, -i.minUV[1] },
+                    {  0, -1, 0,  i.maxUV[1] }
+                };
+                glClipPlane(GL_CLIP_PLANE0, planes[0]);
+                glClipPlane(GL_CLIP_PLANE1, planes[1]);
+                glClipPlane(GL_CLIP_PLANE2, planes[2]);
+                glClipPlane(GL_CLIP_PLANE3, planes[3]);
+
+                // Background
+                glColor3ub(238, 236, 230);
+                glBegin(GL_QUADS);
+                    glVertex2f(i.minUV[0], i.minUV[1]);
+                    glVertex2f(i.minUV[0], i.maxUV[1]);
+                    glVertex2f(i.maxUV[0], i.maxUV[1]);
+                    glVertex2f(i.maxUV[0], i.minUV[1]);
+                glEnd();
+
+                loader.draw(*i.draw);
+            glPopMatrix();
+        }
+    }
+
+    glDisable(GL_CLIP_PLANE0);
+    glDisable(GL_CLIP_PLANE1);
+    glDisable(GL_CLIP_PLANE2);
+    glDisable(GL_CLIP_PLANE3);
+}
+
+static void drawTerrain(TerrainLoader & terrain, const VisibleSet & elevations, const VisibleSet & visible, const s_grid & g, double tilt)
+{
+    // Imagery and elevation over the same grid, tile for tile.
+    // Elevation deeper than the source comes from an ancestor.
+
+    glEnable(GL_DEPTH_TEST);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    for (size_t k = 0; k < visible.tiles().size() && k < elevations.tiles().size(); ++k)
+    {
+        const VisibleTile & i = visible.tiles()[k];
+        const VisibleTile & e = elevations.tiles()[k];
+
+        terrain.touch(*e.tile);
+
+        if (!i.draw)
+        {
+            continue;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, i.draw->texid);
+        glPushMatrix();
+            glScaled(g.zf, g.zf, g.zf);
+            glTranslated(-g.fx, -g.fy, 0);
+            glScaled(tileSize, tileSize, tileSize);
+            glTranslated(i.i, i.j, 0);
+
+            if (!e.draw)
+            {
+                // Flat until there is some elevation
+                glBegin(GL_QUADS);
+                    glTexCoord2f(i.minUV[0], i.minUV[1]); glVertex2f(0.0, 0.0);
+                    glTexCoord2f(i.minUV[0], i.maxUV[1]); glVertex2f(0.0, 1.0);
+                    glTexCoord2f(i.maxUV[0], i.maxUV[1]); glVertex2f(1.0, 1.0);
+                    glTexCoord2f(i.maxUV[0], i.minUV[1]); glVertex2f(1.0, 0.0);
+                glEnd();
+                glPopMatrix();
+                continue;
+            }
+
+            // The elevation tile, or the part of an ancestor covering
+            // this tile.  Heights scale along with the ancestor.
+            const double scale = 1.0/(e.maxUV[0]-e.minUV[0]);
+            glScaled(scale, scale, scale);
+            glTranslated(-e.minUV[0], -e.minUV[1], 0);
+
+            // Planes are in vertex co-ordinates, the modelview is identity
+            const GLdouble planes[4][4] = {
+                {  1,  0, 0, -e.minUV[0] },
+                { -1,  0, 0,  e.maxUV[0] },
+                {  0,  1, 0, -e.minUV[1] },
+                {  0, -1, 0,  e.maxUV[1] }
+            };
+            glClipPlane(GL_CLIP_PLANE0, planes[0]);
+            glClipPlane(GL_CLIP_PLANE1, planes[1]);
+            glClipPlane(GL_CLIP_PLANE2, planes[2]);
+            glClipPlane(GL_CLIP_PLANE3, planes[3]);
+            glEnable(GL_CLIP_PLANE0);
+            glEnable(GL_CLIP_PLANE1);
+            glEnable(GL_CLIP_PLANE2);
+            glEnable(GL_CLIP_PLANE3);
+
+            // Drape the imagery, from elevation co-ordinates
+            // to the part of the texture for this tile
+            glMatrixMode(GL_TEXTURE);
+            glPushMatrix();
+                glTranslated(i.minUV[0], i.minUV[1], 0);
+                glScaled(i.maxUV[0]-i.minUV[0], i.maxUV[1]-i.minUV[1], 1);
+                glScaled(scale, scale, 1);
+                glTranslated(-e.minUV[0], -e.minUV[1], 0);
+            glMatrixMode(GL_PROJECTION);
+
+            const int lod = terrain.select(*e.draw, tileSize*g.zf*scale, tilt);
+            terrain.draw(*e.draw, lod);
+
+            glMatrixMode(GL_TEXTURE);
+            glPopMatrix();
+            glMatrixMode(GL_PROJECTION);
+
+            glDisable(GL_CLIP_PLANE0);
+            glDisable(GL_CLIP_PLANE1);
+            glDisable(GL_CLIP_PLANE2);
+            glDisable(GL_CLIP_PLANE3);
+        glPopMatrix();
+    }
+
+    glDisable(GL_DEPTH_TEST);
+}
+
+// Each tile of the grid in its own unit square, for layers drawn by tile
+template<typename Draw>
+static void eachTile(const s_grid & g, Draw draw)
+{
+    const uint64_t levelSize = uint64_t(1)<<g.z;
+
+    for (uint64_t j = 0; j <= g.size[1]; ++j)
+    {
+        for (uint64_t i = 0; i <= g.size[0]; ++i)
+        {
+            glPushMatrix();
+                glScaled(g.zf, g.zf, 1);
+                glTranslated(-g.fx, -g.fy, 0);
+                glScaled(tileSize, tileSize, 1);
+                glTranslated(i, j, 0);
+                draw(g.z, (g.tile[0] + i)%levelSize, (g.tile[1] + j)%levelSize);
+            glPopMatrix();
+        }
+    }
+}
+
+static void drawTracks(TrackLayer & tracks, const s_grid & g)
+{
+    glColor3ub(255, 64, 0);
+    glLineWidth(3.0);
+    eachTile(g, [&](uint16_t z, uint64_t x, uint64_t y) { tracks.draw(z, x, y); });
+    glLineWidth(1.0);
+}
+
+static void drawMarkers(MarkerLayer & markers, const s_grid & g)
+{
+    glEnable(GL_TEXTURE_2D);
+    eachTile(g, [&](uint16_t z, uint64_t x, uint64_t y) { markers.draw(z, x, y); });
+    glDisable(GL_TEXTURE_2D);
+    glColor4d(1.0, 1.0, 1.0, 1.0);
+}
+
+static void drawSeries(TimeSeries & series, const s_grid & g)
+{
+    glEnable(GL_TEXTURE_2D);
+    eachTile(g, [&](uint16_t z, uint64_t x, uint64_t y) { series.draw(z, x, y); });
+    glDisable(GL_TEXTURE_2D);
+}
+
+static void drawHeatmap(HeatmapLayer & heatmap, const s_grid & g)
+{
+    glEnable(GL_TEXTURE_2D);
+    eachTile(g, [&](uint16_t z, uint64_t x, uint64_t y) { heatmap.draw(z, x, y); });
+    glDisable(GL_TEXTURE_2D);
+}
+
+// Seven segment digits and a slash as line segments, a unit wide and two high
+static void label(std::vector<GLfloat> & lines, const std::string & text, double x, double y, double unit)
+{
+    static const GLfloat segments[8][4] = {
+        { 0, 2, 1, 2 }, { 1, 2, 1, 1 }, { 1, 1, 1, 0 }, { 0, 0, 1, 0 },
+        { 0, 0, 0, 1 }, { 0, 1, 0, 2 }, { 0, 1, 1, 1 }, { 0, 0, 1, 2 }
+    };
+    // Segments of 0 to 9 and /, bit 0 the top and then clockwise, the middle bit 6
+    static const uint8_t digits[11] = { 0x3f, 0x06, 0x5b, 0x4f, 0x66, 0x6d, 0x7d, 0x07, 0x7f, 0x6f, 0x80 };
+
+    for (char c : text)
+    {
+        const uint8_t mask = c == '/' ? digits[10] : digits[c - '0'];
+        for (int s = 0; s < 8; ++s)
+        {
+            if (mask & (1 << s))
+            {
+                lines.push_back(GLfloat(x + segments[s][0]*unit));
+                lines.push_back(GLfloat(y + segments[s][1]*unit));
+                lines.push_back(GLfloat(x + segments[s][2]*unit));
+                lines.push_back(GLfloat(y + segments[s][3]*unit));
+            }
+        }
+        x += 1.6*unit;
+    }
+}
+
+// Tile boundaries of the level drawn, worked out from the camera alone,
+// covering the view whatever its rotation and tilt, in one draw call
+static void drawGrid(const View & v)
+{
+    const s_grid & g = v.basemapGrid;
+    const uint16_t z = g.z;
+    const int64_t levelSize = int64_t(1) << z;
+
+    // Window pixels across a tile, and the camera in tiles from the corner
+    // of the tile it is in
+    const double across = tileSize*g.zf;
+    const int64_t cx = z ? int64_t(v.player.x >> (64 - z)) : 0;
+    const int64_t cy = z ? int64_t(v.player.y >> (64 - z)) : 0;
+    const double fx = std::ldexp(double(z ? v.player.x - (uint64_t(cx) << (64 - z)) : v.player.x), -(64 - z));
+    const double fy = std::ldexp(double(z ? v.player.y - (uint64_t(cy) << (64 - z)) : v.player.y), -(64 - z));
+
+    // Tilting stretches the ground the view covers, rotating turns it,
+    // so reach the corners either way
+    const double stretch = 1.0/std::max(std::cos(v.viewport.angle_tilt*M_PI/180.0), 0.1);
+    const double reach = std::hypot(v.w/2.0, v.h/2.0*stretch)/across;
+    const int64_t extent = std::min<int64_t>(int64_t(std::ceil(reach)) + 1, 256);
+
+    // Lines along the grid, within the world north to south
+    const int64_t south = std::max<int64_t>(-extent, -cy);
+    const int64_t north = std::min<int64_t>(extent + 1, levelSize - cy);
+    std::vector<GLfloat> lines;
+    for (int64_t i = -extent; i <= extent + 1; ++i)
+    {
+        const GLfloat x = GLfloat((i - fx)*across);
+        lines.push_back(x); lines.push_back(GLfloat((south - fy)*across));
+        lines.push_back(x); lines.push_back(GLfloat((north - fy)*across));
+    }
+    for (int64_t j = south; j <= north; ++j)
+    {
+        const GLfloat y = GLfloat((j - fy)*across);
+        lines.push_back(GLfloat((-extent - fx)*across)); lines.push_back(y);
+        lines.push_back(GLfloat((extent + 1 - fx)*across)); lines.push_back(y);
+    }
+
+    // z/x/y of each tile in its bottom left corner, y from the north
+    if (player_state.labels)
+    {
+        for (int64_t j = south; j < north; ++j)
+        {
+            for (int64_t i = -extent; i <= extent; ++i)
+            {
+                const int64_t x = ((cx + i)%levelSize + levelSize)%levelSize;
+                const int64_t y = levelSize - 1 - (cy + j);
+                label(lines, std::to_string(z) + "/" + std::to_string(x) + "/" + std::to_string(y),
+                      (i - fx)*across + 6.0, (j - fy)*across + 6.0, 5.0);
+            }
+        }
+    }
+
+    glColor3d(1.0, 1.0, 1.0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(2, GL_FLOAT, 0, lines.data());
+    glDrawArrays(GL_LINES, 0, GLsizei(lines.size()/2));
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+static void drawCross()
+{
+    glColor3d(0.0, 0.0, 0.0);
+    glLineWidth(3.0);
+    glBegin(GL_LINES);
+        glVertex2f(-6,  0);
+        glVertex2f( 6,  0);
+        glVertex2f( 0, -6);
+        glVertex2f( 0,  6);
+    glEnd();
+
+    glColor3d(1.0, 1.0, 1.0);
+    glLineWidth(1.0);
+    glBegin(GL_LINES);
+        glVertex2f(-5,  0);
+        glVertex2f( 5,  0);
+        glVertex2f( 0, -5);
+        glVertex2f( 0,  5);
+    glEnd();
+}
+
+void render_view(View & v)
+{
+    // Drawn in window pixels, to drawable pixels
+    const double scale = window_state.scale;
+    glViewport(v.x*scale, v.y*scale, v.w*scale, v.h*scale);
+
+    // Clear with black
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(v.x*scale, v.y*scale, v.w*scale, v.h*scale);
+    glClearColor(0.0, 0.0, 0.0, 0.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glScalef(1.0,-1.0,1.0);
+    glTranslatef(0.0,-1.0,0.0);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    // Deep enough for terrain heights in pixels
+    glOrtho(-v.w/2.0, v.w/2.0, -v.h/2.0, v.h/2.0, -100000, 100000);
+
+    glPushMatrix();
+
+        // Rotate and and tilt the world geometry
+        glRotated(v.viewport.angle_tilt, 1.0, 0.0, 0.0);
+        glRotated(v.viewport.angle_rotate, 0.0, 0.0, -1.0);
+
+        // Draw tiles
+        glEnable(GL_BLEND);
+        glEnable(GL_TEXTURE_2D);
+
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glColor4d(1.0, 1.0, 1.0, 1.0);
+
+            if (terrain && player_state.terrain)
+            {
+                drawTerrain(*terrain, v.terrainVisible, v.basemapVisible, v.basemapGrid, v.viewport.angle_tilt);
+            }
+            else if (v.blend > 0.0)
+            {
+                drawTiles(v.basemapVisible, NULL, v.basemapGrid);
+                glColor4d(1.0, 1.0, 1.0, v.blend);
+                drawTiles(v.blendVisible, NULL, v.blendGrid);
+                glColor4d(1.0, 1.0, 1.0, 1.0);
+            }
+            else
+            {
+                drawTiles(v.basemapVisible, player_state.scroll ? &v.cache : NULL, v.basemapGrid);
+            }
+
+        glDisable(GL_TEXTURE_2D);
+
+            // Vector tiles over the imagery
+            if (vectors && player_state.vector)
+            {
+                drawVectorTiles(*vectors, v.vectorsVisible, v.vectorsGrid);
+            }
+
+            // The current frame of the animation
+            if (series)
+            {
+                drawSeries(*series, v.seriesGrid);
+            }
+            if (heatmap && player_state.heatmap)
+            {
+                drawHeatmap(*heatmap, v.heatmapGrid);
+            }
+
+            // Tracks over everything else
+            if (tracks && player_state.tracks)
+            {
+                drawTracks(*tracks, v.basemapGrid);
+            }
+            if (markers && player_state.markers)
+            {
+                drawMarkers(*markers, v.basemapGrid);
+            }
+
+        glDisable(GL_BLEND);
+
+        // Draw grid
+        if (player_state.grid)
+        {
+            drawGrid(v);
+        }
+
+    glPopMatrix();
+
+    // Draw cross
+    if (player_state.cross)
+    {
+        drawCross();
+    }
+
+    // Frame views that don't fill the window
+    if (v.w < window_state.width || v.h < window_state.height)
+    {
+        glColor3d(1.0, 1.0, 1.0);
+        glBegin(GL_LINE_LOOP);
+            glVertex2f(-(v.w / 2) + 0.5, -(v.h / 2) + 0.5);
+            glVertex2f(-(v.w / 2) + 0.5,  (v.h / 2) - 0.5);
+            glVertex2f( (v.w / 2) - 0.5,  (v.h / 2) - 0.5);
+            glVertex2f( (v.w / 2) - 0.5, -(v.h / 2) + 0.5);
+        glEnd();
+    }
+}
+
+void render_views()
+{
+    for (auto & i : views)
+    {
+        if (i->shown())
+        {
+            render_view(*i);
+        }
+    }
+
+    glViewport(0, 0, window_state.width*window_state.scale, window_state.height*window_state.scale);
+}
+
+void release_views()
+{
+    for (auto & i : views)
+    {
+        i->cache.release();
+        i->basemapVisible.clear();
+        i->vectorsVisible.clear();
+        i->terrainVisible.clear();
+        i->blendVisible.clear();
+    }
+    if (vectors)
+    {
+        vectors->release();
+    }
+    if (terrain)
+    {
+        terrain->release();
+    }
+    if (tracks)
+    {
+        tracks->release();
+    }
+    if (markers)
+    {
+        markers->release();
+    }
+    if (series)
+    {
+        series->release();
+    }
+    if (heatmap)
+    {
+        heatmap->release();
+    }
+}
@@ -0,0 +1,138 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "global.h"
+#include "input.h"
+#include "visibleset.h"
+#include "scrollcache.h"
+
+class Loader;
+class VectorLoader;
+class TerrainLoader;
+class TrackLayer;
+class MarkerLayer;
+class TimeSeries;
+class HeatmapLayer;
+
+// Window pixels across a level z tile at zoom z, whatever the source serves
+static const uint16_t bits = 9;
+static const uint64_t tileSize = uint64_t(1)<<bits;
+
+/**
+ * @brief grid of tiles at level z covering a view
+ */
+struct s_grid
+{
+    uint16_t z = 0;
+    double   zf = 1.0;          // scale of the level z tiles
+    uint64_t tile[2] = { 0, 0 };  // bottom left tile
+    uint64_t size[2] = { 0, 0 };  // grid size
+    double   fx = 0.0;          // offset in pixels from bottom left to center
+    double   fy = 0.0;
+};
+
+/**
+ * @brief a camera and the part of the window it is drawn to
+ *
+ * Views share the loaders and TileFactory, so a tile visible in more
+ * than one view is only fetched, decoded and uploaded once.
+ */
+struct View
+{
+    // Fraction of the window, from the bottom left
+    double left   = 0.0;
+    double bottom = 0.0;
+    double width  = 1.0;
+    double height = 1.0;
+
+    // Follow the centre of the main camera, zoomed out by zoomOffset
+    bool   follow = true;
+    double zoomOffset = 0.0;
+    // Follow the rotation and tilt of the main camera
+    bool   orient = true;
+    // Only shown with the minimap toggle
+    bool   minimap = false;
+
+    s_player_state   player;
+    s_viewport_state viewport;
+
+    // Pixels of the window, updated by update_views
+    GLint   x = 0;
+    GLint   y = 0;
+    GLsizei w = 0;
+    GLsizei h = 0;
+
+    s_grid      basemapGrid;
+    s_grid      vectorsGrid;
+    s_grid      seriesGrid;
+    s_grid      heatmapGrid;
+    VisibleSet  basemapVisible;
+    VisibleSet  vectorsVisible;
+    VisibleSet  terrainVisible;
+
+    // The next level of imagery faded in over basemapGrid near the
+    // switch between levels, if blending
+    s_grid      blendGrid;
+    VisibleSet  blendVisible;
+    double      blend = 0.0;
+    ScrollCache cache;
+
+    bool shown() const { return !minimap || player_state.minimap; }
+};
+
+extern Loader                              basemap;
+extern std::unique_ptr<VectorLoader>       vectors;
+extern std::unique_ptr<TerrainLoader>      terrain;
+extern std::unique_ptr<TrackLayer>         tracks;
+extern std::unique_ptr<MarkerLayer>        markers;
+extern std::unique_ptr<TimeSeries>         series;
+extern std::unique_ptr<HeatmapLayer>       heatmap;
+extern std::vector<std::unique_ptr<View>>  views;
+
+// Drawable pixels per window pixel, after the window is created or resized
+extern void update_scale();
+
+// Update the cameras and the visible tiles of every view, in one pass,
+// following the main camera
+extern void update_views(const s_player_state & camera);
+
+// Update the visible tiles of one view, for its own camera
+extern void update_view(View & v);
+
+// Draw every view
+extern void render_views();
+
+// Draw one view, whether or not it is shown
+extern void render_view(View & v);
+
+// Free the GL resources of the views and loaders, and let go of their tiles
+extern void release_views();
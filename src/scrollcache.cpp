@@ -0,0 +1,214 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <iostream>
+
+#include "scrollcache.h"
+#include "visibleset.h"
+#include "tile.h"
+#include "tilefactory.h"
+
+// Key of an empty slot, never a valid tile key
+static const uint64_t none = ~uint64_t(0);
+
+ScrollCache::ScrollCache()
+: m_fbo(0), m_texture(0), m_columns(0), m_rows(0), m_slotSize(0), m_zoom(0), m_redrawn(0)
+{
+}
+
+ScrollCache::~ScrollCache()
+{
+    // The GL context is gone by the time globals are destroyed,
+    // call release() beforehand to free the framebuffer.
+}
+
+void ScrollCache::release()
+{
+    if (m_fbo) {
+        glDeleteFramebuffers(1, &m_fbo);
+        m_fbo = 0;
+    }
+    if (m_texture) {
+        glDeleteTextures(1, &m_texture);
+        m_texture = 0;
+    }
+    m_columns = m_rows = m_slotSize = 0;
+    m_slots.clear();
+}
+
+bool ScrollCache::allocate(uint64_t columns, uint64_t rows, uint64_t slotSize)
+{
+    release();
+
+    if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object) {
+        return false;
+    }
+
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (columns*slotSize > uint64_t(maxSize) || rows*slotSize > uint64_t(maxSize)) {
+        return false;
+    }
+
+    glGenTextures(1, &m_texture);
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, columns*slotSize, rows*slotSize, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    // Drawing may be going to a framebuffer other than the window
+    GLint previous = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+
+    glGenFramebuffers(1, &m_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture, 0);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Scroll cache framebuffer incomplete: " << status << std::endl;
+        release();
+        return false;
+    }
+
+    m_columns  = columns;
+    m_rows     = rows;
+    m_slotSize = slotSize;
+    m_slots.assign(columns*rows, Slot{none, 0});
+
+    return true;
+}
+
+bool ScrollCache::draw(const VisibleSet & visible, uint64_t slotSize, uint64_t tileSize, double zf, double fx, double fy)
+{
+    const uint64_t columns = visible.columns();
+    const uint64_t rows    = visible.rows();
+
+    if (columns != m_columns || rows != m_rows || slotSize != m_slotSize) {
+        if (!allocate(columns, rows, slotSize)) {
+            return false;
+        }
+    }
+
+    if (visible.zoom() != m_zoom) {
+        m_zoom = visible.zoom();
+        m_slots.assign(columns*rows, Slot{none, 0});
+    }
+
+    // Bring the slots up to date with the visible tiles
+
+    m_redrawn = 0;
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLint previous = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glViewport(0, 0, m_columns*m_slotSize, m_rows*m_slotSize);
+
+    // Slot co-ordinates, the caller's transform is restored below
+    GLint mode;
+    glGetIntegerv(GL_MATRIX_MODE, &mode);
+    GLdouble projection[16];
+    glGetDoublev(GL_PROJECTION_MATRIX, projection);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, m_columns, 0, m_rows, -1, 1);
+
+    glDisable(GL_BLEND);
+
+    for (const auto & i : visible.tiles())
+    {
+        const uint64_t column = (visible.origin(0) + i.i) % m_columns;
+        const uint64_t row    = (visible.origin(1) + i.j) % m_rows;
+        Slot & slot = m_slots[row*m_columns + column];
+
+        const GLuint texid = i.draw ? i.draw->texid : 0;
+        const uint64_t key = TileFactory::tile_key(i.tile->zoom, i.tile->x, i.tile->y);
+        if (slot.key == key && slot.texid == texid) {
+            continue;
+        }
+        slot.key   = key;
+        slot.texid = texid;
+        ++m_redrawn;
+
+        // Only the clear is scissored, quads cover their own slot
+        if (!i.draw) {
+            glEnable(GL_SCISSOR_TEST);
+            glScissor(column*m_slotSize, row*m_slotSize, m_slotSize, m_slotSize);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDisable(GL_SCISSOR_TEST);
+            continue;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, texid);
+        glBegin(GL_QUADS);
+            glTexCoord2f(i.minUV[0], i.minUV[1]); glVertex2f(column,   row);
+            glTexCoord2f(i.minUV[0], i.maxUV[1]); glVertex2f(column,   row+1);
+            glTexCoord2f(i.maxUV[0], i.maxUV[1]); glVertex2f(column+1, row+1);
+            glTexCoord2f(i.maxUV[0], i.minUV[1]); glVertex2f(column+1, row);
+        glEnd();
+    }
+
+    glEnable(GL_BLEND);
+
+    glLoadMatrixd(projection);
+    glMatrixMode(mode);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    // Draw the whole grid as one quad, wrapping around the torus
+
+    const float u = float(visible.origin(0) % m_columns) / m_columns;
+    const float v = float(visible.origin(1) % m_rows)    / m_rows;
+
+    glMatrixMode(GL_TEXTURE);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(mode);
+
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glPushMatrix();
+        glScaled(zf, zf, 1);
+        glTranslated(-fx, -fy, 0);
+        glScaled(tileSize, tileSize, 1);
+        glBegin(GL_QUADS);
+            glTexCoord2f(u,     v    ); glVertex2f(0.0,     0.0);
+            glTexCoord2f(u,     v + 1); glVertex2f(0.0,     m_rows);
+            glTexCoord2f(u + 1, v + 1); glVertex2f(m_columns, m_rows);
+            glTexCoord2f(u + 1, v    ); glVertex2f(m_columns, 0.0);
+        glEnd();
+    glPopMatrix();
+
+    glMatrixMode(GL_TEXTURE);
+    glPopMatrix();
+    glMatrixMode(mode);
+
+    return true;
+}
@@ -0,0 +1,80 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+class VisibleSet;
+
+/**
+ * @brief offscreen cache of the composited, untilted map
+ *
+ * The visible grid of tiles is kept in a framebuffer texture addressed as
+ * a torus, tile (x, y) of the grid lives in slot (x % columns, y % rows).
+ * Panning only draws the tiles that scrolled into view, or that have a
+ * new texture since they were cached.  The cache is then drawn to the
+ * window as a single repeating quad.
+ */
+class ScrollCache
+{
+public:
+    ScrollCache();
+    ~ScrollCache();
+
+    // Draw the visible tiles via the cache, with the same transform as
+    // drawTiles, keeping slotSize pixels of each.  Returns false if the
+    // cache can't be used.
+    bool draw(const VisibleSet & visible, uint64_t slotSize, uint64_t tileSize, double zf, double fx, double fy);
+
+    void release();
+
+    // Number of tiles drawn into the cache by the last draw
+    size_t redrawn() const { return m_redrawn; }
+
+private:
+    ScrollCache(const ScrollCache &) = delete;
+
+    bool allocate(uint64_t columns, uint64_t rows, uint64_t slotSize);
+
+    // By key rather than Tile *, as records are reused once released
+    struct Slot
+    {
+        uint64_t key;
+        GLuint   texid;
+    };
+
+    GLuint   m_fbo;
+    GLuint   m_texture;
+    uint64_t m_columns;
+    uint64_t m_rows;
+    uint64_t m_slotSize;
+    uint16_t m_zoom;
+    size_t   m_redrawn;
+
+    std::vector<Slot> m_slots;
+};
@@ -0,0 +1,734 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <curl/curl.h>
+
+#include "server.h"
+#include "origin.h"
+#include "urltemplate.h"
+
+using boost::asio::ip::tcp;
+
+struct TileServer::Fetch
+{
+    Fetch(const std::string & path) : path(path) {}
+
+    const std::string path;
+
+    std::mutex                         mutex;
+    std::string                        type;
+    std::vector<char>                  data;
+    bool                               done = false;
+    bool                               ok   = false;
+
+    // Called once when there is more data, or the fetch is done
+    std::vector<std::function<void()>> waiters;
+
+    void append(const char * ptr, size_t size, const char * contentType)
+    {
+        std::vector<std::function<void()>> notify;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (type.empty() && contentType) {
+                type = contentType;
+            }
+            data.insert(data.end(), ptr, ptr + size);
+            notify.swap(waiters);
+        }
+        for (auto & i : notify) {
+            i();
+        }
+    }
+
+    void finish(bool success)
+    {
+        std::vector<std::function<void()>> notify;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+            ok = success;
+            notify.swap(waiters);
+        }
+        for (auto & i : notify) {
+            i();
+        }
+    }
+};
+
+// Only {z}/{x}/{y} with an optional extension, nothing that could
+// leave the cache directory
+static bool tile_path(const std::string & target, std::string & path)
+{
+    std::string t = target.substr(0, target.find('?'));
+    if (t.empty() || t[0] != '/') {
+        return false;
+    }
+    t.erase(0, 1);
+
+    int    slashes = 0;
+    bool   digits = false;
+    size_t i = 0;
+    for (; i < t.size(); ++i) {
+        if (std::isdigit(static_cast<unsigned char>(t[i]))) {
+            digits = true;
+        } else if (t[i] == '/' && digits && slashes < 2) {
+            ++slashes;
+            digits = false;
+        } else {
+            break;
+        }
+    }
+    if (slashes != 2 || !digits) {
+        return false;
+    }
+    if (i < t.size()) {
+        if (t[i] != '.') {
+            return false;
+        }
+        for (++i; i < t.size(); ++i) {
+            if (!std::isalnum(static_cast<unsigned char>(t[i]))) {
+                return false;
+            }
+        }
+    }
+
+    path = t;
+    return true;
+}
+
+// Level and tile of a path from tile_path, laid out as in the cache,
+// y from the south as in Tile
+static bool tile_coordinates(const std::string & path, bool tms, bool zxy, uint16_t & z, uint64_t & x, uint64_t & y)
+{
+    unsigned long long values[3];
+    std::stringstream ss(path);
+    char slash;
+    if (!(ss >> values[0] >> slash >> values[1] >> slash >> values[2]) || values[0] > 29) {
+        return false;
+    }
+    z = uint16_t(values[0]);
+    x = zxy ? values[1] : values[2];
+    y = zxy ? values[2] : values[1];
+    const uint64_t levelSize = uint64_t(1) << z;
+    if (x >= levelSize || y >= levelSize) {
+        return false;
+    }
+    if (!tms) {
+        y = levelSize - 1 - y;
+    }
+    return true;
+}
+
+// Content type from the first bytes, the cache keeps no headers
+static const char * sniff(const char * data, size_t size)
+{
+    if (size >= 4 && data[0] == '\x89' && data[1] == 'P' && data[2] == 'N' && data[3] == 'G') {
+        return "image/png";
+    }
+    if (size >= 2 && data[0] == '\xff' && data[1] == '\xd8') {
+        return "image/jpeg";
+    }
+    if (size >= 12 && std::string(data, 4) == "RIFF" && std::string(data + 8, 4) == "WEBP") {
+        return "image/webp";
+    }
+    if (size >= 2 && data[0] == '\x1f' && data[1] == '\x8b') {
+        return "application/x-protobuf";
+    }
+    return "application/octet-stream";
+}
+
+/**
+ * @brief one keep-alive client connection
+ *
+ * Handlers for a connection run on its strand, one at a time.
+ */
+class TileServer::Connection : public std::enable_shared_from_this<Connection>
+{
+public:
+    Connection(TileServer & server, boost::asio::io_service & service)
+    : m_server(server), m_socket(service), m_strand(service), m_timer(service), m_in(max_request)
+    {
+    }
+
+    ~Connection()
+    {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    tcp::socket & socket() { return m_socket; }
+
+    void start()
+    {
+        boost::system::error_code ignored;
+        m_socket.set_option(tcp::no_delay(true), ignored);
+        m_socket.native_non_blocking(true, ignored);
+        read();
+    }
+
+private:
+    void read();
+    void request(const boost::system::error_code & error, size_t size);
+    void respond(int status, const char * reason);
+    void send_file();
+    void stream();
+    void finished();
+    void close();
+
+    std::string header(int status, const char * reason, const char * type, int64_t length);
+
+    TileServer &                  m_server;
+    tcp::socket                   m_socket;
+    boost::asio::io_service::strand m_strand;
+    boost::asio::deadline_timer   m_timer;
+    // Request head, never buffered beyond max_request
+    static const size_t           max_request = 8192;
+    boost::asio::streambuf        m_in;
+    std::string                   m_out;
+
+    bool                          m_reading   = false;
+    bool                          m_http11    = true;
+    bool                          m_keepalive = true;
+
+    // Cached file being sent
+    int                           m_fd = -1;
+    off_t                         m_offset = 0;
+    off_t                         m_size = 0;
+
+    // Origin download being streamed
+    std::shared_ptr<Fetch>        m_fetch;
+    size_t                        m_sent = 0;
+    bool                          m_headerSent = false;
+    bool                          m_chunked = false;
+};
+
+void TileServer::Connection::read()
+{
+    auto self = shared_from_this();
+
+    // Idle keep-alive connections are closed after a while
+    m_reading = true;
+    m_timer.expires_from_now(boost::posix_time::seconds(30));
+    m_timer.async_wait(m_strand.wrap([self](const boost::system::error_code & error) {
+        if (!error && self->m_reading) {
+            self->close();
+        }
+    }));
+
+    boost::asio::async_read_until(m_socket, m_in, "\r\n\r\n",
+        m_strand.wrap([self](const boost::system::error_code & error, size_t size) {
+            self->request(error, size);
+        }));
+}
+
+void TileServer::Connection::request(const boost::system::error_code & error, size_t size)
+{
+    m_reading = false;
+    m_timer.cancel();
+
+    // No blank line within the limit, the rest is not worth reading
+    if (error == boost::asio::error::not_found) {
+        ++m_server.m_requests;
+        m_keepalive = false;
+        respond(431, "Request Header Fields Too Large");
+        return;
+    }
+    if (error) {
+        close();
+        return;
+    }
+
+    std::string head(boost::asio::buffers_begin(m_in.data()), boost::asio::buffers_begin(m_in.data()) + size);
+    m_in.consume(size);
+    ++m_server.m_requests;
+
+    std::istringstream lines(head);
+    std::string line;
+    std::getline(lines, line);
+
+    std::string method, target, version;
+    std::istringstream(line) >> method >> target >> version;
+    m_http11 = version == "HTTP/1.1";
+    m_keepalive = m_http11;
+
+    while (std::getline(lines, line)) {
+        for (auto & c : line) {
+            c = std::tolower(static_cast<unsigned char>(c));
+        }
+        if (line.compare(0, 11, "connection:") == 0) {
+            if (line.find("close") != std::string::npos) {
+                m_keepalive = false;
+            } else if (line.find("keep-alive") != std::string::npos) {
+                m_keepalive = true;
+            }
+        }
+    }
+
+    if (method != "GET") {
+        respond(405, "Method Not Allowed");
+        return;
+    }
+
+    std::string path;
+    if (!tile_path(target, path)) {
+        respond(404, "Not Found");
+        return;
+    }
+
+    int fd = -1;
+    m_fetch = m_server.lookup(path, fd);
+
+    if (m_fetch) {
+        m_sent = 0;
+        m_headerSent = false;
+        stream();
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    m_fd = fd;
+    m_offset = 0;
+    m_size = st.st_size;
+
+    char magic[16];
+    const ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    m_out = header(200, "OK", sniff(magic, n > 0 ? n : 0), m_size);
+
+    auto self = shared_from_this();
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_out),
+        m_strand.wrap([self](const boost::system::error_code & error, size_t) {
+            if (error) {
+                self->close();
+            } else {
+                self->send_file();
+            }
+        }));
+}
+
+std::string TileServer::Connection::header(int status, const char * reason, const char * type, int64_t length)
+{
+    std::ostringstream h;
+    h << (m_http11 ? "HTTP/1.1 " : "HTTP/1.0 ") << status << ' ' << reason << "\r\n";
+    h << "Server: slippymap3d\r\n";
+    if (type) {
+        h << "Content-Type: " << type << "\r\n";
+    }
+
+    m_chunked = false;
+    if (length >= 0) {
+        h << "Content-Length: " << length << "\r\n";
+    } else if (m_http11) {
+        h << "Transfer-Encoding: chunked\r\n";
+        m_chunked = true;
+    } else {
+        // HTTP/1.0 without a length ends at close
+        m_keepalive = false;
+    }
+
+    h << "Connection: " << (m_keepalive ? "keep-alive" : "close") << "\r\n\r\n";
+    return h.str();
+}
+
+void TileServer::Connection::respond(int status, const char * reason)
+{
+    const std::string body = std::string(reason) + "\n";
+    m_out = header(status, reason, "text/plain", body.size()) + body;
+
+    auto self = shared_from_this();
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_out),
+        m_strand.wrap([self](const boost::system::error_code & error, size_t) {
+            if (error) {
+                self->close();
+            } else {
+                self->finished();
+            }
+        }));
+}
+
+void TileServer::Connection::send_file()
+{
+    auto self = shared_from_this();
+
+#ifdef __linux__
+    // Zero copy from the page cache, waiting whenever the socket is full
+    while (m_offset < m_size) {
+        const ssize_t n = ::sendfile(m_socket.native_handle(), m_fd, &m_offset, m_size - m_offset);
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            m_socket.async_write_some(boost::asio::null_buffers(),
+                m_strand.wrap([self](const boost::system::error_code & error, size_t) {
+                    if (error) {
+                        self->close();
+                    } else {
+                        self->send_file();
+                    }
+                }));
+            return;
+        }
+        // Error, or the file was truncated
+        close();
+        return;
+    }
+#else
+    // Elsewhere, a block at a time
+    if (m_offset < m_size) {
+        m_out.resize(std::min<off_t>(m_size - m_offset, 64*1024));
+        const ssize_t n = pread(m_fd, &m_out[0], m_out.size(), m_offset);
+        if (n <= 0) {
+            close();
+            return;
+        }
+        m_offset += n;
+        boost::asio::async_write(m_socket, boost::asio::buffer(m_out.data(), n),
+            m_strand.wrap([self](const boost::system::error_code & error, size_t) {
+                if (error) {
+                    self->close();
+                } else {
+                    self->send_file();
+                }
+            }));
+        return;
+    }
+#endif
+
+    ::close(m_fd);
+    m_fd = -1;
+    finished();
+}
+
+void TileServer::Connection::stream()
+{
+    std::string type;
+    bool done;
+    bool ok;
+    size_t total;
+    {
+        std::lock_guard<std::mutex> lock(m_fetch->mutex);
+        done = m_fetch->done;
+        ok = m_fetch->ok;
+        total = m_fetch->data.size();
+
+        if (total == m_sent && !done) {
+            // Wait for the origin
+            auto self = shared_from_this();
+            m_fetch->waiters.push_back([self]() {
+                self->m_strand.post(std::bind(&Connection::stream, self));
+            });
+            return;
+        }
+
+        type = m_fetch->type;
+        m_out.assign(m_fetch->data.begin() + m_sent, m_fetch->data.begin() + total);
+    }
+
+    if (done && !ok) {
+        ++m_server.m_failed;
+        m_fetch.reset();
+        if (m_headerSent) {
+            // Too late for a status, an unterminated response tells the client
+            close();
+        } else {
+            respond(502, "Bad Gateway");
+        }
+        return;
+    }
+
+    std::string prefix;
+    if (!m_headerSent) {
+        if (type.empty()) {
+            type = sniff(m_out.data(), m_out.size());
+        }
+        // Complete already, the length is known
+        prefix = header(200, "OK", type.c_str(), done ? int64_t(total) : -1);
+        m_headerSent = true;
+    }
+
+    std::string suffix;
+    if (m_chunked) {
+        if (!m_out.empty()) {
+            char size[32];
+            std::snprintf(size, sizeof(size), "%zx\r\n", m_out.size());
+            prefix += size;
+            suffix = "\r\n";
+        }
+        if (done) {
+            suffix += "0\r\n\r\n";
+        }
+    }
+    m_out = prefix + m_out + suffix;
+    m_sent = total;
+
+    auto self = shared_from_this();
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_out),
+        m_strand.wrap([self, done](const boost::system::error_code & error, size_t) {
+            if (error) {
+                self->close();
+            } else if (done) {
+                self->m_fetch.reset();
+                self->finished();
+            } else {
+                self->stream();
+            }
+        }));
+}
+
+void TileServer::Connection::finished()
+{
+    if (m_keepalive) {
+        read();
+    } else {
+        close();
+    }
+}
+
+void TileServer::Connection::close()
+{
+    boost::system::error_code ignored;
+    m_timer.cancel(ignored);
+    m_socket.shutdown(tcp::socket::shutdown_both, ignored);
+    m_socket.close(ignored);
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+// Origin download threads, mostly waiting on the network
+static size_t download_threads()
+{
+    const char * value = std::getenv("SLIPPYMAP_IO_THREADS");
+    if (value && std::atoi(value) > 0) {
+        return std::atoi(value);
+    }
+    return 16;
+}
+
+TileServer::TileServer(unsigned short port, const std::string & origin, const std::string & dir,
+                       bool tms, bool zxy, const std::string & extension)
+: m_origin(origin), m_dir(dir), m_tms(tms), m_zxy(zxy),
+  m_acceptor(m_service, tcp::endpoint(tcp::v4(), port)),
+  m_signals(m_service, SIGINT, SIGTERM),
+  m_downloads("origin", download_threads()),
+  m_requests(0), m_hits(0), m_misses(0), m_coalesced(0), m_failed(0)
+{
+    // Writes to a closed connection are errors, not signals
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!m_origin.empty()) {
+        m_urls.reset(new UrlTemplate(m_origin, tms, zxy, extension));
+        m_origins.resize(m_urls->mirrors());
+        for (size_t m = 0; m < m_urls->mirrors(); ++m) {
+            for (size_t s = 0; s < m_urls->shards(m); ++s) {
+                m_origins[m].push_back(&Origin::get(m_urls->host(m, s), download_threads()));
+            }
+        }
+    }
+
+    m_signals.async_wait([this](const boost::system::error_code &, int) { stop(); });
+    accept();
+}
+
+TileServer::~TileServer()
+{
+    stop();
+    m_threads.join_all();
+}
+
+void TileServer::run()
+{
+    const size_t threads = std::max<size_t>(boost::thread::hardware_concurrency(), 1);
+
+    std::cout << "TileServer port " << m_acceptor.local_endpoint().port()
+              << ", " << m_dir << " from " << m_origin
+              << ", " << threads << " threads" << std::endl;
+
+    for (size_t i = 0; i < threads; i++) {
+        m_threads.create_thread([this]() { m_service.run(); });
+    }
+    m_threads.join_all();
+
+    std::cout << "TileServer " << m_requests << " requests, "
+              << m_hits << " hits, " << m_misses << " misses, "
+              << m_coalesced << " coalesced, " << m_failed << " failed" << std::endl;
+}
+
+void TileServer::stop()
+{
+    m_service.stop();
+}
+
+void TileServer::accept()
+{
+    std::shared_ptr<Connection> connection(new Connection(*this, m_service));
+    m_acceptor.async_accept(connection->socket(), [this, connection](const boost::system::error_code & error) {
+        if (error == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (!error) {
+            connection->start();
+        }
+        accept();
+    });
+}
+
+std::shared_ptr<TileServer::Fetch> TileServer::lookup(const std::string & path, int & fd)
+{
+    // Under the lock, so a fetch finishing now is either still listed
+    // or already in the cache
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto i = m_fetches.find(path);
+    if (i != m_fetches.end()) {
+        ++m_coalesced;
+        return i->second;
+    }
+
+    fd = ::open((m_dir + path).c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            ++m_hits;
+            return nullptr;
+        }
+        ::close(fd);
+        fd = -1;
+    }
+
+    ++m_misses;
+    std::shared_ptr<Fetch> f(new Fetch(path));
+    m_fetches[path] = f;
+    m_downloads.post(std::bind(&TileServer::fetch, this, f));
+    return f;
+}
+
+struct Transfer
+{
+    CURL *              curl;
+    TileServer::Fetch * fetch;
+};
+
+static size_t received(char * ptr, size_t size, size_t nmemb, void * userdata)
+{
+    Transfer * transfer = static_cast<Transfer *>(userdata);
+    char * type = nullptr;
+    curl_easy_getinfo(transfer->curl, CURLINFO_CONTENT_TYPE, &type);
+    transfer->fetch->append(ptr, size*nmemb, type);
+    return size*nmemb;
+}
+
+void TileServer::fetch(std::shared_ptr<Fetch> f)
+{
+    bool ok = false;
+
+    uint16_t z;
+    uint64_t x, y;
+    const bool known = m_urls && tile_coordinates(f->path, m_tms, m_zxy, z, x, y);
+
+    // Another mirror if one fails before anything was sent on
+    for (size_t attempt = 0; known && !ok && attempt < m_urls->mirrors(); ++attempt) {
+        {
+            std::lock_guard<std::mutex> lock(f->mutex);
+            if (!f->data.empty()) {
+                break;
+            }
+        }
+
+        std::vector<const Origin *> mirrors;
+        for (size_t m = 0; m < m_origins.size(); ++m) {
+            mirrors.push_back(m_origins[m][m_urls->shard(m, z, x, y)]);
+        }
+        const std::string url = m_urls->url(Origin::choose(mirrors, int(attempt)), z, x, y);
+
+        CURL * curl = curl_easy_init();
+        if (!curl) {
+            break;
+        }
+        Transfer transfer{curl, f.get()};
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, received);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+
+        char errorMessage[CURL_ERROR_SIZE];
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorMessage);
+
+        CURLcode res = curl_easy_perform(curl);
+        curl_easy_cleanup(curl);
+        if (res != CURLE_OK) {
+            std::cerr << "Failed to fetch: " << url << " " << errorMessage << std::endl;
+        } else {
+            ok = true;
+        }
+    }
+
+    // Into the cache before leaving the in-flight list, written aside
+    // and renamed so that a partial tile is never served
+    if (ok) {
+        const std::string file = m_dir + f->path;
+        const std::string part = file + ".part";
+        boost::system::error_code ignored;
+        boost::filesystem::create_directories(boost::filesystem::path(file).parent_path(), ignored);
+
+        FILE * fp = fopen(part.c_str(), "wb");
+        if (fp) {
+            const bool written = fwrite(f->data.data(), 1, f->data.size(), fp) == f->data.size();
+            if (fclose(fp) == 0 && written) {
+                std::rename(part.c_str(), file.c_str());
+            } else {
+                std::remove(part.c_str());
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fetches.erase(f->path);
+    }
+
+    f->finish(ok);
+}
@@ -0,0 +1,114 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include "pool.h"
+
+class Origin;
+class UrlTemplate;
+
+/**
+ * @brief HTTP tile server in front of a loader disk cache
+ *
+ * Serves {z}/{x}/{y} paths from the cache directory over keep-alive
+ * connections, using sendfile for cached tiles.  A miss is fetched
+ * from the origin once, however many clients ask for it at the same
+ * time, and each of them is streamed the response as it arrives.  The
+ * finished tile is then written to the cache for later requests.
+ * Misses are fetched from the origin's URL template, laid out as the
+ * cache is, from the same mirror and subdomain as a Loader would use.
+ *
+ * Other instances use it by pointing their loader prefix at it.
+ */
+class TileServer
+{
+public:
+    // The origin and cache of a Loader, see UrlTemplate and get_filename
+    TileServer(unsigned short port, const std::string & origin, const std::string & dir,
+               bool tms, bool zxy, const std::string & extension);
+    ~TileServer();
+
+    // Serve until interrupted
+    void run();
+    void stop();
+
+    uint64_t requests()  const { return m_requests; }
+    uint64_t hits()      const { return m_hits; }
+    uint64_t misses()    const { return m_misses; }
+    uint64_t coalesced() const { return m_coalesced; }
+    uint64_t failed()    const { return m_failed; }
+
+    // Origin download in progress, shared by the clients waiting for it
+    struct Fetch;
+
+    // The in-flight fetch for the path, if any, or the open cached file.
+    // Otherwise a new fetch is started.
+    std::shared_ptr<Fetch> lookup(const std::string & path, int & fd);
+
+private:
+    TileServer(const TileServer &) = delete;
+
+    class Connection;
+
+    void accept();
+    void fetch(std::shared_ptr<Fetch> fetch);
+
+    const std::string m_origin;
+    const std::string m_dir;
+    const bool        m_tms;
+    const bool        m_zxy;
+
+    // Every host of every mirror, for choosing between them
+    std::unique_ptr<UrlTemplate>        m_urls;
+    std::vector<std::vector<Origin *>>  m_origins;
+
+    boost::asio::io_service        m_service;
+    boost::asio::ip::tcp::acceptor m_acceptor;
+    boost::asio::signal_set        m_signals;
+    boost::thread_group            m_threads;
+
+    // Blocking origin downloads
+    WorkerPool                     m_downloads;
+
+    std::mutex                                     m_mutex;
+    std::map<std::string, std::shared_ptr<Fetch>>  m_fetches;
+
+    std::atomic<uint64_t> m_requests;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_coalesced;
+    std::atomic<uint64_t> m_failed;
+};
@@ -0,0 +1,484 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include "loader.h"
+#include "session.h"
+
+SessionRecorder * recording = NULL;
+SessionPlayer   * replaying = NULL;
+
+namespace {
+
+const char magic[4] = { 'S', 'M', 'S', '2' };
+
+// Record tags
+enum : uint8_t { KEYDOWN = 'K', KEYUP = 'k', MOTION = 'M', BUTTONDOWN = 'B', BUTTONUP = 'b',
+                 WHEEL = 'W', RESIZED = 'R', QUIT = 'Q', FRAME = 'F' };
+
+void put_u8(std::string & out, uint8_t v)
+{
+    out.push_back(char(v));
+}
+
+void put_u64(std::string & out, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(char(v >> (i*8)));
+    }
+}
+
+void put_f64(std::string & out, double v)
+{
+    uint64_t u;
+    std::memcpy(&u, &v, sizeof(u));
+    put_u64(out, u);
+}
+
+void put_varint(std::string & out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+// Zigzag, so that small negative numbers are small too
+void put_signed(std::string & out, int64_t v)
+{
+    put_varint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+}
+
+/**
+ * @brief reads what the put_ functions wrote, failing at the end
+ */
+struct Reader
+{
+    Reader(const std::vector<uint8_t> & data, size_t & pos) : data(data), pos(pos), ok(true) {}
+
+    const std::vector<uint8_t> & data;
+    size_t & pos;
+    bool ok;
+
+    uint8_t u8()
+    {
+        if (pos >= data.size()) {
+            ok = false;
+            return 0;
+        }
+        return data[pos++];
+    }
+
+    uint64_t u64()
+    {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i) {
+            v |= uint64_t(u8()) << (i*8);
+        }
+        return v;
+    }
+
+    double f64()
+    {
+        const uint64_t u = u64();
+        double v;
+        std::memcpy(&v, &u, sizeof(v));
+        return v;
+    }
+
+    uint64_t varint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; ok && shift < 64; shift += 7) {
+            const uint8_t b = u8();
+            v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                break;
+            }
+        }
+        return v;
+    }
+
+    int64_t signed_()
+    {
+        const uint64_t v = varint();
+        return int64_t(v >> 1) ^ -int64_t(v & 1);
+    }
+};
+
+}
+
+SessionRecorder::SessionRecorder()
+: m_file(NULL)
+{
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    close();
+}
+
+bool SessionRecorder::open(const std::string & filename, const std::vector<Loader *> & loaders)
+{
+    close();
+
+    m_file = std::fopen(filename.c_str(), "wb");
+    if (!m_file) {
+        std::cerr << "Could not record to " << filename << std::endl;
+        return false;
+    }
+
+    m_buffer.assign(magic, sizeof(magic));
+    put_varint(m_buffer, window_state.width);
+    put_varint(m_buffer, window_state.height);
+
+    put_varint(m_buffer, player_state.grid    << 0 |
+                         player_state.cross   << 1 |
+                         player_state.scroll  << 2 |
+                         player_state.vector  << 3 |
+                         player_state.terrain << 4 |
+                         player_state.minimap << 5 |
+                         player_state.blend   << 6 |
+                         player_state.tracks  << 7 |
+                         player_state.markers << 8 |
+                         player_state.animate << 9 |
+                         player_state.heatmap << 10 |
+                         player_state.labels  << 11);
+    put_u64(m_buffer, player_state.x);
+    put_u64(m_buffer, player_state.y);
+    put_f64(m_buffer, player_state.zoom);
+    put_f64(m_buffer, viewport_state.angle_rotate);
+    put_f64(m_buffer, viewport_state.angle_tilt);
+    put_signed(m_buffer, velocity.x);
+    put_signed(m_buffer, velocity.y);
+
+    // Sorted keys, as differences from the one before
+    put_u8(m_buffer, uint8_t(loaders.size()));
+    for (Loader * loader : loaders) {
+        put_u8(m_buffer, loader != NULL);
+        if (!loader) {
+            continue;
+        }
+        const std::vector<uint64_t> keys = loader->cached();
+        put_varint(m_buffer, keys.size());
+        uint64_t previous = 0;
+        for (uint64_t key : keys) {
+            put_varint(m_buffer, key - previous);
+            previous = key;
+        }
+    }
+
+    std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+    m_buffer.clear();
+
+    return true;
+}
+
+void SessionRecorder::event(const SDL_Event & event)
+{
+    switch (event.type) {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            put_u8(m_buffer, event.type == SDL_KEYDOWN ? KEYDOWN : KEYUP);
+            put_varint(m_buffer, uint32_t(event.key.keysym.sym));
+            put_varint(m_buffer, event.key.keysym.mod);
+            put_u8(m_buffer, event.key.state);
+            put_u8(m_buffer, event.key.repeat);
+            break;
+        case SDL_MOUSEMOTION:
+            put_u8(m_buffer, MOTION);
+            put_varint(m_buffer, event.motion.state);
+            put_signed(m_buffer, event.motion.x);
+            put_signed(m_buffer, event.motion.y);
+            put_signed(m_buffer, event.motion.xrel);
+            put_signed(m_buffer, event.motion.yrel);
+            break;
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+            put_u8(m_buffer, event.type == SDL_MOUSEBUTTONDOWN ? BUTTONDOWN : BUTTONUP);
+            put_u8(m_buffer, event.button.button);
+            put_u8(m_buffer, event.button.clicks);
+            put_signed(m_buffer, event.button.x);
+            put_signed(m_buffer, event.button.y);
+            break;
+        case SDL_MOUSEWHEEL:
+            put_u8(m_buffer, WHEEL);
+            put_signed(m_buffer, event.wheel.x);
+            put_signed(m_buffer, event.wheel.y);
+            put_varint(m_buffer, event.wheel.direction);
+            break;
+        case SDL_WINDOWEVENT:
+            if (event.window.event == SDL_WINDOWEVENT_RESIZED) {
+                put_u8(m_buffer, RESIZED);
+                put_varint(m_buffer, event.window.data1);
+                put_varint(m_buffer, event.window.data2);
+            }
+            break;
+        case SDL_QUIT:
+            put_u8(m_buffer, QUIT);
+            break;
+        default:
+            break;
+    }
+}
+
+void SessionRecorder::frame(double elapsed)
+{
+    if (!m_file) {
+        return;
+    }
+    put_u8(m_buffer, FRAME);
+    put_f64(m_buffer, elapsed);
+    std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+    m_buffer.clear();
+}
+
+void SessionRecorder::close()
+{
+    if (m_file) {
+        // Whatever was polled after the last frame, e.g. quitting
+        std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+        std::fclose(m_file);
+        m_file = NULL;
+    }
+    m_buffer.clear();
+}
+
+SessionPlayer::SessionPlayer()
+: m_pos(0), m_width(0), m_height(0), m_velocity(0, 0), m_elapsed(0.0), m_frames(0)
+{
+}
+
+bool SessionPlayer::open(const std::string & filename)
+{
+    std::ifstream is(filename, std::ios::binary);
+    m_data.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    m_pos = 0;
+    m_cached.clear();
+
+    if (m_data.size() < sizeof(magic) || std::memcmp(m_data.data(), magic, sizeof(magic))) {
+        std::cerr << "Not a recorded session: " << filename << std::endl;
+        m_data.clear();
+        return false;
+    }
+    m_pos = sizeof(magic);
+
+    Reader in(m_data, m_pos);
+    m_width  = int(in.varint());
+    m_height = int(in.varint());
+
+    const uint64_t flags = in.varint();
+    m_player.grid    = flags & (1 << 0);
+    m_player.cross   = flags & (1 << 1);
+    m_player.scroll  = flags & (1 << 2);
+    m_player.vector  = flags & (1 << 3);
+    m_player.terrain = flags & (1 << 4);
+    m_player.minimap = flags & (1 << 5);
+    m_player.blend   = flags & (1 << 6);
+    m_player.tracks  = flags & (1 << 7);
+    m_player.markers = flags & (1 << 8);
+    m_player.animate = flags & (1 << 9);
+    m_player.heatmap = flags & (1 << 10);
+    m_player.labels  = flags & (1 << 11);
+    m_player.x    = in.u64();
+    m_player.y    = in.u64();
+    m_player.zoom = in.f64();
+    m_viewport.angle_rotate = in.f64();
+    m_viewport.angle_tilt   = in.f64();
+    m_velocity.x = in.signed_();
+    m_velocity.y = in.signed_();
+
+    const uint8_t loaders = in.u8();
+    for (uint8_t i = 0; in.ok && i < loaders; ++i) {
+        m_cached.emplace_back(in.u8() != 0, std::vector<uint64_t>());
+        if (!m_cached.back().first) {
+            continue;
+        }
+        std::vector<uint64_t> & keys = m_cached.back().second;
+        keys.resize(std::min<uint64_t>(in.varint(), m_data.size()));
+        uint64_t key = 0;
+        for (uint64_t & k : keys) {
+            key += in.varint();
+            k = key;
+        }
+    }
+
+    if (!in.ok) {
+        std::cerr << "Truncated session: " << filename << std::endl;
+        m_data.clear();
+        m_pos = 0;
+        return false;
+    }
+
+    return true;
+}
+
+void SessionPlayer::start(const std::vector<Loader *> & loaders)
+{
+    player_state   = m_player;
+    viewport_state = m_viewport;
+    velocity       = m_velocity;
+
+    // A loader that wasn't there when recording has nothing cached
+    for (size_t i = 0; i < loaders.size(); ++i) {
+        if (loaders[i]) {
+            loaders[i]->freeze(i < m_cached.size() ? m_cached[i].second : std::vector<uint64_t>());
+        }
+    }
+}
+
+bool SessionPlayer::event(SDL_Event & event)
+{
+    Reader in(m_data, m_pos);
+    if (finished()) {
+        return false;
+    }
+
+    std::memset(&event, 0, sizeof(event));
+    const uint8_t tag = in.u8();
+    switch (tag) {
+        case KEYDOWN:
+        case KEYUP:
+            event.type = tag == KEYDOWN ? SDL_KEYDOWN : SDL_KEYUP;
+            event.key.keysym.sym = SDL_Keycode(uint32_t(in.varint()));
+            event.key.keysym.mod = Uint16(in.varint());
+            event.key.state  = in.u8();
+            event.key.repeat = in.u8();
+            break;
+        case MOTION:
+            event.type = SDL_MOUSEMOTION;
+            event.motion.state = Uint32(in.varint());
+            event.motion.x    = Sint32(in.signed_());
+            event.motion.y    = Sint32(in.signed_());
+            event.motion.xrel = Sint32(in.signed_());
+            event.motion.yrel = Sint32(in.signed_());
+            break;
+        case BUTTONDOWN:
+        case BUTTONUP:
+            event.type = tag == BUTTONDOWN ? SDL_MOUSEBUTTONDOWN : SDL_MOUSEBUTTONUP;
+            event.button.state  = event.type == SDL_MOUSEBUTTONDOWN;
+            event.button.button = in.u8();
+            event.button.clicks = in.u8();
+            event.button.x = Sint32(in.signed_());
+            event.button.y = Sint32(in.signed_());
+            break;
+        case WHEEL:
+            event.type = SDL_MOUSEWHEEL;
+            event.wheel.x = Sint32(in.signed_());
+            event.wheel.y = Sint32(in.signed_());
+            event.wheel.direction = Uint32(in.varint());
+            break;
+        case RESIZED:
+            event.type = SDL_WINDOWEVENT;
+            event.window.event = SDL_WINDOWEVENT_RESIZED;
+            event.window.data1 = Sint32(in.varint());
+            event.window.data2 = Sint32(in.varint());
+            // The drawable has to match, as well as the window state
+            SDL_SetWindowSize(window, event.window.data1, event.window.data2);
+            break;
+        case QUIT:
+            event.type = SDL_QUIT;
+            break;
+        case FRAME:
+            m_elapsed = in.f64();
+            ++m_frames;
+            return false;
+        default:
+            // Can't tell where the next record starts
+            m_pos = m_data.size();
+            return false;
+    }
+
+    if (!in.ok) {
+        m_pos = m_data.size();
+        return false;
+    }
+
+    return true;
+}
+
+void ReplayReport::frame(double settle, double draw, size_t uploads, uint64_t hash)
+{
+    m_frames.push_back(Frame{settle, draw, uploads, hash});
+}
+
+bool ReplayReport::write(const std::string & filename) const
+{
+    std::ofstream os(filename);
+    if (!os) {
+        std::cerr << "Could not write " << filename << std::endl;
+        return false;
+    }
+
+    os << "frame,settle_ms,draw_ms,uploads,hash" << std::endl;
+    for (size_t i = 0; i < m_frames.size(); ++i) {
+        const Frame & f = m_frames[i];
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) f.hash);
+        os << i << ',' << f.settle*1000.0 << ',' << f.draw*1000.0 << ',' << f.uploads << ',' << hash << std::endl;
+    }
+
+    return bool(os);
+}
+
+void ReplayReport::summary(std::ostream & os) const
+{
+    if (m_frames.empty()) {
+        os << "No frames replayed" << std::endl;
+        return;
+    }
+
+    std::vector<double> draw;
+    uint64_t combined = 14695981039346656037ull;
+    for (const Frame & f : m_frames) {
+        draw.push_back(f.draw);
+        for (int i = 0; i < 8; ++i) {
+            combined = (combined ^ uint8_t(f.hash >> (i*8))) * 1099511628211ull;
+        }
+    }
+    std::sort(draw.begin(), draw.end());
+
+    // Nearest rank
+    auto percentile = [&](double p) { return draw[std::min(draw.size()-1, size_t(p*draw.size()))]*1000.0; };
+
+    char hash[17];
+    std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) combined);
+    os << m_frames.size() << " frames, draw p50 " << percentile(0.50) << " ms, p95 " << percentile(0.95)
+       << " ms, p99 " << percentile(0.99) << " ms, max " << draw.back()*1000.0 << " ms, hash " << hash << std::endl;
+}
+
+uint64_t ReplayReport::hash(const std::vector<uint8_t> & pixels)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (uint8_t p : pixels) {
+        h = (h ^ p) * 1099511628211ull;
+    }
+    return h;
+}
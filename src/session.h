@@ -0,0 +1,150 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "global.h"
+#include "input.h"
+
+class Loader;
+
+/**
+ * @brief records a session of input for replaying later
+ *
+ * The log starts with the window size, the camera and the keys of the
+ * tiles each loader has cached, followed by the input events of each
+ * pass of the main loop and the time that pass advanced the simulation.
+ * Everything is little-endian, with variable length integers for the
+ * keys and event fields.
+ */
+class SessionRecorder
+{
+public:
+    SessionRecorder();
+    ~SessionRecorder();
+
+    // Start a log, loaders may be NULL
+    bool open(const std::string & filename, const std::vector<Loader *> & loaders);
+
+    // An input event, before it is handled
+    void event(const SDL_Event & event);
+
+    // End of a pass of the main loop
+    void frame(double elapsed);
+
+    void close();
+
+private:
+    SessionRecorder(const SessionRecorder &) = delete;
+
+    FILE *      m_file;
+    std::string m_buffer;
+};
+
+/**
+ * @brief plays back a session recorded by SessionRecorder
+ *
+ * The loaders are frozen to the tiles that were cached when recording
+ * started, so that what is drawn does not depend on the network or on
+ * what has been downloaded since.
+ */
+class SessionPlayer
+{
+public:
+    SessionPlayer();
+
+    bool open(const std::string & filename);
+
+    // Window size when recording started
+    int width() const  { return m_width; }
+    int height() const { return m_height; }
+
+    // Restore the camera and freeze the loaders, loaders may be NULL
+    void start(const std::vector<Loader *> & loaders);
+
+    // Next event of this pass of the main loop, false when there are
+    // no more and elapsed() is the time recorded for the pass
+    bool event(SDL_Event & event);
+    double elapsed() const { return m_elapsed; }
+
+    // Frames played so far, and is there nothing more?
+    uint64_t frames() const { return m_frames; }
+    bool finished() const { return m_pos >= m_data.size(); }
+
+private:
+    std::vector<uint8_t>  m_data;
+    size_t                m_pos;
+    int                   m_width;
+    int                   m_height;
+    s_player_state        m_player;
+    s_viewport_state      m_viewport;
+    Imath::Vec2<int64_t>  m_velocity;
+    double                m_elapsed;
+    uint64_t              m_frames;
+
+    // Cached keys of each loader, if it existed when recording
+    std::vector<std::pair<bool, std::vector<uint64_t>>> m_cached;
+};
+
+/**
+ * @brief timings and image hashes of the frames of a replay
+ */
+class ReplayReport
+{
+public:
+    // Time waiting for tiles, and drawing, in seconds
+    void frame(double settle, double draw, size_t uploads, uint64_t hash);
+
+    // CSV, one line per frame
+    bool write(const std::string & filename) const;
+
+    // Percentiles of the drawing time, and a hash of every frame
+    void summary(std::ostream & os) const;
+
+    // FNV-1a of the pixels read back
+    static uint64_t hash(const std::vector<uint8_t> & pixels);
+
+private:
+    struct Frame
+    {
+        double   settle;
+        double   draw;
+        size_t   uploads;
+        uint64_t hash;
+    };
+
+    std::vector<Frame> m_frames;
+};
+
+extern SessionRecorder * recording;
+extern SessionPlayer   * replaying;
@@ -0,0 +1,366 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include <SDL2/SDL_image.h>
+
+#include "terrain.h"
+
+namespace {
+
+// Vertices along each side of a level of detail
+inline size_t grid(int lod)
+{
+    return (size_t(1) << (lod + 2)) + 1;
+}
+
+// Grid then skirts along the bottom, top, left and right edges
+inline size_t vertices(int lod)
+{
+    return grid(lod)*grid(lod) + 4*grid(lod);
+}
+
+const double EARTH_CIRCUMFERENCE = 40075016.686;
+
+}
+
+TerrainLoader::~TerrainLoader()
+{
+    // Decoding uses the meshes and mutex below
+    finish_tasks();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_meshed.clear();
+}
+
+bool TerrainLoader::loaded(const Tile & tile) const
+{
+    return m_meshes.count(&tile) > 0;
+}
+
+void TerrainLoader::forget(Tile & tile)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_meshed.erase(std::remove_if(m_meshed.begin(), m_meshed.end(),
+                                      [&tile](const Meshed & m) { return m.tile == &tile; }),
+                       m_meshed.end());
+    }
+
+    // The buffer is recycled for the next tile
+    auto i = m_meshes.find(&tile);
+    if (i != m_meshes.end()) {
+        m_free.push_back(i->second.buffer);
+        m_meshes.erase(i);
+    }
+    m_evicted.erase(&tile);
+    Loader::forget(tile);
+}
+
+void TerrainLoader::decode_image(Tile * tile, const Cached & cached)
+{
+    SDL_Surface * image = IMG_Load_RW(SDL_RWFromConstMem(cached.data.data(), int(cached.data.size())), 1);
+    if (!image) {
+        decode_failed(tile);
+        return;
+    }
+
+    SDL_PixelFormat * format = SDL_AllocFormat(SDL_PIXELFORMAT_RGB24);
+    SDL_Surface * rgb = SDL_ConvertSurface(image, format, 0);
+    SDL_FreeFormat(format);
+    SDL_FreeSurface(image);
+    if (!rgb) {
+        return;
+    }
+
+    // Heights in tile units, the tile is narrower in metres away from the equator
+    const uint64_t n = uint64_t(1) << tile->zoom;
+    const double   y = 1.0 - 2.0*((n - 1 - tile->y) + 0.5)/n;
+    const double   latitude = std::atan(std::sinh(M_PI*y));
+    const double   metres = EARTH_CIRCUMFERENCE * std::cos(latitude) / n;
+
+    const uint8_t * pixels = static_cast<const uint8_t *>(rgb->pixels);
+    auto sample = [&](int px, int py) -> double
+    {
+        const uint8_t * p = pixels + py*rgb->pitch + px*3;
+        const double h = m_encoding == TERRARIUM ?
+            (p[0]*256.0 + p[1] + p[2]/256.0) - 32768.0 :
+            (p[0]*65536.0 + p[1]*256.0 + p[2])*0.1 - 10000.0;
+        return h / metres;
+    };
+
+    // Bilinear height at u, v in the unit square, image rows run north to south
+    auto height = [&](double u, double v) -> double
+    {
+        const double fx = u*(rgb->w - 1);
+        const double fy = (1.0 - v)*(rgb->h - 1);
+        const int x0 = std::min(int(fx), rgb->w - 2);
+        const int y0 = std::min(int(fy), rgb->h - 2);
+        const double ax = fx - x0;
+        const double ay = fy - y0;
+        return (sample(x0, y0  )*(1 - ax) + sample(x0+1, y0  )*ax)*(1 - ay) +
+               (sample(x0, y0+1)*(1 - ax) + sample(x0+1, y0+1)*ax)*ay;
+    };
+
+    Meshed meshed;
+    meshed.tile = tile;
+
+    // Finest grid as the reference for the error of coarser levels
+    const size_t fine = grid(LODS - 1);
+    std::vector<double> reference(fine*fine);
+    for (size_t j = 0; j < fine; ++j) {
+        for (size_t i = 0; i < fine; ++i) {
+            reference[j*fine + i] = height(double(i)/(fine - 1), double(j)/(fine - 1));
+        }
+    }
+
+    for (int lod = 0; lod < LODS; ++lod)
+    {
+        const size_t size = grid(lod);
+        const size_t step = (fine - 1)/(size - 1);
+
+        // Worst difference between the reference and this level
+        double error = 0.0;
+        for (size_t j = 0; j < fine; ++j) {
+            for (size_t i = 0; i < fine; ++i) {
+                const size_t i0 = std::min(i/step, size - 2)*step;
+                const size_t j0 = std::min(j/step, size - 2)*step;
+                const double ax = double(i - i0)/step;
+                const double ay = double(j - j0)/step;
+                const double h =
+                    (reference[j0*fine + i0       ]*(1 - ax) + reference[j0*fine + i0 + step       ]*ax)*(1 - ay) +
+                    (reference[(j0+step)*fine + i0]*(1 - ax) + reference[(j0+step)*fine + i0 + step]*ax)*ay;
+                error = std::max(error, std::abs(h - reference[j*fine + i]));
+            }
+        }
+        meshed.error[lod] = float(error);
+
+        for (size_t j = 0; j < size; ++j) {
+            for (size_t i = 0; i < size; ++i) {
+                const double h = reference[j*step*fine + i*step];
+                meshed.vertices.push_back(Vertex{ GLfloat(double(i)/(size - 1)), GLfloat(double(j)/(size - 1)), GLfloat(h) });
+            }
+        }
+
+        // Skirts hang below the edges, hiding cracks against
+        // neighbours drawn at another level of detail
+        const GLfloat skirt = GLfloat(error*2.0 + 0.01);
+        const size_t edges[4][2] = { { 0, 1 }, { (size - 1)*size, 1 }, { 0, size }, { size - 1, size } };
+        const size_t base = meshed.vertices.size() - size*size;
+        for (const auto & edge : edges) {
+            for (size_t i = 0; i < size; ++i) {
+                Vertex v = meshed.vertices[base + edge[0] + i*edge[1]];
+                v.z -= skirt;
+                meshed.vertices.push_back(v);
+            }
+        }
+    }
+
+    SDL_FreeSurface(rgb);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_meshed.push_back(std::move(meshed));
+}
+
+void TerrainLoader::indices()
+{
+    size_t offset = 0;
+    for (int lod = 0; lod < LODS; ++lod)
+    {
+        const GLushort size = GLushort(grid(lod));
+        std::vector<GLushort> index;
+
+        for (GLushort j = 0; j + 1 < size; ++j) {
+            for (GLushort i = 0; i + 1 < size; ++i) {
+                const GLushort a = j*size + i;
+                index.insert(index.end(), { a, GLushort(a + 1), GLushort(a + size + 1), a, GLushort(a + size + 1), GLushort(a + size) });
+            }
+        }
+
+        // Each edge of the grid, and the skirt below it
+        const GLushort skirts = size*size;
+        const GLushort edges[4][2] = { { 0, 1 }, { GLushort((size - 1)*size), 1 }, { 0, size }, { GLushort(size - 1), size } };
+        for (int e = 0; e < 4; ++e) {
+            for (GLushort i = 0; i + 1 < size; ++i) {
+                const GLushort a = edges[e][0] + i*edges[e][1];
+                const GLushort b = a + edges[e][1];
+                const GLushort c = skirts + e*size + i;
+                index.insert(index.end(), { a, b, GLushort(c + 1), a, GLushort(c + 1), c });
+            }
+        }
+
+        glGenBuffers(1, &m_indices[lod]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indices[lod]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, index.size()*sizeof(GLushort), &index[0], GL_STATIC_DRAW);
+        m_count[lod]  = GLsizei(index.size());
+        m_offset[lod] = offset;
+        offset += vertices(lod);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    m_vertices = offset;
+}
+
+size_t TerrainLoader::upload_images(size_t max)
+{
+    std::vector<Meshed> meshed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_meshed.empty()) {
+            return 0;
+        }
+        const size_t n = std::min(max, m_meshed.size());
+        std::move(m_meshed.begin(), m_meshed.begin() + n, std::back_inserter(meshed));
+        m_meshed.erase(m_meshed.begin(), m_meshed.begin() + n);
+    }
+
+    if (!m_vertices) {
+        indices();
+    }
+
+    for (auto & i : meshed)
+    {
+        Mesh mesh;
+        std::copy(i.error, i.error + LODS, mesh.error);
+        mesh.frame = m_frame;
+
+        // Every tile has the same number of vertices, recycle buffers
+        if (m_free.empty()) {
+            glGenBuffers(1, &mesh.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer);
+            glBufferData(GL_ARRAY_BUFFER, m_vertices*sizeof(Vertex), NULL, GL_STATIC_DRAW);
+        } else {
+            mesh.buffer = m_free.back();
+            m_free.pop_back();
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, i.vertices.size()*sizeof(Vertex), &i.vertices[0]);
+
+        auto existing = m_meshes.find(i.tile);
+        if (existing != m_meshes.end()) {
+            m_free.push_back(existing->second.buffer);
+        }
+        m_meshes[i.tile] = mesh;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    evict();
+
+    m_uploads += meshed.size();
+    return meshed.size();
+}
+
+void TerrainLoader::evict()
+{
+    if (m_meshes.size() <= m_budget) {
+        return;
+    }
+
+    // Least recently drawn first, but not anything drawn recently
+    std::vector<std::pair<uint64_t, const Tile *>> candidates;
+    for (const auto & i : m_meshes) {
+        if (i.second.frame + 1 < m_frame) {
+            candidates.push_back(std::make_pair(i.second.frame, i.first));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const auto & i : candidates) {
+        if (m_meshes.size() <= m_budget) {
+            break;
+        }
+        auto mesh = m_meshes.find(i.second);
+        m_free.push_back(mesh->second.buffer);
+        m_meshes.erase(mesh);
+        m_evicted.insert(const_cast<Tile *>(i.second));
+    }
+}
+
+void TerrainLoader::touch(Tile & tile)
+{
+    if (m_evicted.erase(&tile)) {
+        load_image(tile);
+    }
+}
+
+int TerrainLoader::select(const Tile & tile, double pixelsPerUnit, double tilt) const
+{
+    auto i = m_meshes.find(&tile);
+    if (i == m_meshes.end()) {
+        return 0;
+    }
+
+    // Heights are foreshortened by the sine of the tilt, flat
+    // when looking straight down
+    const double scale = pixelsPerUnit * std::abs(std::sin(tilt * M_PI / 180.0));
+    for (int lod = 0; lod < LODS; ++lod) {
+        if (i->second.error[lod] * scale < 1.0) {
+            return lod;
+        }
+    }
+    return LODS - 1;
+}
+
+void TerrainLoader::draw(const Tile & tile, int lod)
+{
+    auto i = m_meshes.find(&tile);
+    if (i == m_meshes.end()) {
+        return;
+    }
+    i->second.frame = m_frame;
+
+    const GLvoid * offset = reinterpret_cast<const GLvoid *>(m_offset[lod]*sizeof(Vertex));
+
+    glBindBuffer(GL_ARRAY_BUFFER, i->second.buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indices[lod]);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(Vertex), offset);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), offset);
+
+    glDrawElements(GL_TRIANGLES, m_count[lod], GL_UNSIGNED_SHORT, NULL);
+
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void TerrainLoader::release()
+{
+    for (auto & i : m_meshes) {
+        glDeleteBuffers(1, &i.second.buffer);
+    }
+    m_meshes.clear();
+    if (!m_free.empty()) {
+        glDeleteBuffers(GLsizei(m_free.size()), &m_free[0]);
+        m_free.clear();
+    }
+    if (m_vertices) {
+        glDeleteBuffers(LODS, m_indices);
+        m_vertices = 0;
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "loader.h"
+
+/**
+ * @brief Loader variant for RGB encoded elevation tiles
+ *
+ * Elevation tiles are fetched and cached like imagery.  The CPU pool
+ * builds a grid mesh with skirts for each level of detail, along with
+ * the worst height error of each level.  The render thread picks the
+ * coarsest level with an error of less than a pixel on screen.
+ *
+ * Vertex buffers are all the same size and are recycled, the least
+ * recently drawn are evicted beyond a budget.  Index buffers are shared
+ * by every tile.
+ */
+class TerrainLoader : public Loader
+{
+public:
+    enum Encoding { TERRARIUM, MAPBOX };
+
+    // Levels of detail, grids of 2^k+1 vertices for k = 2..6
+    static const int LODS = 5;
+
+    TerrainLoader(Encoding encoding, bool tms, bool zxy, uint16_t maxZoom, const std::string & prefix, const std::string & extension, const std::string & dir, size_t budget = 256)
+    : Loader(tms, zxy, maxZoom, prefix, extension, dir), m_encoding(encoding), m_budget(budget)
+    {
+    }
+
+    ~TerrainLoader();
+
+    size_t upload_images(size_t max = SIZE_MAX) override;
+
+    bool loaded(const Tile & tile) const override;
+
+    void forget(Tile & tile) override;
+
+    // Level of detail for a tile drawn at pixelsPerUnit pixels across,
+    // heights are foreshortened by tilt
+    int select(const Tile & tile, double pixelsPerUnit, double tilt) const;
+
+    // Draw the mesh of the tile, in the unit square with heights in
+    // the same units.  Texture co-ordinates are the unit square.
+    void draw(const Tile & tile, int lod);
+
+    // Reload a visible tile, if it was evicted
+    void touch(Tile & tile);
+
+    // Start of a frame, meshes not drawn recently may be evicted
+    void next_frame() { ++m_frame; }
+
+    // Free the buffers, while the GL context is current
+    void release();
+
+    size_t resident() const { return m_meshes.size(); }
+
+protected:
+    void decode_image(Tile * tile, const Cached & cached) override;
+
+    // Elevations must arrive exactly as encoded, never lossy
+    const char * accept() const override { return "image/png"; }
+
+private:
+    struct Vertex
+    {
+        GLfloat x, y, z;
+    };
+
+    // Meshed by the CPU pool, waiting for upload by the render thread
+    struct Meshed
+    {
+        Tile              * tile;
+        std::vector<Vertex> vertices;
+        float               error[LODS];
+    };
+
+    struct Mesh
+    {
+        GLuint   buffer;
+        float    error[LODS];
+        uint64_t frame;
+    };
+
+    void indices();
+    void evict();
+
+    const Encoding m_encoding;
+    const size_t   m_budget;
+
+    std::mutex          m_mutex;
+    std::vector<Meshed> m_meshed;
+
+    std::unordered_map<const Tile *, Mesh> m_meshes;
+    std::unordered_set<Tile *>             m_evicted;
+    std::vector<GLuint>                    m_free;
+
+    GLuint   m_indices[LODS] = {};
+    GLsizei  m_count[LODS] = {};
+    size_t   m_offset[LODS] = {};
+    size_t   m_vertices = 0;
+    uint64_t m_frame = 0;
+};
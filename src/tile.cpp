@@ -29,18 +29,16 @@
 #include "tilefactory.h"
 #include "loader.h"
 
+const uint32_t Tile::none;
+
 Tile::Tile(uint16_t zoom, uint64_t x, uint64_t y, GLuint texid) : 
-    zoom(zoom), x(x), y(y), texid(texid)
+    x(x), y(y), texid(texid), zoom(zoom), refs(0), index(none), queued(false)
 {
 }
 
 Tile * Tile::get(Loader & loader, int64_t dx, int64_t dy)
 {
-    const uint64_t m = uint64_t(1)<<zoom;
-    if (zoom>0)
-        return TileFactory::instance()->get_tile(loader, zoom, (x+dx)%m, (y+dy)%m);
-    else
-        return TileFactory::instance()->get_tile(loader, 0, 0, 0);
+    return TileFactory::instance()->get_neighbour(loader, *this, dx, dy);
 }
 
 Tile * Tile::get_east(Loader & loader) {
@@ -63,7 +61,7 @@ Tile * Tile::get_parent(Loader & loader)
 {
     if (zoom>0)
     {
-        return TileFactory::instance()->get_tile(loader, zoom-1, x>>1, y>>1);
+        return TileFactory::instance()->get_parent(loader, *this);
     }
     return NULL;
 }
@@ -82,13 +80,13 @@ Tile * Tile::get_parent(Loader & loader, float minUV[2], float maxUV[2]) const
         minUV[1] += (y&1) ? 0.5 : 0.0; 
         maxUV[1] += (y&1) ? 0.5 : 0.0; 
 
-        return TileFactory::instance()->get_tile(loader, zoom-1, x>>1, y>>1);
+        return TileFactory::instance()->get_parent(loader, *this);
     }
 
     return NULL;
 }
 
-std::string Tile::get_filename(bool tms, bool zxy, const std::string & ext)
+std::string Tile::get_filename(bool tms, bool zxy, const std::string & ext) const
 {
     uint64_t xx = x;
     uint64_t yy = tms ? y : (uint64_t(1)<<zoom) - 1 - y;
@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 #include <GL/glew.h>
@@ -35,11 +36,21 @@ class Loader;
  */
 class Tile {
 public:
-    uint16_t zoom;
+    // Hot fields first, records are packed in TileFactory slabs
     uint64_t x;
     uint64_t y;
-
     GLuint   texid;
+    uint16_t zoom;
+
+    // VisibleSets holding the tile, see TileFactory::acquire
+    uint16_t refs;
+
+    // Slot in the TileFactory, none while the slot is free
+    uint32_t index;
+    // Waiting in the TileFactory's queue of tiles nothing holds
+    bool     queued;
+
+    static const uint32_t none = 0xffffffff;
 
     Tile(uint16_t zoom, uint64_t x, uint64_t y, GLuint texid);
 
@@ -55,6 +66,6 @@ public:
 //    inline bool valid() const { return x>=0 && x<(1<<zoom) && y>=0 && y<(1<<zoom); }
     inline bool valid() const { return x < (uint64_t(1)<<zoom) && y < (uint64_t(1)<<zoom); }
 
-    std::string get_filename(bool tms = true, bool zxy = true, const std::string & ext = ".png");
+    std::string get_filename(bool tms = true, bool zxy = true, const std::string & ext = ".png") const;
 };
 
@@ -22,7 +22,7 @@
  * THE SOFTWARE.
  */
 
-#include <sstream>
+#include <algorithm>
 #include <cmath>
 
 #include "tilefactory.h"
@@ -30,24 +30,181 @@
 
 TileFactory* TileFactory::_instance = nullptr;
 
+const uint32_t TileFactory::sideBits;
+const uint32_t TileFactory::sideMask;
+const uint32_t TileFactory::slabBits;
+const uint32_t TileFactory::slabSize;
+const uint32_t TileFactory::slabMask;
+
+// Keys of unused and erased entries, never a valid tile key
+static const uint64_t empty  = ~uint64_t(0);
+static const uint64_t erased = ~uint64_t(0) - 1;
+
+static size_t hash(uint64_t key)
+{
+    // splitmix64 finaliser
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return size_t(key);
+}
+
+uint32_t TileFactory::Table::find(uint64_t key) const
+{
+    if (keys.empty()) {
+        return Tile::none;
+    }
+    const size_t mask = keys.size() - 1;
+    for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+        if (keys[i] == key) {
+            return slots[i];
+        }
+        if (keys[i] == empty) {
+            return Tile::none;
+        }
+    }
+}
+
+void TileFactory::Table::insert(uint64_t key, uint32_t slot)
+{
+    // No more than half full, counting erased entries
+    if (2*(used + 1) > keys.size()) {
+        grow();
+    }
+    const size_t mask = keys.size() - 1;
+    for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+        if (keys[i] == empty) {
+            keys[i] = key;
+            slots[i] = slot;
+            ++used;
+            return;
+        }
+    }
+}
+
+void TileFactory::Table::erase(uint64_t key)
+{
+    if (keys.empty()) {
+        return;
+    }
+    const size_t mask = keys.size() - 1;
+    for (size_t i = hash(key) & mask; keys[i] != empty; i = (i + 1) & mask) {
+        if (keys[i] == key) {
+            keys[i] = erased;
+            return;
+        }
+    }
+}
+
+void TileFactory::Table::grow()
+{
+    std::vector<uint64_t> oldKeys;
+    std::vector<uint32_t> oldSlots;
+    oldKeys.swap(keys);
+    oldSlots.swap(slots);
+
+    // Double, unless mostly erased entries are being dropped
+    size_t live = 0;
+    for (uint64_t k : oldKeys) {
+        live += k != empty && k != erased;
+    }
+    size_t size = 1024;
+    while (size < 4*(live + 1)) {
+        size *= 2;
+    }
+
+    keys.assign(size, empty);
+    slots.assign(size, Tile::none);
+    used = 0;
+    for (size_t i = 0; i < oldKeys.size(); ++i) {
+        if (oldKeys[i] != empty && oldKeys[i] != erased) {
+            insert(oldKeys[i], oldSlots[i]);
+        }
+    }
+}
+
 TileFactory::~TileFactory() {
-    for (const auto & i : tiles) {
-        delete i.second;
+    clear();
+}
+
+void TileFactory::clear() {
+    slabs.clear();
+    info.clear();
+    freed.clear();
+    pools.clear();
+    count = 0;
+}
+
+TileFactory::Pool & TileFactory::pool(Loader & loader)
+{
+    // Only a few loaders, the last one used is most likely
+    for (auto i = pools.rbegin(); i != pools.rend(); ++i) {
+        if (i->loader == &loader) {
+            return *i;
+        }
     }
-    tiles.clear();
+    pools.push_back(Pool());
+    pools.back().loader = &loader;
+    return pools.back();
 }
 
-Tile* TileFactory::get_tile(Loader & loader, uint16_t zoom, uint64_t x, uint64_t y) {
-    std::string id = tile_id(zoom, x, y);
-    auto key = std::make_pair(&loader, id);
-    auto i = tiles.find(key);
-    if (i != tiles.end()) {
-        return i->second;
+uint32_t TileFactory::slab(Loader & loader, uint16_t zoom, uint64_t x, uint64_t y)
+{
+    Table & t = pool(loader).table;
+    const uint64_t key = tile_key(zoom, x >> sideBits, y >> sideBits);
+    uint32_t s = t.find(key);
+    if (s != Tile::none) {
+        return s;
     }
-    Tile* tile = new Tile(zoom, x, y, dummy);
-    loader.load_image(*tile);
-    tiles[key] = tile;
-    return tile;
+
+    // Every tile of a freed slab is released already
+    if (!freed.empty()) {
+        s = freed.back();
+        freed.pop_back();
+    } else {
+        s = uint32_t(slabs.size());
+        slabs.emplace_back(slabSize, Tile(0, 0, 0, dummy));
+        info.push_back(Slab());
+    }
+    info[s] = Slab{ &loader, zoom, x & ~uint64_t(sideMask), y & ~uint64_t(sideMask), Tile::none, 0 };
+    t.insert(key, s);
+    return s;
+}
+
+Tile * TileFactory::at(Loader & loader, uint32_t s, uint64_t x, uint64_t y)
+{
+    const uint32_t index = (s << slabBits) | local(x, y);
+    Tile * t = tile(index);
+    if (t->index != Tile::none) {
+        return t;
+    }
+
+    *t = Tile(info[s].zoom, x, y, dummy);
+    t->index = index;
+    ++info[s].live;
+    ++count;
+
+    // Held by nobody until a VisibleSet acquires it
+    Pool & p = pool(loader);
+    ++p.idle;
+    queue(p, t);
+
+    loader.load_image(*t);
+    return t;
+}
+
+void TileFactory::queue(Pool & p, Tile * t)
+{
+    if (!t->queued) {
+        t->queued = true;
+        p.unused.push_back(Unused{ t->index, tile_key(t->zoom, t->x, t->y) });
+    }
+}
+
+Tile* TileFactory::get_tile(Loader & loader, uint16_t zoom, uint64_t x, uint64_t y) {
+    return at(loader, slab(loader, zoom, x, y), x, y);
 }
 
 Tile* TileFactory::get_tile_at(Loader & loader, uint16_t zoom, uint64_t x, uint64_t y)
@@ -61,20 +218,122 @@ Tile* TileFactory::get_tile_at(Loader & loader, uint16_t zoom, uint64_t x, uint6
     {
         x = y = 0;
     }
-    std::string id = tile_id(zoom, x, y);
-    auto key = std::make_pair(&loader, id);
-    auto i = tiles.find(key);
-    if (i != tiles.end()) {
-        return i->second;
+    return get_tile(loader, zoom, x, y);
+}
+
+Tile* TileFactory::get_neighbour(Loader & loader, const Tile & t, int64_t dx, int64_t dy)
+{
+    const uint64_t mask = (uint64_t(1) << t.zoom) - 1;
+    const uint64_t x = (t.x + dx) & mask;
+    const uint64_t y = (t.y + dy) & mask;
+
+    // Within the same slab, no lookup
+    if ((((x ^ t.x) | (y ^ t.y)) >> sideBits) == 0) {
+        return at(loader, t.index >> slabBits, x, y);
+    }
+    return get_tile(loader, t.zoom, x, y);
+}
+
+Tile* TileFactory::get_parent(Loader & loader, const Tile & child)
+{
+    const uint64_t x = child.x >> 1;
+    const uint64_t y = child.y >> 1;
+
+    // Still the same slab, if it was freed and reused since
+    const uint32_t c = child.index >> slabBits;
+    uint32_t s = info[c].parent;
+    if (s == Tile::none || info[s].owner != &loader || info[s].zoom + 1 != child.zoom ||
+        info[s].x != (x & ~uint64_t(sideMask)) || info[s].y != (y & ~uint64_t(sideMask))) {
+        s = slab(loader, child.zoom - 1, x, y);
+        info[c].parent = s;
+    }
+    return at(loader, s, x, y);
+}
+
+std::vector<Tile *> TileFactory::tiles(Loader & loader)
+{
+    std::vector<Tile *> result;
+    for (uint32_t s = 0; s < info.size(); ++s) {
+        if (info[s].owner != &loader) {
+            continue;
+        }
+        for (Tile & t : slabs[s]) {
+            if (t.index != Tile::none) {
+                result.push_back(&t);
+            }
+        }
+    }
+    return result;
+}
+
+void TileFactory::acquire(Loader & loader, Tile * t)
+{
+    if (t->refs++ == 0) {
+        --pool(loader).idle;
     }
-    Tile* tile = new Tile(zoom, x, y, dummy);
-    loader.load_image(*tile);
-    tiles[key] = tile;
-    return tile;
 }
 
-std::string TileFactory::tile_id(uint16_t zoom, uint64_t x, uint64_t y) {
-    std::stringstream ss;
-    ss << zoom << "/" << x << "/" << y;
-    return ss.str();
+void TileFactory::unuse(Loader & loader, Tile * t)
+{
+    if (--t->refs == 0) {
+        Pool & p = pool(loader);
+        ++p.idle;
+        queue(p, t);
+    }
+}
+
+size_t TileFactory::collect(Loader & loader, size_t spare, size_t limit)
+{
+    Pool & p = pool(loader);
+    size_t released = 0;
+    for (size_t n = std::min(limit, p.unused.size()); n > 0 && p.idle > spare; --n) {
+        const Unused u = p.unused.front();
+        p.unused.pop_front();
+
+        // Released, or the slab reused, since it was queued
+        Tile * t = tile(u.index);
+        if (info[u.index >> slabBits].owner != &loader || t->index != u.index ||
+            tile_key(t->zoom, t->x, t->y) != u.key) {
+            continue;
+        }
+
+        // Held again, queued once more when let go
+        if (t->refs) {
+            t->queued = false;
+            continue;
+        }
+
+        // Still loading, or waiting for upload
+        if (loader.busy(*t)) {
+            p.unused.push_back(u);
+            continue;
+        }
+
+        loader.forget(*t);
+        release(loader, t);
+        ++released;
+    }
+    return released;
+}
+
+void TileFactory::release(Loader & loader, Tile * t)
+{
+    Pool & p = pool(loader);
+    if (!t->refs) {
+        --p.idle;
+    }
+
+    const uint32_t s = t->index >> slabBits;
+    t->index = Tile::none;
+    t->queued = false;
+    t->refs = 0;
+    --count;
+
+    // Reused for any loader and level once empty
+    Slab & slab = info[s];
+    if (--slab.live == 0) {
+        p.table.erase(tile_key(slab.zoom, slab.x >> sideBits, slab.y >> sideBits));
+        slab.owner = nullptr;
+        freed.push_back(s);
+    }
 }
@@ -26,18 +26,31 @@
 
 #include "tile.h"
 
-#include <string>
-#include <map>
 #include <cstdint>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include <GL/glew.h>
 
 class Loader;
 
+/**
+ * @brief owner of every Tile, one per loader and level, x and y
+ *
+ * Tiles are kept in fixed size slabs of 16 by 16 neighbouring tiles of
+ * one level, so that a Tile * stays valid while the tile is in use.  A
+ * slab is found by an integer key in an open addressing table per
+ * loader, the tiles within it, and so most neighbours and parents, by
+ * index arithmetic alone.
+ *
+ * Tiles held by no VisibleSet are queued, oldest first, and released by
+ * collect once the loader is done with them.  A slab is reused once all
+ * of its tiles are released.
+ */
 class TileFactory
 {
-private:
-    std::map<std::pair<Loader *, std::string>, Tile *> tiles;
 public:
     static TileFactory* instance() {
         static CGuard g;
@@ -50,11 +63,114 @@ public:
     Tile *get_tile   (Loader & loader, uint16_t zoom, uint64_t x, uint64_t y);
     Tile *get_tile_at(Loader & loader, uint16_t zoom, uint64_t x, uint64_t y);
 
+    // The tile dx, dy away on the same level, wrapping around
+    Tile *get_neighbour(Loader & loader, const Tile & tile, int64_t dx, int64_t dy);
+
+    // The parent of a tile, its slab remembered after the first lookup
+    Tile *get_parent (Loader & loader, const Tile & tile);
+
     GLuint get_dummy() {
         return dummy;
     }
 
+    size_t size() const {
+        return count;
+    }
+
+    // Record for a slot
+    Tile * tile(uint32_t index) {
+        return &slabs[index >> slabBits][index & slabMask];
+    }
+
+    // A tile held, or no longer, by a VisibleSet.  Those nobody holds
+    // may be released by collect.
+    void acquire(Loader & loader, Tile * tile);
+    void unuse  (Loader & loader, Tile * tile);
+
+    // Release the tiles of the loader held by nobody, least recently
+    // held first, looking at no more than limit of them and keeping the
+    // spare most recent.  Tiles the loader is still busy with are left
+    // for later.  Returns the number released.
+    size_t collect(Loader & loader, size_t spare, size_t limit = 256);
+
+    // Forget a tile, for reuse of its record.  Nothing may still refer
+    // to it, including work queued by the loader.
+    void release(Loader & loader, Tile * tile);
+
+    // Every tile of a loader, in no particular order
+    std::vector<Tile *> tiles(Loader & loader);
+
+    // Forget every tile, nothing may still refer to them
+    void clear();
+
+    // Integer key of a tile, levels up to 29
+    static uint64_t tile_key(uint16_t zoom, uint64_t x, uint64_t y) {
+        return (uint64_t(zoom) << 58) | (x << 29) | y;
+    }
+
 private:
+    static const uint32_t sideBits = 4;
+    static const uint32_t sideMask = (uint32_t(1) << sideBits) - 1;
+    static const uint32_t slabBits = 2*sideBits;
+    static const uint32_t slabSize = uint32_t(1) << slabBits;
+    static const uint32_t slabMask = slabSize - 1;
+
+    // Key to slab, linear probing
+    struct Table
+    {
+        std::vector<uint64_t> keys;
+        std::vector<uint32_t> slots;
+        size_t                used = 0;    // including erased
+
+        uint32_t find(uint64_t key) const;
+        void     insert(uint64_t key, uint32_t slot);
+        void     erase(uint64_t key);
+        void     grow();
+    };
+
+    // The loader, level and first tile of a slab, and its parent slab
+    // once looked up, still to be checked as the slab may be reused
+    struct Slab
+    {
+        Loader * owner;
+        uint16_t zoom;
+        uint64_t x;
+        uint64_t y;
+        uint32_t parent;
+        uint32_t live;
+    };
+
+    // A tile held by nobody, as it was when queued
+    struct Unused
+    {
+        uint32_t index;
+        uint64_t key;
+    };
+
+    // Slabs of a loader, and its tiles held by nobody
+    struct Pool
+    {
+        Loader *           loader;
+        Table              table;
+        std::deque<Unused> unused;
+        size_t             idle = 0;
+    };
+
+    Pool & pool(Loader & loader);
+    uint32_t slab(Loader & loader, uint16_t zoom, uint64_t x, uint64_t y);
+    Tile * at(Loader & loader, uint32_t slab, uint64_t x, uint64_t y);
+    void queue(Pool & pool, Tile * tile);
+
+    static uint32_t local(uint64_t x, uint64_t y) {
+        return uint32_t(((y & sideMask) << sideBits) | (x & sideMask));
+    }
+
+    std::vector<std::vector<Tile>>               slabs;
+    std::vector<Slab>                            info;     // per slab
+    std::vector<uint32_t>                        freed;
+    std::vector<Pool>                            pools;
+    size_t                                       count = 0;
+
     static TileFactory* _instance;
     GLuint dummy;
     TileFactory() {
@@ -66,7 +182,6 @@ private:
     }
     TileFactory(const TileFactory&) {}
     ~TileFactory();
-    std::string tile_id(uint16_t zoom, uint64_t x, uint64_t y);
 
     class CGuard {
     public:
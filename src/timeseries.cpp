@@ -0,0 +1,366 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <iterator>
+
+#include <SDL2/SDL_image.h>
+
+#include "timeseries.h"
+#include "loader.h"
+#include "tilefactory.h"
+
+// Shown anyway once this late, for tiles that never arrive
+static const double max_wait = 2.0;
+
+/**
+ * @brief the tiles of one time, decoded for the slots of the series
+ */
+class TimeSeries::Frame : public Loader
+{
+public:
+    Frame(TimeSeries & series, size_t index, uint16_t maxZoom, const std::string & url, const std::string & extension, const std::string & dir)
+    : Loader(false, true, maxZoom, url, extension, dir), m_series(series), m_index(index)
+    {
+    }
+
+    ~Frame()
+    {
+        // Decoding hands tiles to the series
+        finish_tasks();
+    }
+
+protected:
+    void decode_image(Tile * tile, const Cached & cached) override
+    {
+        SDL_Surface * image = IMG_Load_RW(SDL_RWFromConstMem(cached.data.data(), int(cached.data.size())), 1);
+        if (!image) {
+            decode_failed(tile);
+            return;
+        }
+
+        // RGBA bytes, overlays are mostly transparent
+        SDL_PixelFormat * format = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA32);
+        SDL_Surface * rgba = SDL_ConvertSurface(image, format, 0);
+        SDL_FreeFormat(format);
+        SDL_FreeSurface(image);
+        if (!rgba) {
+            return;
+        }
+
+        TimeSeries::Decoded d;
+        d.tile = tile;
+        d.frame = m_index;
+        d.width = rgba->w;
+        d.height = rgba->h;
+        d.pixels.resize(size_t(rgba->w)*rgba->h*4);
+        if (SDL_MUSTLOCK(rgba)) {
+            SDL_LockSurface(rgba);
+        }
+        for (int j = 0; j < rgba->h; ++j) {
+            const uint8_t * row = static_cast<const uint8_t *>(rgba->pixels) + size_t(j)*rgba->pitch;
+            std::copy(row, row + size_t(rgba->w)*4, d.pixels.begin() + size_t(j)*rgba->w*4);
+        }
+        if (SDL_MUSTLOCK(rgba)) {
+            SDL_UnlockSurface(rgba);
+        }
+        SDL_FreeSurface(rgba);
+
+        m_series.decoded(std::move(d));
+    }
+
+private:
+    TimeSeries & m_series;
+    const size_t m_index;
+};
+
+// Characters of a time that are safe in a directory name
+static std::string directory(const std::string & time)
+{
+    std::string name = time;
+    for (char & c : name) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '.') {
+            c = '_';
+        }
+    }
+    return name;
+}
+
+TimeSeries::TimeSeries(const std::string & url, const std::vector<std::string> & times, uint16_t maxZoom,
+                       const std::string & extension, const std::string & dir, size_t budget)
+: m_times(times.empty() ? std::vector<std::string>(1) : times), m_maxZoom(maxZoom), m_budget(budget),
+  m_fps(4.0), m_playhead(0), m_clock(0.0), m_generation(0), m_tileSize(256),
+  m_played(0), m_waited(0), m_late(0), m_recycled(0)
+{
+    for (size_t i = 0; i < m_times.size(); ++i)
+    {
+        // {t} wherever it is in the template
+        std::string expanded = url;
+        for (size_t p = expanded.find("{t}"); p != std::string::npos; p = expanded.find("{t}", p + m_times[i].size())) {
+            expanded.replace(p, 3, m_times[i]);
+        }
+        m_frames.emplace_back(new Frame(*this, i, maxZoom, expanded, extension, dir + directory(m_times[i]) + "/"));
+    }
+}
+
+TimeSeries::~TimeSeries()
+{
+    // Each frame waits for its decoding, before the decoded tiles go
+    m_frames.clear();
+}
+
+Loader & TimeSeries::loader()
+{
+    return *m_frames.front();
+}
+
+void TimeSeries::decoded(Decoded && d)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tileSize = std::max(d.width, d.height);
+    m_decoded.push_back(std::move(d));
+}
+
+size_t TimeSeries::capacity() const
+{
+    const size_t size = m_tileSize;
+    const size_t bytes = size*size*4;
+    return std::max<size_t>(m_budget/bytes, 1);
+}
+
+// Frames to load beyond the current one, as many as the slots hold
+size_t TimeSeries::ahead() const
+{
+    size_t tiles = 0;
+    for (const Grid & g : m_shown) {
+        tiles += (g.size[0] + 1)*(g.size[1] + 1);
+    }
+    const size_t fit = tiles ? capacity()/tiles : 1;
+    return std::min(fit ? fit - 1 : 0, frames() - 1);
+}
+
+// How far ahead of the playhead, frames behind it being furthest
+size_t TimeSeries::distance(size_t frame) const
+{
+    return (frame + frames() - m_playhead) % frames();
+}
+
+// The slot to recycle: one not wanted lately, else the frame needed last
+size_t TimeSeries::victim() const
+{
+    size_t best = 0;
+    std::pair<bool, size_t> worst(false, 0);
+    for (size_t i = 0; i < m_slots.size(); ++i) {
+        const std::pair<bool, size_t> score(m_slots[i].used + 1 < m_generation, distance(m_slots[i].frame));
+        if (i == 0 || score > worst) {
+            best = i;
+            worst = score;
+        }
+    }
+    return best;
+}
+
+template<typename Visit>
+void TimeSeries::each(const Grid & g, Visit visit) const
+{
+    const uint64_t levelSize = uint64_t(1)<<g.z;
+    for (uint64_t j = 0; j <= g.size[1]; ++j) {
+        for (uint64_t i = 0; i <= g.size[0]; ++i) {
+            visit((g.tile[0] + i)%levelSize, (g.tile[1] + j)%levelSize);
+        }
+    }
+}
+
+bool TimeSeries::ready(size_t frame)
+{
+    TileFactory * factory = TileFactory::instance();
+    Loader & loader = *m_frames[frame];
+    bool all = true;
+    for (const Grid & g : m_shown) {
+        each(g, [&](uint64_t x, uint64_t y) {
+            all = all && m_resident.count(factory->get_tile(loader, g.z, x, y));
+        });
+    }
+    return all;
+}
+
+bool TimeSeries::advance(double seconds, bool playing)
+{
+    if (!playing || frames() < 2) {
+        m_clock = 0.0;
+        return false;
+    }
+
+    // Wait for the next frame, rather than show it half loaded
+    m_clock += seconds*m_fps;
+    if (m_clock < 1.0) {
+        return false;
+    }
+    const size_t next = (m_playhead + 1) % frames();
+    if (!ready(next)) {
+        if (m_clock < 1.0 + max_wait*m_fps) {
+            ++m_waited;
+            return false;
+        }
+        ++m_late;
+    }
+    m_playhead = next;
+    m_clock = std::min(m_clock - 1.0, 1.0);
+    ++m_played;
+    return true;
+}
+
+void TimeSeries::next_frame()
+{
+    ++m_generation;
+    m_shown.swap(m_grids);
+    m_grids.clear();
+}
+
+void TimeSeries::update(uint16_t z, const uint64_t tile[2], const uint64_t size[2])
+{
+    const Grid g = { z, { tile[0], tile[1] }, { size[0], size[1] } };
+    m_grids.push_back(g);
+    if (m_shown.empty()) {
+        m_shown.push_back(g);
+    }
+
+    // The current frame first, then those ahead of it
+    TileFactory * factory = TileFactory::instance();
+    const size_t n = ahead();
+    for (size_t k = 0; k <= n; ++k) {
+        const size_t f = (m_playhead + k) % frames();
+        Loader & loader = *m_frames[f];
+        each(g, [&](uint64_t x, uint64_t y) {
+            Tile * t = factory->get_tile(loader, z, x, y);
+            auto r = m_resident.find(t);
+            if (r != m_resident.end()) {
+                m_slots[r->second].used = m_generation;
+            } else if (m_evicted.erase(t)) {
+                loader.load_image(*t);
+            }
+        });
+    }
+}
+
+size_t TimeSeries::upload_images(size_t max)
+{
+    std::vector<Decoded> decoded;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_decoded.empty()) {
+            return 0;
+        }
+        const size_t n = std::min(max, m_decoded.size());
+        std::move(m_decoded.begin(), m_decoded.begin() + n, std::back_inserter(decoded));
+        m_decoded.erase(m_decoded.begin(), m_decoded.begin() + n);
+    }
+
+    for (Decoded & d : decoded)
+    {
+        size_t slot;
+        auto r = m_resident.find(d.tile);
+        if (r != m_resident.end()) {
+            slot = r->second;
+        } else if (m_slots.size() < capacity()) {
+            Slot s = { 0, 0, 0, NULL, 0, 0 };
+            glGenTextures(1, &s.texture);
+            glBindTexture(GL_TEXTURE_2D, s.texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            slot = m_slots.size();
+            m_slots.push_back(s);
+        } else {
+            // Needed later than anything in the slots, load it again when due
+            slot = victim();
+            Slot & s = m_slots[slot];
+            const bool stale = s.used + 1 < m_generation;
+            if (!stale && distance(s.frame) <= distance(d.frame)) {
+                m_evicted.insert(d.tile);
+                continue;
+            }
+            m_resident.erase(s.tile);
+            m_evicted.insert(s.tile);
+            ++m_recycled;
+        }
+
+        Slot & s = m_slots[slot];
+        glBindTexture(GL_TEXTURE_2D, s.texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (s.width == d.width && s.height == d.height) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, d.width, d.height, GL_RGBA, GL_UNSIGNED_BYTE, d.pixels.data());
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, d.width, d.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, d.pixels.data());
+            s.width = d.width;
+            s.height = d.height;
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        s.tile = d.tile;
+        s.frame = d.frame;
+        s.used = m_generation;
+        m_resident[d.tile] = slot;
+    }
+    return decoded.size();
+}
+
+void TimeSeries::draw(uint16_t z, uint64_t x, uint64_t y)
+{
+    Tile * t = TileFactory::instance()->get_tile(*m_frames[m_playhead], z, x, y);
+    auto r = m_resident.find(t);
+    if (r == m_resident.end()) {
+        return;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_slots[r->second].texture);
+    glBegin(GL_QUADS);
+        glTexCoord2f(0.0, 0.0); glVertex2f(0.0, 0.0);
+        glTexCoord2f(0.0, 1.0); glVertex2f(0.0, 1.0);
+        glTexCoord2f(1.0, 1.0); glVertex2f(1.0, 1.0);
+        glTexCoord2f(1.0, 0.0); glVertex2f(1.0, 0.0);
+    glEnd();
+}
+
+void TimeSeries::release()
+{
+    for (Slot & s : m_slots) {
+        glDeleteTextures(1, &s.texture);
+    }
+    m_slots.clear();
+    for (const auto & r : m_resident) {
+        m_evicted.insert(const_cast<Tile *>(r.first));
+    }
+    m_resident.clear();
+}
+
+void TimeSeries::report(std::ostream & os) const
+{
+    os << "Time series: " << frames() << " frames, " << m_played << " played, "
+       << m_late << " shown late, waited " << m_waited << " times, "
+       << m_slots.size() << " of " << capacity() << " slots, " << m_recycled << " recycled" << std::endl;
+}
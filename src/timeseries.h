@@ -0,0 +1,166 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <GL/glew.h>
+
+class Loader;
+class Tile;
+
+/**
+ * @brief an animated layer of the same tiles at many times, radar or forecasts
+ *
+ * Each time has a Loader of its own, from a URL template with {t} for the
+ * time as well as the fields of the tile, and cached under a directory per
+ * time.  Tiles of different times are then different tiles to the
+ * TileFactory, keyed by time as well as level, x and y.
+ *
+ * Playback requests the visible tiles of the frames ahead of the playhead,
+ * as many frames as fit the budget, and moves on to the next frame only
+ * once all of its tiles are uploaded, unless they are very late.  So the
+ * animation runs at a steady rate and never shows a frame half loaded.
+ *
+ * Decoded tiles go into a ring of texture slots, recycled rather than
+ * deleted.  When all are in use, the slot of the frame needed last, the
+ * one just behind the playhead, is taken first.
+ */
+class TimeSeries
+{
+public:
+    // Slots up to budget bytes of RGBA texture
+    TimeSeries(const std::string & url, const std::vector<std::string> & times, uint16_t maxZoom,
+               const std::string & extension, const std::string & dir, size_t budget);
+    ~TimeSeries();
+
+    size_t frames() const { return m_times.size(); }
+    size_t frame()  const { return m_playhead; }
+    const std::string & time() const { return m_times[m_playhead]; }
+
+    // Frames per second of playback
+    void set_rate(double fps) { m_fps = fps; }
+
+    // Move the playhead on by elapsed seconds, if the next frame is ready.
+    // True if the frame shown changed.
+    bool advance(double seconds, bool playing);
+
+    // The first frame, for the levels and size of the tiles
+    Loader & loader();
+    uint16_t maxZoom() const { return m_maxZoom; }
+
+    // Start of a frame, then the grid of each view, of level z tiles
+    void next_frame();
+    void update(uint16_t z, const uint64_t tile[2], const uint64_t size[2]);
+
+    // Upload decoded tiles into slots, returns the number uploaded
+    size_t upload_images(size_t max = SIZE_MAX);
+
+    // Draw the tile of the current frame, in the unit square
+    void draw(uint16_t z, uint64_t x, uint64_t y);
+
+    // Free the slots, while the GL context is current
+    void release();
+
+    // Frames shown, how often playback waited, and the slots in use
+    void report(std::ostream & os) const;
+
+private:
+    TimeSeries(const TimeSeries &) = delete;
+
+    class Frame;
+    friend class Frame;
+
+    struct Decoded
+    {
+        Tile *               tile;
+        size_t               frame;
+        uint32_t             width;
+        uint32_t             height;
+        std::vector<uint8_t> pixels;
+    };
+
+    struct Slot
+    {
+        GLuint   texture;
+        uint32_t width;
+        uint32_t height;
+        Tile *   tile;
+        size_t   frame;
+        uint64_t used;
+    };
+
+    struct Grid
+    {
+        uint16_t z;
+        uint64_t tile[2];
+        uint64_t size[2];
+    };
+
+    void   decoded(Decoded && d);
+    size_t ahead() const;
+    size_t capacity() const;
+    size_t distance(size_t frame) const;
+    size_t victim() const;
+    bool   ready(size_t frame);
+
+    template<typename Visit>
+    void   each(const Grid & g, Visit visit) const;
+
+    const std::vector<std::string>       m_times;
+    const uint16_t                       m_maxZoom;
+    const size_t                         m_budget;
+    std::vector<std::unique_ptr<Frame>>  m_frames;
+
+    double   m_fps;
+    size_t   m_playhead;
+    double   m_clock;
+
+    // Grids of this frame, and of the last one for checking readiness
+    std::vector<Grid> m_grids;
+    std::vector<Grid> m_shown;
+    uint64_t          m_generation;
+
+    std::mutex           m_mutex;
+    std::vector<Decoded> m_decoded;
+    std::atomic<uint32_t> m_tileSize;
+
+    std::vector<Slot>                     m_slots;
+    std::unordered_map<const Tile *, size_t> m_resident;
+    std::unordered_set<Tile *>            m_evicted;
+
+    uint64_t m_played;
+    uint64_t m_waited;
+    uint64_t m_late;
+    uint64_t m_recycled;
+};
@@ -0,0 +1,490 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+
+#include "track.h"
+#include "geo.h"
+#include "render.h"
+#include "tilefactory.h"
+
+// Positions of GPX track and route points, a new line at each
+// track, track segment and route
+static void parse_gpx(const std::string & text, std::vector<double> & longitude, std::vector<double> & latitude, std::vector<uint32_t> & starts)
+{
+    auto attribute = [&](size_t begin, size_t end, const char * name, double & value) -> bool
+    {
+        const size_t n = std::strlen(name);
+        for (size_t p = text.find(name, begin); p < end; p = text.find(name, p + 1))
+        {
+            // Whole attribute names only, lat but not some_lat
+            if (p > begin && !std::isspace(static_cast<unsigned char>(text[p-1])))
+            {
+                continue;
+            }
+            size_t q = p + n;
+            while (q < end && std::isspace(static_cast<unsigned char>(text[q]))) ++q;
+            if (q >= end || text[q] != '=') continue;
+            ++q;
+            while (q < end && std::isspace(static_cast<unsigned char>(text[q]))) ++q;
+            if (q >= end || (text[q] != '"' && text[q] != '\'')) continue;
+            char * stop = NULL;
+            value = std::strtod(text.c_str() + q + 1, &stop);
+            return stop != text.c_str() + q + 1;
+        }
+        return false;
+    };
+
+    auto element = [&](size_t p, const char * name) -> bool
+    {
+        const size_t n = std::strlen(name);
+        return text.compare(p, n, name) == 0 && p + n < text.size() &&
+               (std::isspace(static_cast<unsigned char>(text[p + n])) || text[p + n] == '>' || text[p + n] == '/');
+    };
+
+    for (size_t p = text.find('<'); p != std::string::npos; p = text.find('<', p + 1))
+    {
+        if (element(p + 1, "trkpt") || element(p + 1, "rtept"))
+        {
+            const size_t end = std::min(text.find('>', p), text.size());
+            double lat, lon;
+            if (attribute(p, end, "lat", lat) && attribute(p, end, "lon", lon))
+            {
+                longitude.push_back(lon);
+                latitude.push_back(lat);
+            }
+        }
+        else if (element(p + 1, "trkseg") || element(p + 1, "trk") || element(p + 1, "rte"))
+        {
+            starts.push_back(uint32_t(longitude.size()));
+        }
+    }
+}
+
+// Positions of every "coordinates" array, each innermost array of
+// positions is a line: LineString, MultiLineString and polygon rings
+static void parse_geojson(const std::string & text, std::vector<double> & longitude, std::vector<double> & latitude, std::vector<uint32_t> & starts)
+{
+    static const char key[] = "\"coordinates\"";
+
+    const char * const begin = text.c_str();
+    const char * const end = begin + text.size();
+    for (size_t found = text.find(key); found != std::string::npos; found = text.find(key, found + 1))
+    {
+        const char * p = begin + found + sizeof(key) - 1;
+        while (p < end && *p != '[' && *p != '{' && *p != '"') ++p;
+        if (p >= end || *p != '[')
+        {
+            continue;
+        }
+
+        int depth = 0;
+        int lineDepth = -1;
+        for (; p < end; ++p)
+        {
+            if (*p == '[')
+            {
+                ++depth;
+            }
+            else if (*p == ']')
+            {
+                if (depth == lineDepth)
+                {
+                    starts.push_back(uint32_t(longitude.size()));
+                }
+                if (--depth == 0)
+                {
+                    break;
+                }
+            }
+            else if (*p == '-' || *p == '.' || std::isdigit(static_cast<unsigned char>(*p)))
+            {
+                // A position, longitude then latitude and perhaps elevation
+                char * stop = NULL;
+                const double lon = std::strtod(p, &stop);
+                p = stop;
+                while (p < end && (*p == ',' || std::isspace(static_cast<unsigned char>(*p)))) ++p;
+                const double lat = std::strtod(p, &stop);
+                if (stop == p)
+                {
+                    break;
+                }
+                p = stop;
+                while (p < end && *p != ']') ++p;
+                --p;
+
+                if (lineDepth != depth - 1)
+                {
+                    lineDepth = depth - 1;
+                    starts.push_back(uint32_t(longitude.size()));
+                }
+                longitude.push_back(lon);
+                latitude.push_back(lat);
+            }
+        }
+        starts.push_back(uint32_t(longitude.size()));
+    }
+}
+
+TrackLayer::TrackLayer()
+: m_budget(1024), m_frame(0)
+{
+}
+
+TrackLayer::~TrackLayer()
+{
+}
+
+bool TrackLayer::load(const std::string & filename)
+{
+    std::ifstream is(filename.c_str(), std::ios::binary);
+    if (!is)
+    {
+        std::cerr << "Could not read " << filename << std::endl;
+        return false;
+    }
+    const std::string text((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+
+    std::vector<double>   longitude;
+    std::vector<double>   latitude;
+    std::vector<uint32_t> starts;
+
+    const size_t first = text.find_first_not_of(" \t\r\n\xef\xbb\xbf");
+    if (first != std::string::npos && text[first] == '<')
+    {
+        parse_gpx(text, longitude, latitude, starts);
+    }
+    else
+    {
+        parse_geojson(text, longitude, latitude, starts);
+    }
+
+    const size_t before = m_x.size();
+    add(longitude, latitude, starts);
+    if (m_x.size() == before)
+    {
+        std::cerr << "No tracks in " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void TrackLayer::add(const std::vector<double> & longitude, const std::vector<double> & latitude, const std::vector<uint32_t> & starts)
+{
+    std::vector<uint64_t> x(longitude.size());
+    std::vector<uint64_t> y(latitude.size());
+    to_quadtree(longitude.data(), latitude.data(), longitude.size(), x.data(), y.data());
+
+    // Lines between the starts, and after the last, of two points or more
+    std::vector<uint32_t> bounds(starts);
+    bounds.push_back(0);
+    bounds.push_back(uint32_t(x.size()));
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+    for (size_t i = 0; i + 1 < bounds.size(); ++i)
+    {
+        const uint32_t begin = bounds[i];
+        const uint32_t end = bounds[i + 1];
+        if (end - begin < 2)
+        {
+            continue;
+        }
+        const uint32_t offset = uint32_t(m_x.size());
+        m_x.insert(m_x.end(), x.begin() + begin, x.begin() + end);
+        m_y.insert(m_y.end(), y.begin() + begin, y.begin() + end);
+        m_lines.push_back(std::make_pair(offset, offset + (end - begin)));
+    }
+}
+
+void TrackLayer::simplify(uint32_t begin, uint32_t end)
+{
+    // The ends are always drawn
+    m_level[begin] = 0;
+    m_level[end - 1] = 0;
+
+    // Each point is as significant as its distance from the line between
+    // the ends of the span that kept it, but no more than that span's own
+    struct Span
+    {
+        uint32_t a;
+        uint32_t c;
+        double   cap;
+    };
+    std::vector<Span> stack;
+    stack.push_back(Span{begin, end - 1, std::numeric_limits<double>::infinity()});
+
+    while (!stack.empty())
+    {
+        const Span s = stack.back();
+        stack.pop_back();
+        if (s.c - s.a < 2)
+        {
+            continue;
+        }
+
+        // Relative to the first point, across the wrap of the world
+        const double dx = double(int64_t(m_x[s.c] - m_x[s.a]));
+        const double dy = double(int64_t(m_y[s.c] - m_y[s.a]));
+        const double length2 = dx*dx + dy*dy;
+
+        uint32_t k = s.a + 1;
+        double   far = -1.0;
+        for (uint32_t i = s.a + 1; i < s.c; ++i)
+        {
+            const double px = double(int64_t(m_x[i] - m_x[s.a]));
+            const double py = double(int64_t(m_y[i] - m_y[s.a]));
+
+            // Distance from the segment, tracks often double back
+            const double t = length2 > 0.0 ? std::max(0.0, std::min(1.0, (px*dx + py*dy)/length2)) : 0.0;
+            const double ex = px - t*dx;
+            const double ey = py - t*dy;
+            const double d2 = ex*ex + ey*ey;
+            if (d2 > far)
+            {
+                far = d2;
+                k = i;
+            }
+        }
+
+        // Kept at level L when more than half a level L pixel away
+        const double d = std::min(std::sqrt(far), s.cap);
+        const double level = d > 0.0 ? std::floor(63 - bits - std::log2(d)) + 1 : maxLevel + 1;
+        m_level[k] = uint8_t(std::max(0.0, std::min<double>(level, maxLevel + 1)));
+
+        stack.push_back(Span{s.a, k, d});
+        stack.push_back(Span{k, s.c, d});
+    }
+}
+
+void TrackLayer::index()
+{
+    release();
+
+    m_level.assign(m_x.size(), maxLevel + 1);
+    for (const auto & line : m_lines)
+    {
+        simplify(line.first, line.second);
+    }
+
+    m_runs.assign(maxLevel + 1, std::vector<Run>());
+    for (uint16_t z = 0; z <= maxLevel; ++z)
+    {
+        std::vector<Run> & runs = m_runs[z];
+        std::unordered_map<uint64_t, size_t> last;
+        uint64_t lastKey = ~uint64_t(0);
+        size_t   lastRun = 0;
+
+        // Segment i to i+1 joins the run of the tile that ended at i,
+        // the same tile as the previous segment more often than not
+        auto add = [&](uint64_t key, uint32_t i)
+        {
+            if (key != lastKey)
+            {
+                auto found = last.find(key);
+                if (found == last.end() || runs[found->second].end != i + 1)
+                {
+                    last[key] = runs.size();
+                    runs.push_back(Run{key, i, i + 2});
+                    lastKey = key;
+                    lastRun = runs.size() - 1;
+                    return;
+                }
+                lastKey = key;
+                lastRun = found->second;
+            }
+            if (runs[lastRun].end == i + 1)
+            {
+                runs[lastRun].end = i + 2;
+            }
+            else
+            {
+                last[key] = runs.size();
+                runs.push_back(Run{key, i, i + 2});
+                lastRun = runs.size() - 1;
+            }
+        };
+
+        const int shift = 64 - z;
+        auto tile = [shift](uint64_t v) -> uint64_t { return shift < 64 ? v >> shift : 0; };
+
+        for (const auto & line : m_lines)
+        {
+            for (uint32_t i = line.first; i + 1 < line.second; ++i)
+            {
+                const uint64_t x0 = tile(m_x[i]);
+                const uint64_t y0 = tile(m_y[i]);
+                const uint64_t x1 = tile(m_x[i + 1]);
+                const uint64_t y1 = tile(m_y[i + 1]);
+                if (x0 == x1 && y0 == y1)
+                {
+                    add(TileFactory::tile_key(z, x0, y0), i);
+                    continue;
+                }
+
+                // Every tile under the segment's bounds, unless it spans
+                // the world the other way around, or a great many tiles
+                const uint64_t w = std::max(x0, x1) - std::min(x0, x1) + 1;
+                const uint64_t h = std::max(y0, y1) - std::min(y0, y1) + 1;
+                if (w*h > 256 || w > 256 || h > 256)
+                {
+                    add(TileFactory::tile_key(z, x0, y0), i);
+                    add(TileFactory::tile_key(z, x1, y1), i);
+                    continue;
+                }
+                for (uint64_t y = std::min(y0, y1); y <= std::max(y0, y1); ++y)
+                {
+                    for (uint64_t x = std::min(x0, x1); x <= std::max(x0, x1); ++x)
+                    {
+                        add(TileFactory::tile_key(z, x, y), i);
+                    }
+                }
+            }
+        }
+
+        std::sort(runs.begin(), runs.end());
+    }
+}
+
+void TrackLayer::draw(uint16_t z, uint64_t x, uint64_t y)
+{
+    // Deeper than the index, the part of the indexed ancestor in this tile
+    const uint16_t deeper = z > maxLevel ? z - maxLevel : 0;
+    if (deeper)
+    {
+        const uint64_t mask = (uint64_t(1) << deeper) - 1;
+        glPushMatrix();
+        glScaled(std::ldexp(1.0, deeper), std::ldexp(1.0, deeper), 1);
+        glTranslated(-std::ldexp(double(x & mask), -deeper), -std::ldexp(double(y & mask), -deeper), 0);
+        z -= deeper;
+        x >>= deeper;
+        y >>= deeper;
+    }
+
+    const uint64_t key = TileFactory::tile_key(z, x, y);
+    auto found = m_strips.find(key);
+    if (found == m_strips.end() && z < m_runs.size())
+    {
+        Strips strips;
+        strips.buffer = 0;
+        strips.frame = m_frame;
+
+        // The points of each run simplified for the level, and its ends
+        // so that it meets the runs of neighbouring tiles
+        const uint64_t ox = z ? x << (64 - z) : 0;
+        const uint64_t oy = z ? y << (64 - z) : 0;
+        const double scale = std::ldexp(1.0, -(64 - z));
+        std::vector<GLfloat> vertices;
+        const std::vector<Run> & runs = m_runs[z];
+        for (auto i = std::lower_bound(runs.begin(), runs.end(), Run{key, 0, 0}); i != runs.end() && i->key == key; ++i)
+        {
+            const GLint first = GLint(vertices.size()/2);
+            for (uint32_t j = i->begin; j < i->end; ++j)
+            {
+                if (j == i->begin || j + 1 == i->end || m_level[j] <= z)
+                {
+                    vertices.push_back(GLfloat(double(int64_t(m_x[j] - ox))*scale));
+                    vertices.push_back(GLfloat(double(int64_t(m_y[j] - oy))*scale));
+                }
+            }
+            strips.first.push_back(first);
+            strips.count.push_back(GLsizei(vertices.size()/2 - first));
+        }
+
+        if (!vertices.empty())
+        {
+            glGenBuffers(1, &strips.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, strips.buffer);
+            glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        found = m_strips.insert(std::make_pair(key, std::move(strips))).first;
+        evict();
+    }
+
+    if (found != m_strips.end())
+    {
+        Strips & strips = found->second;
+        strips.frame = m_frame;
+        if (strips.buffer)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, strips.buffer);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glVertexPointer(2, GL_FLOAT, 0, NULL);
+            glMultiDrawArrays(GL_LINE_STRIP, strips.first.data(), strips.count.data(), GLsizei(strips.first.size()));
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+    }
+
+    if (deeper)
+    {
+        glPopMatrix();
+    }
+}
+
+void TrackLayer::evict()
+{
+    if (m_strips.size() <= m_budget) {
+        return;
+    }
+
+    // Least recently drawn first, but not anything drawn recently
+    std::vector<std::pair<uint64_t, uint64_t>> candidates;
+    for (const auto & i : m_strips) {
+        if (i.second.frame + 1 < m_frame) {
+            candidates.push_back(std::make_pair(i.second.frame, i.first));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const auto & i : candidates) {
+        if (m_strips.size() <= m_budget) {
+            break;
+        }
+        auto strips = m_strips.find(i.second);
+        if (strips->second.buffer) {
+            glDeleteBuffers(1, &strips->second.buffer);
+        }
+        m_strips.erase(strips);
+    }
+}
+
+void TrackLayer::release()
+{
+    for (auto & i : m_strips) {
+        if (i.second.buffer) {
+            glDeleteBuffers(1, &i.second.buffer);
+        }
+    }
+    m_strips.clear();
+}
@@ -0,0 +1,107 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/glew.h>
+
+/**
+ * @brief GPS tracks from GPX or GeoJSON files, drawn over the imagery
+ *
+ * Positions are converted to quad-tree co-ordinates once.  Douglas-Peucker
+ * gives each point the shallowest level at which it is more than half a
+ * pixel from the simplified line, so every level has its own
+ * simplification without storing the track again.  For each level the
+ * track is indexed by the tiles it crosses, as runs of consecutive points.
+ * The line strips of a tile are built and uploaded to a vertex buffer the
+ * first time the tile is drawn, so a frame only touches the tiles in view.
+ */
+class TrackLayer
+{
+public:
+    TrackLayer();
+    ~TrackLayer();
+
+    // Add the lines of a .gpx or .geojson file, false if there were none
+    bool load(const std::string & filename);
+
+    // Simplify and index what has been loaded, before drawing
+    void index();
+
+    size_t points() const { return m_x.size(); }
+    size_t lines() const  { return m_lines.size(); }
+
+    // Draw the track in a level z tile, in the unit square
+    void draw(uint16_t z, uint64_t x, uint64_t y);
+
+    // Start of a frame, buffers not drawn recently may be freed
+    void next_frame() { ++m_frame; }
+
+    // Free the buffers, while the GL context is current
+    void release();
+
+    // Deepest level indexed, deeper tiles draw the track of this level
+    static const uint16_t maxLevel = 20;
+
+private:
+    TrackLayer(const TrackLayer &) = delete;
+
+    void add(const std::vector<double> & longitude, const std::vector<double> & latitude, const std::vector<uint32_t> & starts);
+    void simplify(uint32_t begin, uint32_t end);
+    void evict();
+
+    // Consecutive points of a line, with a segment in the tile
+    struct Run
+    {
+        uint64_t key;
+        uint32_t begin;
+        uint32_t end;
+
+        bool operator<(const Run & other) const { return key < other.key || (key == other.key && begin < other.begin); }
+    };
+
+    // Line strips of a tile, in tile co-ordinates
+    struct Strips
+    {
+        GLuint               buffer;
+        std::vector<GLint>   first;
+        std::vector<GLsizei> count;
+        uint64_t             frame;
+    };
+
+    std::vector<uint64_t> m_x;
+    std::vector<uint64_t> m_y;
+    std::vector<uint8_t>  m_level;      // shallowest level each point is drawn at
+    std::vector<std::pair<uint32_t, uint32_t>> m_lines;
+    std::vector<std::vector<Run>> m_runs;   // per level, sorted by tile
+
+    std::unordered_map<uint64_t, Strips> m_strips;
+    const size_t m_budget;
+    uint64_t     m_frame;
+};
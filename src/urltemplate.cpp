@@ -0,0 +1,120 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <iostream>
+#include <sstream>
+
+#include "urltemplate.h"
+
+UrlTemplate::UrlTemplate(const std::string & spec, bool tms, bool zxy, const std::string & extension)
+: m_spec(spec)
+{
+    std::stringstream ss(spec);
+    std::string pattern;
+    while (ss >> pattern)
+    {
+        // As get_filename, {z}/{a}/{b}
+        if (pattern.find('{') == std::string::npos) {
+            const std::string y = tms ? "{-y}" : "{y}";
+            pattern += zxy ? "{z}/{x}/" + y : "{z}/" + y + "/{x}";
+            pattern += extension;
+        }
+
+        Mirror mirror;
+        size_t i = 0;
+        while (i < pattern.size())
+        {
+            const size_t open = pattern.find('{', i);
+            const size_t close = open == std::string::npos ? open : pattern.find('}', open);
+            if (close == std::string::npos) {
+                mirror.parts.push_back(Part{ TEXT, pattern.substr(i) });
+                break;
+            }
+            if (open > i) {
+                mirror.parts.push_back(Part{ TEXT, pattern.substr(i, open - i) });
+            }
+
+            const std::string name = pattern.substr(open + 1, close - open - 1);
+            if (name == "z") {
+                mirror.parts.push_back(Part{ Z, "" });
+            } else if (name == "x") {
+                mirror.parts.push_back(Part{ X, "" });
+            } else if (name == "y") {
+                mirror.parts.push_back(Part{ Y, "" });
+            } else if (name == "-y") {
+                mirror.parts.push_back(Part{ TMS_Y, "" });
+            } else if (name == "s" || name.compare(0, 2, "s:") == 0) {
+                const std::string list = name.size() > 2 ? name.substr(2) : "abc";
+                for (char c : list) {
+                    mirror.subdomains.push_back(std::string(1, c));
+                }
+                mirror.parts.push_back(Part{ S, "" });
+            } else {
+                std::cerr << "Unknown field in tile URL: {" << name << "}" << std::endl;
+                mirror.parts.push_back(Part{ TEXT, pattern.substr(open, close - open + 1) });
+            }
+            i = close + 1;
+        }
+
+        // One shard without {s}
+        if (mirror.subdomains.empty()) {
+            mirror.subdomains.push_back("");
+        }
+        m_mirrors.push_back(mirror);
+    }
+}
+
+size_t UrlTemplate::shard(size_t mirror, uint16_t /*z*/, uint64_t x, uint64_t y) const
+{
+    // Neighbours alternate, as other clients do
+    return (x + y) % m_mirrors[mirror].subdomains.size();
+}
+
+std::string UrlTemplate::host(size_t mirror, size_t shard) const
+{
+    return expand(m_mirrors[mirror], shard, 0, 0, 0);
+}
+
+std::string UrlTemplate::url(size_t mirror, uint16_t z, uint64_t x, uint64_t y) const
+{
+    return expand(m_mirrors[mirror], shard(mirror, z, x, y), z, x, y);
+}
+
+std::string UrlTemplate::expand(const Mirror & mirror, size_t shard, uint16_t z, uint64_t x, uint64_t y) const
+{
+    std::string url;
+    for (const Part & part : mirror.parts)
+    {
+        switch (part.field)
+        {
+            case TEXT:  url += part.text;                                          break;
+            case Z:     url += std::to_string(z);                                  break;
+            case X:     url += std::to_string(x);                                  break;
+            case Y:     url += std::to_string((uint64_t(1) << z) - 1 - y);         break;
+            case TMS_Y: url += std::to_string(y);                                  break;
+            case S:     url += mirror.subdomains[shard];                           break;
+        }
+    }
+    return url;
+}
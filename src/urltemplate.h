@@ -0,0 +1,78 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief tile URLs from templates, sharded across subdomains and mirrors
+ *
+ * A template has {z}, {x}, and {y} counted from the north or {-y} from
+ * the south as for TMS.  {s} is one of the subdomains a, b and c, or of
+ * those listed as in {s:1234}, chosen by the tile so that a tile always
+ * comes from the same host and stays in HTTP caches.  Mirrors are
+ * alternative templates separated by spaces.
+ */
+class UrlTemplate
+{
+public:
+    // Templates, or a plain prefix for paths laid out as in the cache
+    UrlTemplate(const std::string & spec, bool tms, bool zxy, const std::string & extension);
+
+    const std::string & spec() const { return m_spec; }
+
+    size_t mirrors() const { return m_mirrors.size(); }
+    size_t shards(size_t mirror) const { return m_mirrors[mirror].subdomains.size(); }
+
+    // Subdomain of the mirror for the tile, y from the south as in Tile
+    size_t shard(size_t mirror, uint16_t z, uint64_t x, uint64_t y) const;
+
+    // Template with the subdomain filled in, enough for its scheme://host
+    std::string host(size_t mirror, size_t shard) const;
+
+    std::string url(size_t mirror, uint16_t z, uint64_t x, uint64_t y) const;
+
+private:
+    enum Field { TEXT, Z, X, Y, TMS_Y, S };
+
+    struct Part
+    {
+        Field       field;
+        std::string text;
+    };
+
+    struct Mirror
+    {
+        std::vector<Part>        parts;
+        std::vector<std::string> subdomains;
+    };
+
+    std::string expand(const Mirror & mirror, size_t shard, uint16_t z, uint64_t x, uint64_t y) const;
+
+    std::string         m_spec;
+    std::vector<Mirror> m_mirrors;
+};
@@ -0,0 +1,302 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <deque>
+
+#include "vectorloader.h"
+#include "mvt.h"
+
+// After GLEW
+#include <GL/glu.h>
+
+#ifndef CALLBACK
+#define CALLBACK
+#endif
+
+namespace {
+
+struct Style
+{
+    const char * layer;
+    GLubyte      fill[4];
+    GLubyte      line[4];
+};
+
+// Colours by layer name, covering the OpenMapTiles, Mapbox Streets
+// and Tilezen schemas.  Zero alpha means not drawn.
+const Style styles[] = {
+    { "water",          { 160, 196, 222, 255 }, { 160, 196, 222, 255 } },
+    { "ocean",          { 160, 196, 222, 255 }, { 160, 196, 222, 255 } },
+    { "waterway",       {   0,   0,   0,   0 }, { 140, 180, 214, 255 } },
+    { "landcover",      { 206, 226, 190, 255 }, {   0,   0,   0,   0 } },
+    { "landuse",        { 226, 222, 206, 255 }, {   0,   0,   0,   0 } },
+    { "park",           { 200, 228, 184, 255 }, {   0,   0,   0,   0 } },
+    { "building",       { 214, 206, 198, 255 }, { 190, 180, 170, 255 } },
+    { "buildings",      { 214, 206, 198, 255 }, { 190, 180, 170, 255 } },
+    { "transportation", {   0,   0,   0,   0 }, { 255, 255, 255, 255 } },
+    { "road",           {   0,   0,   0,   0 }, { 255, 255, 255, 255 } },
+    { "roads",          {   0,   0,   0,   0 }, { 255, 255, 255, 255 } },
+    { "boundary",       {   0,   0,   0,   0 }, { 150, 120, 170, 255 } },
+    { "boundaries",     {   0,   0,   0,   0 }, { 150, 120, 170, 255 } },
+    { "admin",          {   0,   0,   0,   0 }, { 150, 120, 170, 255 } },
+    { NULL,             { 238, 236, 230, 255 }, { 170, 170, 170, 255 } }
+};
+
+const Style & style(const std::string & layer)
+{
+    const Style * i = styles;
+    for (; i->layer; ++i) {
+        if (layer == i->layer) {
+            break;
+        }
+    }
+    return *i;
+}
+
+// GLU tessellation of polygon rings into a triangle list
+struct Tessellator
+{
+    GLUtesselator            * tess;
+    std::vector<GLfloat>     * out;
+    std::deque<GLdouble>       combined;
+
+    Tessellator(std::vector<GLfloat> & triangles)
+    : tess(gluNewTess()), out(&triangles)
+    {
+        typedef void (CALLBACK * Callback)();
+        gluTessCallback(tess, GLU_TESS_VERTEX_DATA,    Callback(&Tessellator::vertex));
+        gluTessCallback(tess, GLU_TESS_COMBINE_DATA,   Callback(&Tessellator::combine));
+        // Forces separate triangles, rather than fans and strips
+        gluTessCallback(tess, GLU_TESS_EDGE_FLAG_DATA, Callback(&Tessellator::edge));
+        gluTessProperty(tess, GLU_TESS_WINDING_RULE, GLU_TESS_WINDING_ODD);
+        gluTessNormal(tess, 0, 0, 1);
+    }
+
+    ~Tessellator()
+    {
+        gluDeleteTess(tess);
+    }
+
+    static void CALLBACK vertex(GLvoid * data, GLvoid * self)
+    {
+        const GLdouble * v = static_cast<const GLdouble *>(data);
+        static_cast<Tessellator *>(self)->out->push_back(GLfloat(v[0]));
+        static_cast<Tessellator *>(self)->out->push_back(GLfloat(v[1]));
+    }
+
+    static void CALLBACK combine(GLdouble coords[3], GLvoid *[4], GLfloat[4], GLvoid ** data, GLvoid * self)
+    {
+        std::deque<GLdouble> & combined = static_cast<Tessellator *>(self)->combined;
+        combined.push_back(coords[0]);
+        combined.push_back(coords[1]);
+        combined.push_back(coords[2]);
+        *data = &combined[combined.size() - 3];
+    }
+
+    static void CALLBACK edge(GLboolean, GLvoid *)
+    {
+    }
+};
+
+}
+
+VectorLoader::~VectorLoader()
+{
+    // Decoding uses the tessellations and mutex below
+    finish_tasks();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tessellated.clear();
+}
+
+bool VectorLoader::loaded(const Tile & tile) const
+{
+    return m_meshes.count(&tile) > 0;
+}
+
+void VectorLoader::forget(Tile & tile)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tessellated.erase(std::remove_if(m_tessellated.begin(), m_tessellated.end(),
+                                           [&tile](const Tessellated & t) { return t.tile == &tile; }),
+                            m_tessellated.end());
+    }
+
+    auto i = m_meshes.find(&tile);
+    if (i != m_meshes.end()) {
+        glDeleteBuffers(1, &i->second.buffer);
+        m_meshes.erase(i);
+    }
+    Loader::forget(tile);
+}
+
+void VectorLoader::decode_image(Tile * tile, const Cached & cached)
+{
+    std::vector<MvtLayer> layers;
+    if (!mvt_decode(std::string(cached.data.begin(), cached.data.end()), layers)) {
+        std::cerr << "Failed to decode vector tile: " << cache_filename(*tile) << std::endl;
+        return;
+    }
+
+    Tessellated tessellated;
+    tessellated.tile = tile;
+
+    std::vector<GLfloat>  triangles;
+    std::vector<GLdouble> ring;
+    for (const auto & layer : layers)
+    {
+        const Style & s = style(layer.name);
+
+        // Extent units with y down, to the unit square with y up
+        const double scale = 1.0 / layer.extent;
+
+        for (const auto & feature : layer.features)
+        {
+            if (feature.type == MvtFeature::POLYGON && s.fill[3])
+            {
+                triangles.clear();
+                Tessellator tessellator(triangles);
+
+                // Each ring is a contour, holes cancel by the odd winding rule
+                std::vector<std::vector<GLdouble>> rings;
+                for (const auto & path : feature.paths) {
+                    rings.push_back(std::vector<GLdouble>());
+                    for (const auto & p : path) {
+                        rings.back().push_back(p.x * scale);
+                        rings.back().push_back(1.0 - p.y * scale);
+                        rings.back().push_back(0.0);
+                    }
+                }
+
+                gluTessBeginPolygon(tessellator.tess, &tessellator);
+                for (auto & r : rings) {
+                    gluTessBeginContour(tessellator.tess);
+                    for (size_t i = 0; i + 3 <= r.size(); i += 3) {
+                        gluTessVertex(tessellator.tess, &r[i], &r[i]);
+                    }
+                    gluTessEndContour(tessellator.tess);
+                }
+                gluTessEndPolygon(tessellator.tess);
+
+                for (size_t i = 0; i + 2 <= triangles.size(); i += 2) {
+                    tessellated.triangles.push_back(Vertex{ triangles[i], triangles[i+1], { s.fill[0], s.fill[1], s.fill[2], s.fill[3] } });
+                }
+            }
+
+            if ((feature.type == MvtFeature::LINESTRING || feature.type == MvtFeature::POLYGON) && s.line[3])
+            {
+                // Pairs of vertices for GL_LINES, so that all the lines
+                // of the tile are drawn in one call
+                for (const auto & path : feature.paths) {
+                    for (size_t i = 1; i < path.size(); ++i) {
+                        tessellated.lines.push_back(Vertex{ GLfloat(path[i-1].x * scale), GLfloat(1.0 - path[i-1].y * scale), { s.line[0], s.line[1], s.line[2], s.line[3] } });
+                        tessellated.lines.push_back(Vertex{ GLfloat(path[i].x   * scale), GLfloat(1.0 - path[i].y   * scale), { s.line[0], s.line[1], s.line[2], s.line[3] } });
+                    }
+                }
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tessellated.push_back(std::move(tessellated));
+}
+
+size_t VectorLoader::upload_images(size_t max)
+{
+    std::vector<Tessellated> tessellated;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_tessellated.empty()) {
+            return 0;
+        }
+        if (m_tessellated.size() <= max) {
+            tessellated.swap(m_tessellated);
+        } else {
+            // Leave the remainder for the next frame
+            std::move(m_tessellated.begin(), m_tessellated.begin() + max, std::back_inserter(tessellated));
+            m_tessellated.erase(m_tessellated.begin(), m_tessellated.begin() + max);
+        }
+    }
+
+    for (auto & i : tessellated)
+    {
+        Mesh mesh;
+        mesh.triangles = GLsizei(i.triangles.size());
+        mesh.lines     = GLsizei(i.lines.size());
+
+        glGenBuffers(1, &mesh.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer);
+        glBufferData(GL_ARRAY_BUFFER, (i.triangles.size() + i.lines.size()) * sizeof(Vertex), NULL, GL_STATIC_DRAW);
+        if (!i.triangles.empty()) {
+            glBufferSubData(GL_ARRAY_BUFFER, 0, i.triangles.size() * sizeof(Vertex), &i.triangles[0]);
+        }
+        if (!i.lines.empty()) {
+            glBufferSubData(GL_ARRAY_BUFFER, i.triangles.size() * sizeof(Vertex), i.lines.size() * sizeof(Vertex), &i.lines[0]);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        m_meshes[i.tile] = mesh;
+    }
+
+    m_uploads += tessellated.size();
+    return tessellated.size();
+}
+
+void VectorLoader::draw(const Tile & tile) const
+{
+    auto i = m_meshes.find(&tile);
+    if (i == m_meshes.end()) {
+        return;
+    }
+    const Mesh & mesh = i->second;
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(Vertex), reinterpret_cast<const GLvoid *>(offsetof(Vertex, x)));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), reinterpret_cast<const GLvoid *>(offsetof(Vertex, rgba)));
+
+    if (mesh.triangles) {
+        glDrawArrays(GL_TRIANGLES, 0, mesh.triangles);
+    }
+    if (mesh.lines) {
+        glDrawArrays(GL_LINES, mesh.triangles, mesh.lines);
+    }
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void VectorLoader::release()
+{
+    for (auto & i : m_meshes) {
+        glDeleteBuffers(1, &i.second.buffer);
+    }
+    m_meshes.clear();
+}
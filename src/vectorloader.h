@@ -0,0 +1,95 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "loader.h"
+
+/**
+ * @brief Loader variant for Mapbox Vector Tiles
+ *
+ * Tiles are fetched and cached on disk like imagery, but decoded into
+ * triangles (polygons) and line segments by the CPU pool.  The geometry
+ * of each tile is kept in a vertex buffer, in tile co-ordinates, so it
+ * can be drawn sharply at any fractional zoom without refetching.
+ */
+class VectorLoader : public Loader
+{
+public:
+    VectorLoader(bool tms, bool zxy, uint16_t maxZoom, const std::string & prefix, const std::string & extension, const std::string & dir)
+    : Loader(tms, zxy, maxZoom, prefix, extension, dir)
+    {
+        // Styled for 512 pixels across, as is usual for vector tiles
+        m_tileSize = 512;
+    }
+
+    ~VectorLoader();
+
+    size_t upload_images(size_t max = SIZE_MAX) override;
+
+    bool loaded(const Tile & tile) const override;
+
+    void forget(Tile & tile) override;
+
+    // Draw the geometry of the tile, in the unit square
+    void draw(const Tile & tile) const;
+
+    // Free the vertex buffers, while the GL context is current
+    void release();
+
+protected:
+    void decode_image(Tile * tile, const Cached & cached) override;
+
+    const char * accept() const override { return "application/vnd.mapbox-vector-tile,application/x-protobuf,*/*;q=0.5"; }
+
+private:
+    struct Vertex
+    {
+        GLfloat x, y;
+        GLubyte rgba[4];
+    };
+
+    // Tessellated by the CPU pool, waiting for upload by the render thread
+    struct Tessellated
+    {
+        Tile              * tile;
+        std::vector<Vertex> triangles;
+        std::vector<Vertex> lines;
+    };
+
+    struct Mesh
+    {
+        GLuint  buffer;
+        GLsizei triangles;
+        GLsizei lines;
+    };
+
+    std::mutex                                   m_mutex;
+    std::vector<Tessellated>                     m_tessellated;
+    std::unordered_map<const Tile *, Mesh>       m_meshes;
+};
@@ -0,0 +1,232 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdlib>
+
+#include "visibleset.h"
+#include "tile.h"
+#include "tilefactory.h"
+#include "loader.h"
+
+// Compute the bottom left tile, and tile grid size
+void visibleBounds(uint64_t width, uint64_t height, uint64_t bits, uint64_t z, uint64_t x, uint64_t y, uint64_t tile[2], uint64_t size[2])
+{
+   tile[0] = x - ((width >>1)<<(64-z-bits));
+   tile[1] = y - ((height>>1)<<(64-z-bits));
+
+   if (z>0)
+   {
+       tile[0] >>= (64-z);
+       tile[1] >>= (64-z);
+   }
+   else
+   {
+       tile[0] = 0;
+       tile[1] = 0;
+   }
+
+   const uint64_t tileSize = uint64_t(1)<<bits;
+   size[0] = (width/tileSize) + 2;
+   size[1] = (height/tileSize) + 2;
+}
+
+VisibleSet::VisibleSet()
+: m_loader(NULL), m_zoom(0), m_tile{0, 0}, m_size{0, 0}, m_uploads(0)
+{
+}
+
+VisibleSet::~VisibleSet()
+{
+    clear();
+}
+
+void VisibleSet::clear()
+{
+    for (const auto & i : m_tiles)
+    {
+        leave(*m_loader, i);
+    }
+    m_tiles.clear();
+    m_entered.clear();
+    m_left.clear();
+    m_pending.clear();
+    m_loader = NULL;
+}
+
+// Let go of the tile of a cell, and what was drawn for it
+void VisibleSet::leave(Loader & loader, const VisibleTile & cell)
+{
+    TileFactory * factory = TileFactory::instance();
+    factory->unuse(loader, cell.tile);
+    if (cell.draw)
+    {
+        factory->unuse(loader, cell.draw);
+    }
+}
+
+bool VisibleSet::update(Loader & loader, uint16_t z, const uint64_t tile[2], const uint64_t size[2])
+{
+    m_entered.clear();
+    m_left.clear();
+
+    if (m_loader == &loader && m_zoom == z &&
+        m_tile[0] == tile[0] && m_tile[1] == tile[1] &&
+        m_size[0] == size[0] && m_size[1] == size[1])
+    {
+        // Same tiles, but ancestors may have been replaced by new uploads
+        if (m_uploads != loader.uploads())
+        {
+            resolve(loader);
+        }
+        return false;
+    }
+
+    // Columns and rows panned by, the shorter way around the level.
+    // Cells of the old grid still in view are kept as they are.
+    const uint64_t levelSize = uint64_t(1)<<z;
+    const bool same = m_loader == &loader && m_zoom == z && m_size[0] == size[0] && m_size[1] == size[1];
+    int64_t shift[2] = { 0, 0 };
+    for (int k = 0; k < 2; ++k)
+    {
+        uint64_t d = (tile[k] - m_tile[k]) & (levelSize - 1);
+        shift[k] = d >= levelSize/2 && d ? int64_t(d) - int64_t(levelSize) : int64_t(d);
+    }
+    const bool overlap = same &&
+        uint64_t(std::abs(shift[0])) <= size[0] && uint64_t(std::abs(shift[1])) <= size[1];
+
+    Loader * previous = m_loader;
+    std::vector<VisibleTile> tiles;
+    tiles.swap(m_tiles);
+
+    m_loader  = &loader;
+    m_zoom    = z;
+    m_tile[0] = tile[0];
+    m_tile[1] = tile[1];
+    m_size[0] = size[0];
+    m_size[1] = size[1];
+
+    // The first cell looked up, and the rest mostly by slab arithmetic
+    // from the cell before them, or below them
+    TileFactory * factory = TileFactory::instance();
+    const uint64_t columns = size[0] + 1;
+    m_tiles.reserve(columns*(size[1] + 1));
+    m_pending.clear();
+    for (uint64_t j = 0; j<=size[1]; ++j)
+    {
+        for (uint64_t i = 0; i<=size[0]; ++i)
+        {
+            const int64_t oi = int64_t(i) + shift[0];
+            const int64_t oj = int64_t(j) + shift[1];
+            if (overlap && oi >= 0 && oj >= 0 && uint64_t(oi) <= size[0] && uint64_t(oj) <= size[1])
+            {
+                VisibleTile & kept = tiles[uint64_t(oj)*columns + uint64_t(oi)];
+                kept.i = i;
+                kept.j = j;
+                if (kept.draw != kept.tile)
+                {
+                    m_pending.push_back(m_tiles.size());
+                }
+                m_tiles.push_back(kept);
+                kept.tile = NULL;
+                continue;
+            }
+
+            Tile * current;
+            if (i > 0)
+            {
+                current = factory->get_neighbour(loader, *m_tiles.back().tile, 1, 0);
+            }
+            else if (j > 0)
+            {
+                current = factory->get_neighbour(loader, *m_tiles[m_tiles.size() - columns].tile, 0, 1);
+            }
+            else
+            {
+                current = factory->get_tile(loader, z, tile[0]%levelSize, tile[1]%levelSize);
+            }
+            factory->acquire(loader, current);
+            m_entered.push_back(current);
+            m_pending.push_back(m_tiles.size());
+            m_tiles.push_back(VisibleTile{current, i, j, NULL, {0, 0}, {1, 1}});
+        }
+    }
+
+    // Only the cells that entered, or were still waiting, are resolved
+    resolve(loader);
+
+    // Let go of the old cells once the new ones are held, so that
+    // tiles in both stay put
+    for (const auto & i : tiles)
+    {
+        if (i.tile)
+        {
+            m_left.push_back(i.tile);
+            leave(*previous, i);
+        }
+    }
+
+    return !m_entered.empty() || !m_left.empty();
+}
+
+void VisibleSet::resolve(Loader & loader)
+{
+    m_uploads = loader.uploads();
+
+    TileFactory * factory = TileFactory::instance();
+    size_t waiting = 0;
+    for (size_t k : m_pending)
+    {
+        // If it doesn't exist or hasn't loaded yet,
+        // look for an ancestor
+        VisibleTile & i = m_tiles[k];
+        i.minUV[0] = i.minUV[1] = 0;
+        i.maxUV[0] = i.maxUV[1] = 1;
+        Tile * current = i.tile;
+        while (current && !loader.loaded(*current))
+        {
+            current = current->get_parent(loader, i.minUV, i.maxUV);
+        }
+
+        // Held while drawn
+        if (current != i.draw)
+        {
+            if (current)
+            {
+                factory->acquire(loader, current);
+            }
+            if (i.draw)
+            {
+                factory->unuse(loader, i.draw);
+            }
+            i.draw = current;
+        }
+
+        // Cells drawn from their own tile are done with
+        if (current != i.tile)
+        {
+            m_pending[waiting++] = k;
+        }
+    }
+    m_pending.resize(waiting);
+}
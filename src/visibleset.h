@@ -0,0 +1,111 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class Loader;
+class Tile;
+
+// Compute the bottom left tile, and tile grid size
+extern void visibleBounds(uint64_t width, uint64_t height, uint64_t bits, uint64_t z, uint64_t x, uint64_t y, uint64_t tile[2], uint64_t size[2]);
+
+/**
+ * @brief a tile of the visible grid, and the texture to draw for it
+ */
+struct VisibleTile
+{
+    Tile   * tile;
+    uint64_t i;          // column, from the bottom left of the grid
+    uint64_t j;          // row, from the bottom left of the grid
+
+    Tile   * draw;       // tile or loaded ancestor, NULL if nothing loaded
+    float    minUV[2];
+    float    maxUV[2];
+};
+
+/**
+ * @brief tracks the grid of tiles visible for a Loader
+ *
+ * The grid only changes when the camera crosses a tile boundary or the
+ * zoom level or window size changes.  Panning keeps the cells still in
+ * view and looks up only those that entered, mostly by slab arithmetic
+ * from their neighbours.  Tiles are created, and so loaded, by
+ * TileFactory as they first enter the grid.  Ancestors are looked for
+ * only for cells whose own tile isn't loaded yet, again when something
+ * is uploaded.
+ *
+ * The tiles of the grid, and the ancestors drawn in their place, are
+ * held in the TileFactory until they leave, so that only those may be
+ * released by TileFactory::collect.
+ */
+class VisibleSet
+{
+public:
+    VisibleSet();
+    ~VisibleSet();
+
+    // Update for the bottom left tile and grid size from visibleBounds.
+    // Returns true if the set of tiles changed.
+    bool update(Loader & loader, uint16_t z, const uint64_t tile[2], const uint64_t size[2]);
+
+    // Let go of every tile, before the loader or TileFactory goes
+    void clear();
+
+    const std::vector<VisibleTile> & tiles()   const { return m_tiles;   }
+
+    // Tiles of the cells that entered and left the grid with the last
+    // update.  Where a small level wraps around, a tile may be in both.
+    const std::vector<Tile *>      & entered() const { return m_entered; }
+    const std::vector<Tile *>      & left()    const { return m_left;    }
+
+    uint16_t zoom() const { return m_zoom; }
+
+    // Bottom left tile of the grid, before wrapping
+    uint64_t origin(int i) const { return m_tile[i]; }
+    uint64_t columns() const { return m_size[0] + 1; }
+    uint64_t rows()    const { return m_size[1] + 1; }
+
+private:
+    VisibleSet(const VisibleSet &) = delete;
+    VisibleSet & operator=(const VisibleSet &) = delete;
+
+    void resolve(Loader & loader);
+    void leave(Loader & loader, const VisibleTile & cell);
+
+    Loader * m_loader;
+    uint16_t m_zoom;
+    uint64_t m_tile[2];
+    uint64_t m_size[2];
+    uint64_t m_uploads;
+
+    std::vector<VisibleTile> m_tiles;
+    std::vector<Tile *>      m_entered;
+    std::vector<Tile *>      m_left;
+
+    // Cells drawn from an ancestor, or nothing, for now
+    std::vector<size_t>      m_pending;
+};
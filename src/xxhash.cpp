@@ -0,0 +1,120 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstring>
+
+#include "xxhash.h"
+
+static const uint64_t prime1 = 11400714785074694791ull;
+static const uint64_t prime2 = 14029467366897019727ull;
+static const uint64_t prime3 =  1609587929392839161ull;
+static const uint64_t prime4 =  9650029242287828579ull;
+static const uint64_t prime5 =  2870177450012600261ull;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little endian loads, whatever the alignment
+static inline uint64_t read64(const uint8_t * p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v |= uint64_t(p[i]) << (8*i);
+    }
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t * p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input)
+{
+    acc += input*prime2;
+    acc = rotl(acc, 31);
+    return acc*prime1;
+}
+
+static inline uint64_t merge(uint64_t acc, uint64_t val)
+{
+    acc ^= round(0, val);
+    return acc*prime1 + prime4;
+}
+
+uint64_t xxhash64(const void * data, size_t size, uint64_t seed)
+{
+    const uint8_t * p = static_cast<const uint8_t *>(data);
+    const uint8_t * const end = p + size;
+    uint64_t h;
+
+    // Four lanes of 8 bytes at a time
+    if (size >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        const uint8_t * const limit = end - 32;
+        do {
+            v1 = round(v1, read64(p));      p += 8;
+            v2 = round(v2, read64(p));      p += 8;
+            v3 = round(v3, read64(p));      p += 8;
+            v4 = round(v4, read64(p));      p += 8;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + prime5;
+    }
+    h += uint64_t(size);
+
+    // The remainder
+    for (; p + 8 <= end; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27)*prime1 + prime4;
+    }
+    if (p + 4 <= end) {
+        h ^= uint64_t(read32(p))*prime1;
+        h = rotl(h, 23)*prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= (*p)*prime5;
+        h = rotl(h, 11)*prime1;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,255 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <curl/curl.h>
+
+#include "loader.h"
+#include "origin.h"
+#include "tile.h"
+#include "mockorigin.h"
+#include "options.h"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * @brief loader that checks tiles against the origin instead of decoding
+ *
+ * Everything up to the disk cache is the real loader: the I/O pool,
+ * curl, retries and the cache itself.
+ */
+class CheckLoader : public Loader
+{
+public:
+    CheckLoader(const MockOrigin & origin, const std::string & dir, std::vector<Tile> & tiles)
+    : Loader(false, true, 30, "http://127.0.0.1:" + std::to_string(origin.port()) + "/", ".png", dir),
+      m_origin(origin), m_tiles(tiles), m_start(tiles.size()), m_finish(tiles.size())
+    {
+    }
+
+    ~CheckLoader()
+    {
+        // Checking uses the counts and mutex below
+        finish_tasks();
+    }
+
+    void load_all()
+    {
+        for (size_t i = 0; i < m_tiles.size(); ++i) {
+            m_start[i] = Clock::now();
+            load_image(m_tiles[i]);
+        }
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]() { return m_finished == m_tiles.size(); });
+    }
+
+    // Tile latencies in milliseconds, of those that arrived
+    std::vector<double> latencies() const
+    {
+        std::vector<double> ms;
+        for (size_t i = 0; i < m_tiles.size(); ++i) {
+            if (m_finish[i] != Clock::time_point()) {
+                ms.push_back(std::chrono::duration<double, std::milli>(m_finish[i] - m_start[i]).count());
+            }
+        }
+        std::sort(ms.begin(), ms.end());
+        return ms;
+    }
+
+    size_t correct() const { return m_correct; }
+    size_t corrupt() const { return m_corrupt; }
+    size_t failed()  const { return m_failed; }
+
+protected:
+    void decode_image(Tile * tile, const Cached & cached) override
+    {
+        const std::string filename = cache_filename(*tile);
+        const bool ok = std::string(cached.data.begin(), cached.data.end()) == m_origin.tile("/" + tile->get_filename(false, true, ".png"));
+        if (!ok) {
+            std::cerr << "Corrupt: " << filename << std::endl;
+        }
+        finish(tile, ok ? &m_correct : &m_corrupt, true);
+    }
+
+    void download_failed(Tile * tile) override
+    {
+        finish(tile, &m_failed, false);
+    }
+
+private:
+    void finish(Tile * tile, size_t * count, bool arrived)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (arrived) {
+            m_finish[tile - &m_tiles[0]] = Clock::now();
+        }
+        ++*count;
+        if (++m_finished == m_tiles.size()) {
+            m_done.notify_all();
+        }
+    }
+
+    const MockOrigin &             m_origin;
+    std::vector<Tile> &            m_tiles;
+    std::vector<Clock::time_point> m_start;
+    std::vector<Clock::time_point> m_finish;
+
+    std::mutex                     m_mutex;
+    std::condition_variable        m_done;
+    size_t                         m_finished = 0;
+    size_t                         m_correct = 0;
+    size_t                         m_corrupt = 0;
+    size_t                         m_failed = 0;
+};
+
+static double percentile(const std::vector<double> & sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    return sorted[std::min<size_t>(sorted.size() - 1, size_t(p*sorted.size()))];
+}
+
+static void report(const char * name, const CheckLoader & loader, double seconds)
+{
+    const std::vector<double> ms = loader.latencies();
+    std::cout << name << ": " << ms.size() << " tiles in " << seconds << " s, "
+              << ms.size()/seconds << " tiles/s" << std::endl;
+    std::cout << "  latency ms p50 " << percentile(ms, 0.5)
+              << " p90 " << percentile(ms, 0.9)
+              << " p99 " << percentile(ms, 0.99)
+              << " max " << (ms.empty() ? 0.0 : ms.back()) << std::endl;
+    std::cout << "  " << loader.correct() << " correct, " << loader.corrupt() << " corrupt, "
+              << loader.failed() << " failed" << std::endl;
+}
+
+/**
+ * Pushes tiles through the loader from a local mock origin, with faults:
+ *
+ *   slippymap3d_loadtest --tiles 5000 --latency 50 --dist lognormal --500 0.05 --truncate 0.02
+ *
+ * The first pass downloads into an empty cache, the second reads back
+ * whatever was cached with the origin failing everything, so any tile
+ * found in the cache must be intact.
+ */
+int main(int argc, char * argv[])
+{
+    size_t tiles = 2000;
+    std::string dir = "./loadtest/";
+    MockOrigin::Faults faults;
+    std::string fixtures;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--tiles") && i + 1 < argc) {
+            tiles = std::max(std::atoi(argv[++i]), 1);
+        } else if (!std::strcmp(argv[i], "--cache") && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (!parse_fault_option(argc, argv, i, faults, fixtures)) {
+            std::cerr << "Usage: " << argv[0] << " [--tiles N] [--cache DIR] " << fault_options_usage << std::endl;
+            return 1;
+        }
+    }
+
+    if (curl_global_init(CURL_GLOBAL_ALL) != 0) {
+        std::cerr << "Could not initialize libcurl. " << std::endl;
+        return 1;
+    }
+
+    boost::filesystem::remove_all(dir);
+
+    // A square of zoom 16 tiles
+    std::vector<Tile> set;
+    set.reserve(tiles);
+    const uint64_t side = uint64_t(std::ceil(std::sqrt(double(tiles))));
+    for (size_t i = 0; i < tiles; ++i) {
+        set.emplace_back(16, 30000 + i % side, 20000 + i / side, 0);
+    }
+
+    size_t corrupt = 0;
+
+    {
+        MockOrigin origin(0, faults, fixtures);
+        CheckLoader loader(origin, dir, set);
+
+        const uint64_t retries = Loader::retries();
+        const uint64_t failures = Loader::failures();
+        const Clock::time_point start = Clock::now();
+        loader.load_all();
+        loader.wait();
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        report("download", loader, seconds);
+        corrupt += loader.corrupt();
+        std::cout << "  " << Loader::retries() - retries << " retries, "
+                  << Loader::failures() - failures << " given up" << std::endl;
+        std::cout << "  origin " << origin.requests() << " requests, "
+                  << origin.served() << " served, "
+                  << origin.notFound() << " 404, "
+                  << origin.tooMany() << " 429, "
+                  << origin.serverErrors() << " 500, "
+                  << origin.truncated() << " truncated, "
+                  << origin.slow() << " slow" << std::endl;
+        Origin::report(std::cout);
+    }
+
+    {
+        MockOrigin::Faults down;
+        down.notFound = 1.0;
+        MockOrigin origin(0, down, fixtures);
+        CheckLoader loader(origin, dir, set);
+
+        const Clock::time_point start = Clock::now();
+        loader.load_all();
+        loader.wait();
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        report("cached", loader, seconds);
+        corrupt += loader.corrupt();
+    }
+
+    // Nothing left half written
+    size_t partial = 0;
+    for (boost::filesystem::recursive_directory_iterator i(dir), end; i != end; ++i) {
+        if (i->path().extension() == ".part") {
+            ++partial;
+        }
+    }
+    std::cout << "  " << partial << " partial files" << std::endl;
+
+    return partial || corrupt ? 1 : 0;
+}
@@ -0,0 +1,342 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include <zlib.h>
+
+#include "mockorigin.h"
+
+using boost::asio::ip::tcp;
+
+MockOrigin::MockOrigin(unsigned short port, const Faults & faults, const std::string & fixtures)
+: m_faults(faults), m_fixtures(fixtures),
+  m_acceptor(m_service, tcp::endpoint(tcp::v4(), port)),
+  m_port(m_acceptor.local_endpoint().port()),
+  m_stop(false),
+  m_random(std::random_device()()),
+  m_tokens(std::max(faults.rateLimit, 1.0)), m_refilled(0.0),
+  m_requests(0), m_served(0), m_notFound(0), m_tooMany(0), m_serverErrors(0), m_truncated(0), m_slow(0)
+{
+    m_thread = std::thread(&MockOrigin::accept, this);
+}
+
+MockOrigin::~MockOrigin()
+{
+    stop();
+    m_thread.join();
+
+    // Wait for the connection threads to notice
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_sockets.empty()) {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void MockOrigin::stop()
+{
+    boost::system::error_code ignored;
+    if (!m_stop.exchange(true)) {
+        // A blocking accept isn't woken by closing, connect instead
+        Socket wake(m_service);
+        wake.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), m_port), ignored);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto & i : m_sockets) {
+        i->shutdown(tcp::socket::shutdown_both, ignored);
+    }
+}
+
+void MockOrigin::accept()
+{
+    while (!m_stop) {
+        std::shared_ptr<Socket> socket(new Socket(m_service));
+        boost::system::error_code error;
+        m_acceptor.accept(*socket, error);
+        if (error || m_stop) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_sockets.insert(socket);
+        std::thread(&MockOrigin::serve, this, socket).detach();
+    }
+
+    boost::system::error_code ignored;
+    m_acceptor.close(ignored);
+}
+
+void MockOrigin::serve(std::shared_ptr<Socket> socket)
+{
+    boost::asio::streambuf in;
+    boost::system::error_code error;
+
+    while (!m_stop) {
+        const size_t size = boost::asio::read_until(*socket, in, "\r\n\r\n", error);
+        if (error) {
+            break;
+        }
+
+        std::string head(boost::asio::buffers_begin(in.data()), boost::asio::buffers_begin(in.data()) + size);
+        in.consume(size);
+
+        std::string method, target;
+        std::istringstream(head) >> method >> target;
+        if (!respond(*socket, target.substr(0, target.find('?')))) {
+            break;
+        }
+    }
+
+    socket->close(error);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sockets.erase(socket);
+}
+
+double MockOrigin::latency()
+{
+    const double mean = m_faults.latencyMs;
+    if (mean <= 0.0) {
+        return 0.0;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    switch (m_faults.latency) {
+        case Faults::UNIFORM:
+            return std::uniform_real_distribution<double>(0.0, 2.0*mean)(m_random);
+        case Faults::EXPONENTIAL:
+            return std::exponential_distribution<double>(1.0/mean)(m_random);
+        case Faults::LOGNORMAL: {
+            // Long tail, sigma of 1 with the given mean
+            const double sigma = 1.0;
+            return std::lognormal_distribution<double>(std::log(mean) - sigma*sigma/2.0, sigma)(m_random);
+        }
+        default:
+            return mean;
+    }
+}
+
+// Write, a slice at a time to keep within the bandwidth
+static bool send(tcp::socket & socket, const char * data, size_t size, double bandwidth)
+{
+    boost::system::error_code error;
+    if (bandwidth <= 0.0) {
+        boost::asio::write(socket, boost::asio::buffer(data, size), error);
+        return !error;
+    }
+
+    // Twenty slices a second
+    const size_t slice = std::max<size_t>(size_t(bandwidth/20.0), 1);
+    for (size_t i = 0; i < size; i += slice) {
+        const size_t n = std::min(slice, size - i);
+        boost::asio::write(socket, boost::asio::buffer(data + i, n), error);
+        if (error) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(n/bandwidth));
+    }
+    return true;
+}
+
+static std::string header(int status, const char * reason, size_t length, int retryAfter = 0)
+{
+    std::ostringstream h;
+    h << "HTTP/1.1 " << status << ' ' << reason << "\r\n";
+    h << "Content-Type: " << (status == 200 ? "image/png" : "text/plain") << "\r\n";
+    if (retryAfter) {
+        h << "Retry-After: " << retryAfter << "\r\n";
+    }
+    h << "Content-Length: " << length << "\r\n\r\n";
+    return h.str();
+}
+
+bool MockOrigin::respond(Socket & socket, const std::string & path)
+{
+    ++m_requests;
+
+    const double delay = latency();
+    if (delay > 0.0) {
+        std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(delay));
+    }
+
+    double r;
+    bool limited = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        r = std::uniform_real_distribution<double>(0.0, 1.0)(m_random);
+
+        // Token bucket, with a second's worth of burst
+        if (m_faults.rateLimit > 0.0) {
+            const double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            if (m_refilled > 0.0) {
+                m_tokens = std::min(m_tokens + (now - m_refilled)*m_faults.rateLimit, std::max(m_faults.rateLimit, 1.0));
+            }
+            m_refilled = now;
+            if (m_tokens < 1.0) {
+                limited = true;
+            } else {
+                m_tokens -= 1.0;
+            }
+        }
+    }
+
+    const std::string body = tile(path);
+
+    // Over the limit, come back in a second
+    if (limited) {
+        ++m_tooMany;
+        const std::string text = "Too Many Requests\n";
+        const std::string response = header(429, "Too Many Requests", text.size(), 1) + text;
+        return send(socket, response.data(), response.size(), 0.0);
+    }
+
+    // Errors
+    int status = 0;
+    const char * reason = nullptr;
+    if (body.empty() || (r -= m_faults.notFound) < 0.0) {
+        ++m_notFound;
+        status = 404;
+        reason = "Not Found";
+    } else if ((r -= m_faults.tooMany) < 0.0) {
+        ++m_tooMany;
+        status = 429;
+        reason = "Too Many Requests";
+    } else if ((r -= m_faults.serverError) < 0.0) {
+        ++m_serverErrors;
+        status = 500;
+        reason = "Internal Server Error";
+    }
+    if (status) {
+        const std::string text = std::string(reason) + "\n";
+        const std::string response = header(status, reason, text.size()) + text;
+        return send(socket, response.data(), response.size(), 0.0);
+    }
+
+    const std::string head = header(200, "OK", body.size());
+    if (!send(socket, head.data(), head.size(), 0.0)) {
+        return false;
+    }
+
+    // Half the promised body, then hang up
+    if ((r -= m_faults.truncated) < 0.0) {
+        ++m_truncated;
+        send(socket, body.data(), body.size()/2, m_faults.bandwidth);
+        return false;
+    }
+
+    // A byte a second, for as long as the client waits
+    if ((r -= m_faults.slowLoris) < 0.0) {
+        ++m_slow;
+        for (size_t i = 0; i < body.size() && !m_stop; ++i) {
+            if (!send(socket, body.data() + i, 1, 0.0)) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        return !m_stop;
+    }
+
+    ++m_served;
+    return send(socket, body.data(), body.size(), m_faults.bandwidth);
+}
+
+std::string MockOrigin::tile(const std::string & path) const
+{
+    if (m_fixtures.empty()) {
+        return synthetic_tile(path);
+    }
+
+    // Nothing outside the fixtures
+    if (path.find("..") != std::string::npos) {
+        return std::string();
+    }
+    std::ifstream file(m_fixtures + path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void chunk(std::string & png, const char * type, const std::string & data)
+{
+    const uint32_t length = data.size();
+    const char size[4] = { char(length >> 24), char(length >> 16), char(length >> 8), char(length) };
+    png.append(size, 4);
+
+    std::string body = std::string(type, 4) + data;
+    png += body;
+
+    const uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(body.data()), body.size());
+    const char check[4] = { char(crc >> 24), char(crc >> 16), char(crc >> 8), char(crc) };
+    png.append(check, 4);
+}
+
+std::string MockOrigin::synthetic_tile(const std::string & path)
+{
+    // FNV-1a of the path for the colour
+    uint32_t hash = 2166136261u;
+    for (char c : path) {
+        hash = (hash ^ uint8_t(c)) * 16777619u;
+    }
+    const uint8_t rgb[3] = { uint8_t(hash), uint8_t(hash >> 8), uint8_t(hash >> 16) };
+
+    // 256x256 RGB with a darker border
+    const uint32_t size = 256;
+    std::string pixels;
+    pixels.reserve(size*(1 + size*3));
+    for (uint32_t y = 0; y < size; ++y) {
+        pixels += char(0);
+        for (uint32_t x = 0; x < size; ++x) {
+            const bool border = x == 0 || y == 0;
+            for (int i = 0; i < 3; ++i) {
+                pixels += char(border ? rgb[i]/2 : rgb[i]);
+            }
+        }
+    }
+
+    uLongf compressedSize = compressBound(pixels.size());
+    std::string compressed(compressedSize, '\0');
+    compress(reinterpret_cast<Bytef *>(&compressed[0]), &compressedSize, reinterpret_cast<const Bytef *>(pixels.data()), pixels.size());
+    compressed.resize(compressedSize);
+
+    const char ihdr[13] = {
+        0, 0, char(size >> 8), char(size),
+        0, 0, char(size >> 8), char(size),
+        8, 2, 0, 0, 0                          // 8 bit RGB
+    };
+
+    std::string png("\x89PNG\r\n\x1a\n", 8);
+    chunk(png, "IHDR", std::string(ihdr, sizeof(ihdr)));
+    chunk(png, "IDAT", compressed);
+    chunk(png, "IEND", std::string());
+    return png;
+}
@@ -0,0 +1,122 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief local tile origin with injected faults, for testing the loader
+ *
+ * Serves any {a}/{b}/{c} path, either from a fixture directory or as a
+ * small PNG generated from the path.  Each response can be delayed,
+ * throttled, refused with an error, cut short or dripped out slowly.
+ */
+class MockOrigin
+{
+public:
+    struct Faults
+    {
+        enum Latency { FIXED, UNIFORM, EXPONENTIAL, LOGNORMAL };
+
+        Latency latency     = FIXED;
+        double  latencyMs   = 0.0;   // mean delay before responding
+        double  bandwidth   = 0.0;   // bytes per second per response, 0 for no limit
+
+        // Probability of each fault, per request
+        double  notFound    = 0.0;   // 404
+        double  tooMany     = 0.0;   // 429
+        double  serverError = 0.0;   // 500
+        double  truncated   = 0.0;   // close after half the body
+        double  slowLoris   = 0.0;   // a byte a second
+
+        // Requests per second before 429 with Retry-After, 0 for no limit
+        double  rateLimit   = 0.0;
+    };
+
+    // Port 0 for any free port
+    MockOrigin(unsigned short port, const Faults & faults, const std::string & fixtures = std::string());
+    ~MockOrigin();
+
+    unsigned short port() const { return m_port; }
+
+    void stop();
+
+    uint64_t requests()     const { return m_requests; }
+    uint64_t served()       const { return m_served; }
+    uint64_t notFound()     const { return m_notFound; }
+    uint64_t tooMany()      const { return m_tooMany; }
+    uint64_t serverErrors() const { return m_serverErrors; }
+    uint64_t truncated()    const { return m_truncated; }
+    uint64_t slow()         const { return m_slow; }
+
+    // Body for a path, the same every time
+    std::string tile(const std::string & path) const;
+
+    // PNG of a solid colour chosen by the path
+    static std::string synthetic_tile(const std::string & path);
+
+private:
+    MockOrigin(const MockOrigin &) = delete;
+
+    typedef boost::asio::ip::tcp::socket Socket;
+
+    void accept();
+    void serve(std::shared_ptr<Socket> socket);
+    bool respond(Socket & socket, const std::string & path);
+    double latency();
+
+    const Faults      m_faults;
+    const std::string m_fixtures;
+
+    boost::asio::io_service        m_service;
+    boost::asio::ip::tcp::acceptor m_acceptor;
+    unsigned short                 m_port;
+    std::thread                    m_thread;
+    std::atomic<bool>              m_stop;
+
+    // Open connections, closed by stop
+    std::mutex                        m_mutex;
+    std::set<std::shared_ptr<Socket>> m_sockets;
+    std::mt19937                      m_random;
+    double                            m_tokens;
+    double                            m_refilled;
+
+    std::atomic<uint64_t> m_requests;
+    std::atomic<uint64_t> m_served;
+    std::atomic<uint64_t> m_notFound;
+    std::atomic<uint64_t> m_tooMany;
+    std::atomic<uint64_t> m_serverErrors;
+    std::atomic<uint64_t> m_truncated;
+    std::atomic<uint64_t> m_slow;
+};
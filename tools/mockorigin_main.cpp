@@ -0,0 +1,79 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <pthread.h>
+
+#include "mockorigin.h"
+#include "options.h"
+
+/**
+ * Standalone mock origin, for example for the viewer:
+ *
+ *   slippymap3d_mockorigin --port 8090 --latency 200 --dist lognormal --500 0.05
+ *   SLIPPYMAP_BASEMAP_URL=http://localhost:8090/ slippymap3d
+ */
+int main(int argc, char * argv[])
+{
+    unsigned short port = 8090;
+    MockOrigin::Faults faults;
+    std::string fixtures;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--port") && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else if (!parse_fault_option(argc, argv, i, faults, fixtures)) {
+            std::cerr << "Usage: " << argv[0] << " [--port N] " << fault_options_usage << std::endl;
+            return 1;
+        }
+    }
+
+    // Blocked before the server threads start, to wait for below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    MockOrigin origin(port, faults, fixtures);
+    std::cout << "MockOrigin port " << origin.port() << std::endl;
+
+    // Until interrupted
+    int signal;
+    sigwait(&signals, &signal);
+
+    origin.stop();
+    std::cout << "MockOrigin " << origin.requests() << " requests, "
+              << origin.served() << " served, "
+              << origin.notFound() << " 404, "
+              << origin.tooMany() << " 429, "
+              << origin.serverErrors() << " 500, "
+              << origin.truncated() << " truncated, "
+              << origin.slow() << " slow" << std::endl;
+    return 0;
+}
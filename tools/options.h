@@ -0,0 +1,80 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Nigel Stewart (nigels@nigels.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "mockorigin.h"
+
+static const char * fault_options_usage =
+    "[--latency MS] [--dist fixed|uniform|exponential|lognormal] [--bandwidth BYTES] "
+    "[--404 P] [--429 P] [--500 P] [--truncate P] [--slow P] [--rate N] [--fixtures DIR]";
+
+// Mock origin options shared by the tools, advances i past any value
+static bool parse_fault_option(int argc, char * argv[], int & i, MockOrigin::Faults & faults, std::string & fixtures)
+{
+    const char * option = argv[i];
+    if (i + 1 >= argc) {
+        return false;
+    }
+    const char * value = argv[++i];
+
+    if (!std::strcmp(option, "--latency")) {
+        faults.latencyMs = std::atof(value);
+    } else if (!std::strcmp(option, "--dist")) {
+        if (!std::strcmp(value, "fixed")) {
+            faults.latency = MockOrigin::Faults::FIXED;
+        } else if (!std::strcmp(value, "uniform")) {
+            faults.latency = MockOrigin::Faults::UNIFORM;
+        } else if (!std::strcmp(value, "exponential")) {
+            faults.latency = MockOrigin::Faults::EXPONENTIAL;
+        } else if (!std::strcmp(value, "lognormal")) {
+            faults.latency = MockOrigin::Faults::LOGNORMAL;
+        } else {
+            return false;
+        }
+    } else if (!std::strcmp(option, "--bandwidth")) {
+        faults.bandwidth = std::atof(value);
+    } else if (!std::strcmp(option, "--404")) {
+        faults.notFound = std::atof(value);
+    } else if (!std::strcmp(option, "--429")) {
+        faults.tooMany = std::atof(value);
+    } else if (!std::strcmp(option, "--500")) {
+        faults.serverError = std::atof(value);
+    } else if (!std::strcmp(option, "--truncate")) {
+        faults.truncated = std::atof(value);
+    } else if (!std::strcmp(option, "--slow")) {
+        faults.slowLoris = std::atof(value);
+    } else if (!std::strcmp(option, "--rate")) {
+        faults.rateLimit = std::atof(value);
+    } else if (!std::strcmp(option, "--fixtures")) {
+        fixtures = value;
+    } else {
+        return false;
+    }
+    return true;
+}